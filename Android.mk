@@ -19,6 +19,13 @@ LOCAL_SRC_FILES := \
     extendedcommands.c \
     midnight.c \
     nandroid.c \
+    nandroid_gzip.c \
+    nandroid_journal.c \
+    nandroid_md5.c \
+    nandroid_queue.c \
+    nandroid_stats.c \
+    nandroid_stream.c \
+    nandroid_tar.c \
     ../../system/core/toolbox/reboot.c \
     edifyscripting.c \
     setprop.c
@@ -66,6 +73,7 @@ LOCAL_STATIC_LIBRARIES += libext4_utils libz
 LOCAL_STATIC_LIBRARIES += libminzip libunz libmincrypt
 
 LOCAL_STATIC_LIBRARIES += libedify libbusybox libclearsilverregex libmkyaffs2image libunyaffs liberase_image libdump_image libflash_image
+LOCAL_STATIC_LIBRARIES += libdedupe libcrypto_static
 
 LOCAL_STATIC_LIBRARIES += libcrecovery libflashutils libmtdutils libmmcutils libbmlutils 
 
@@ -77,10 +85,11 @@ LOCAL_STATIC_LIBRARIES += libminui libpixelflinger_static libpng libcutils
 LOCAL_STATIC_LIBRARIES += libstdc++ libc
 
 LOCAL_C_INCLUDES += system/extras/ext4_utils
+LOCAL_C_INCLUDES += external/openssl/include
 
 include $(BUILD_EXECUTABLE)
 
-RECOVERY_LINKS := edify busybox flash_image dump_image mkyaffs2image unyaffs erase_image nandroid reboot volume
+RECOVERY_LINKS := edify busybox flash_image dump_image mkyaffs2image unyaffs erase_image nandroid reboot volume dedupe
 
 # nc is provided by external/netcat
 RECOVERY_SYMLINKS := $(addprefix $(TARGET_RECOVERY_ROOT_OUT)/sbin/,$(RECOVERY_LINKS))
@@ -141,6 +150,22 @@ LOCAL_STATIC_LIBRARIES := libmincrypt libcutils libstdc++ libc
 
 include $(BUILD_EXECUTABLE)
 
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := nandroid_tar_test.c nandroid_tar.c nandroid_queue.c
+
+LOCAL_MODULE := nandroid_tar_test
+
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_C_INCLUDES += external/openssl/include
+
+LOCAL_STATIC_LIBRARIES := libcrypto_static libcutils libstdc++ libc
+
+include $(BUILD_EXECUTABLE)
+
 include $(commands_recovery_local_path)/dedupe/Android.mk
 
 include $(commands_recovery_local_path)/bmlutils/Android.mk
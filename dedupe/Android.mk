@@ -22,3 +22,12 @@ LOCAL_UNSTRIPPED_PATH := $(PRODUCT_OUT)/symbols/utilities
 LOCAL_MODULE_PATH := $(PRODUCT_OUT)/utilities
 LOCAL_FORCE_STATIC_EXECUTABLE := true
 include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := dedupe.c
+LOCAL_STATIC_LIBRARIES := libcrypto_static
+LOCAL_MODULE := libdedupe
+LOCAL_MODULE_TAGS := eng
+LOCAL_C_INCLUDES := external/openssl/include
+LOCAL_CFLAGS += -Dmain=dedupe_main
+include $(BUILD_STATIC_LIBRARY)
@@ -1,4 +1,6 @@
+#include <pthread.h>
 #include <stdio.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <openssl/md5.h>
 #include <openssl/sha.h>
@@ -6,164 +8,1183 @@
 #include <errno.h>
 #include <dirent.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <limits.h>
 
+// Files are read once, in pieces this large. Files that fit are hashed in
+// memory and only written if their blob is new.
+#define DEDUPE_BUFFER_SIZE (1024 * 1024)
+
+// With -c, files of DEDUPE_CHUNK_MIN_FILE and more are cut into chunks
+// where a rolling gear hash of the last 32 bytes has its top 16 bits
+// clear, so an edit only changes the chunks around it. Chunks are blobs
+// like whole files, and such a file is a "c" entry of the manifest with a
+// chunk per blob. These values decide the chunk boundaries; changing them
+// stores every chunked file anew.
+#define DEDUPE_CHUNK_MIN_FILE   DEDUPE_BUFFER_SIZE
+#define DEDUPE_CHUNK_MIN        (16 * 1024)
+#define DEDUPE_CHUNK_MAX        (256 * 1024)
+#define DEDUPE_CHUNK_MASK       0xffff0000
+
+struct CHUNK {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    uint32_t len;
+    int is_new;
+};
+
+// Manifests are binary, in the byte order of the device (little endian).
+// After the header come the entries in the order the tree was walked, the
+// chunk table, an index of the entries sorted by path, and the strings:
+//
+//   header   MANIFEST_HEADER, with the offset and size of every table
+//   entries  MANIFEST_ENTRY[entry_count]
+//   chunks   MANIFEST_CHUNK[chunk_count]; the blobs of a file are the
+//            chunk_count chunks from first_chunk on, one for an "f" entry
+//   index    uint32_t[entry_count], entry numbers sorted by path
+//   strings  nul terminated paths and symlink targets, starting with ""
+//
+// A manifest is mapped and checked once, then read in place; a path is
+// found with a binary search on the index. Text manifests of older
+// versions are still read, and "dedupe convert" rewrites them.
+#define MANIFEST_MAGIC      "DEDUPEMF"
+#define MANIFEST_VERSION    1
+// longest line of a text manifest, a symlink with its target
+#define MANIFEST_TEXT_LINE  (PATH_MAX * 2 + 128)
+
+struct MANIFEST_HEADER {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint32_t entry_count;
+    uint32_t chunk_count;
+    uint32_t strings_size;
+    uint32_t reserved;
+    uint64_t entries_offset;
+    uint64_t chunks_offset;
+    uint64_t index_offset;
+    uint64_t strings_offset;
+};
+
+struct MANIFEST_ENTRY {
+    uint32_t type;          // 'd', 'l', 'f' or 'c'
+    uint32_t mode;          // permission bits
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t path;          // offsets in the strings
+    uint32_t link;
+    uint32_t first_chunk;
+    uint32_t chunk_count;
+    uint64_t size;
+};
+
+struct MANIFEST_CHUNK {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    uint64_t size;
+};
+
+// The tables of a manifest being written, or read from a text manifest.
+struct MANIFEST_BUILDER {
+    struct MANIFEST_ENTRY *entries;
+    uint32_t entry_count;
+    uint32_t entry_alloc;
+    struct MANIFEST_CHUNK *chunks;
+    uint32_t chunk_count;
+    uint32_t chunk_alloc;
+    char *strings;
+    uint32_t strings_size;
+    uint32_t strings_alloc;
+};
+
+// A manifest ready to be read: the tables point either into the mapped
+// file or into the builder.
+struct MANIFEST {
+    const struct MANIFEST_ENTRY *entries;
+    uint32_t entry_count;
+    const struct MANIFEST_CHUNK *chunks;
+    uint32_t chunk_count;
+    const uint32_t *index;
+    const char *strings;
+    uint32_t strings_size;
+    void *map;
+    size_t map_size;
+    struct MANIFEST_BUILDER builder;
+    uint32_t *sorted;
+};
+
+// With -j N, N workers hash and store (or extract) the files while the
+// main thread walks the tree (or reads the manifest). Without it the jobs
+// run inline.
+#define DEDUPE_MAX_JOBS     16
+#define DEDUPE_QUEUE_SIZE   64
+// manifest records held back until the files before them are stored
+#define DEDUPE_MAX_PENDING  1024
+
+struct DEDUPE_POOL;
+
+struct DEDUPE_WORKER {
+    struct DEDUPE_POOL *pool;
+    pthread_t thread;
+    unsigned char *buffer;
+    int index;
+};
+
+typedef int (*dedupe_job_func)(struct DEDUPE_WORKER *worker, void *job);
+
+struct DEDUPE_POOL {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    void *queue[DEDUPE_QUEUE_SIZE];
+    int head;
+    int count;
+    int stop;
+    int error;
+    int worker_count;
+    struct DEDUPE_WORKER workers[DEDUPE_MAX_JOBS];
+    dedupe_job_func run;
+    void *context;
+};
+
+// One manifest entry. Entries are added in the order the tree was walked,
+// a file's once its digest is known.
+struct MANIFEST_RECORD {
+    struct MANIFEST_RECORD *next;
+    char *path;
+    char *link;
+    char type;
+    unsigned int mode;
+    unsigned int uid;
+    unsigned int gid;
+    int is_file;
+    int chunked;
+    struct CHUNK *chunks;
+    int chunk_count;
+    off_t size;
+    int done;
+    int ret;
+    int is_new;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+};
+
+// Digests of the blobs in blob_dir, so a file that was stored before is
+// only hashed. Open addressing on the leading digest bytes, which are
+// uniformly distributed already; an all zero digest marks a free slot.
+struct DIGEST_SET {
+    unsigned char *slots;
+    size_t size;
+    size_t count;
+};
+
 typedef struct DEDUPE_STORE_CONTEXT {
     char blob_dir[PATH_MAX];
     FILE *output_manifest;
+    struct MANIFEST manifest;
+    char **excludes;
+    int exclude_count;
+    int chunking;
+    struct DIGEST_SET blobs;
+    struct DEDUPE_POOL pool;
+    struct MANIFEST_RECORD *first;
+    struct MANIFEST_RECORD *last;
+    int pending;
+    int files_stored;
+    int files_skipped;
+    long long bytes_stored;
+    long long bytes_saved;
 };
 
 static void usage(char** argv) {
-    fprintf(stderr, "usage: %s c input_directory blob_dir output_manifest\n", argv[0]);
-    fprintf(stderr, "usage: %s x input_manifest blob_dir output_directory\n", argv[0]);
+    fprintf(stderr, "usage: %s c [-j jobs] [-c] input_directory blob_dir output_manifest [exclude...]\n", argv[0]);
+    fprintf(stderr, "usage: %s x [-j jobs] input_manifest blob_dir output_directory\n", argv[0]);
+    fprintf(stderr, "usage: %s gc blob_dir [input_manifest...]\n", argv[0]);
+    fprintf(stderr, "usage: %s t input_manifest [path...]\n", argv[0]);
+    fprintf(stderr, "usage: %s convert input_manifest output_manifest\n", argv[0]);
 }
 
-static int copy_file(const char *dst, const char *src) {
-    char buf[4096];
-    int dstfd, srcfd, bytes_read, bytes_written, total_read = 0;
-    if (src == NULL)
-        return 1;
-    if (dst == NULL)
-        return 2;
-    
-    srcfd = open(src, O_RDONLY);
+static int write_fully(int fd, const unsigned char *data, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, data, len);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return 1;
+        data += w;
+        len -= w;
+    }
+    return 0;
+}
+
+// Appends all of 'src' to 'dstfd'.
+static int append_file(int dstfd, const char *src, unsigned char *buf, size_t size) {
+    ssize_t bytes_read;
+    int ret = 0;
+    int srcfd = open(src, O_RDONLY);
     if (srcfd < 0)
         return 3;
 
-    dstfd = open(dst, O_RDWR | O_CREAT | O_TRUNC, 0600);
-    if (dstfd < 0) {
-        close(srcfd);
+    while ((bytes_read = read(srcfd, buf, size)) != 0) {
+        if (bytes_read < 0 && errno == EINTR)
+            continue;
+        if (bytes_read < 0 || write_fully(dstfd, buf, bytes_read)) {
+            ret = 5;
+            break;
+        }
+    }
+    close(srcfd);
+    return ret;
+}
+
+static void digest_to_hex(const unsigned char *digest, char *hex) {
+    int j;
+    for (j = 0; j < SHA256_DIGEST_LENGTH; j++)
+        sprintf(&hex[(j*2)], "%02x", (int)digest[j]);
+    hex[(SHA256_DIGEST_LENGTH * 2)] = '\0';
+}
+
+// Writes the concatenation of the 'count' blobs of a file to 'dst'.
+static int copy_blobs(const char *dst, const char *blob_dir, const struct MANIFEST_CHUNK *chunks, uint32_t count, unsigned char *buf, size_t size) {
+    char blob[PATH_MAX];
+    char psum[SHA256_DIGEST_LENGTH * 2 + 1];
+    uint32_t i;
+    int ret = 0;
+    if (dst == NULL)
+        return 2;
+
+    int dstfd = open(dst, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (dstfd < 0)
         return 4;
+    for (i = 0; i < count && ret == 0; i++) {
+        digest_to_hex(chunks[i].digest, psum);
+        snprintf(blob, sizeof(blob), "%s/%s", blob_dir, psum);
+        ret = append_file(dstfd, blob, buf, size);
     }
+    if (close(dstfd) != 0 && ret == 0)
+        ret = 5;
+    return ret;
+}
+
+static void* pool_worker(void *cookie) {
+    struct DEDUPE_WORKER *worker = (struct DEDUPE_WORKER*) cookie;
+    struct DEDUPE_POOL *pool = worker->pool;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->count == 0 && !pool->stop)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        if (pool->count == 0)
+            break;
+        void *job = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % DEDUPE_QUEUE_SIZE;
+        pool->count--;
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+
+        int ret = pool->run(worker, job);
 
-    while (bytes_read = read(srcfd, buf, 4096)) {
-        total_read += bytes_read;
-        if (write(dstfd, buf, bytes_read) != bytes_read)
-            return 5;
+        pthread_mutex_lock(&pool->lock);
+        if (ret != 0 && pool->error == 0)
+            pool->error = ret;
+        pthread_cond_broadcast(&pool->cond);
     }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
 
-    close(dstfd);
-    close(srcfd);
-    
+// With fewer than two jobs, or if no thread can be started, the jobs run
+// on the caller with the first worker's buffer.
+static int pool_start(struct DEDUPE_POOL *pool, int jobs, dedupe_job_func run, void *context) {
+    int i;
+    memset(pool, 0, sizeof(*pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->run = run;
+    pool->context = context;
+    for (i = 0; i < (jobs > 1 ? jobs : 1); i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        pool->workers[i].buffer = (unsigned char*) malloc(DEDUPE_BUFFER_SIZE);
+        if (pool->workers[i].buffer == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+    }
+    for (i = 0; jobs > 1 && i < jobs; i++) {
+        if (pthread_create(&pool->workers[i].thread, NULL, pool_worker, &pool->workers[i]) != 0)
+            break;
+        pool->worker_count++;
+    }
     return 0;
 }
 
-static void do_sha256sum(FILE *mfile, unsigned char *rptr) {
-    char rdata[BUFSIZ];
-    int rsize;
-    SHA256_CTX c;
-    
-    SHA256_Init(&c);
-    while(!feof(mfile)) {
-        rsize = fread(rdata, sizeof(char), BUFSIZ, mfile);
-        if(rsize > 0) {
-            SHA256_Update(&c, rdata, rsize);
+// Returns the first error of any job so far.
+static int pool_submit(struct DEDUPE_POOL *pool, void *job) {
+    if (pool->worker_count == 0) {
+        int ret = pool->run(&pool->workers[0], job);
+        if (ret != 0 && pool->error == 0)
+            pool->error = ret;
+        return pool->error;
+    }
+    pthread_mutex_lock(&pool->lock);
+    while (pool->count == DEDUPE_QUEUE_SIZE)
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    pool->queue[(pool->head + pool->count) % DEDUPE_QUEUE_SIZE] = job;
+    pool->count++;
+    pthread_cond_broadcast(&pool->cond);
+    int error = pool->error;
+    pthread_mutex_unlock(&pool->lock);
+    return error;
+}
+
+// Runs what is queued, stops the workers and returns the first error.
+static int pool_finish(struct DEDUPE_POOL *pool) {
+    int i;
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->worker_count; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+    for (i = 0; i < DEDUPE_MAX_JOBS; i++)
+        free(pool->workers[i].buffer);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    return pool->error;
+}
+
+static int digest_is_empty(const unsigned char *slot) {
+    int j;
+    for (j = 0; j < SHA256_DIGEST_LENGTH; j++) {
+        if (slot[j] != 0)
+            return 0;
+    }
+    return 1;
+}
+
+// The slot holding 'digest', or the free slot it would go into.
+static size_t digest_slot(const struct DIGEST_SET *set, const unsigned char *digest) {
+    size_t hash = digest[0] | (digest[1] << 8) | (digest[2] << 16) | ((size_t)digest[3] << 24);
+    size_t i = hash & (set->size - 1);
+    for (;;) {
+        unsigned char *slot = set->slots + i * SHA256_DIGEST_LENGTH;
+        if (digest_is_empty(slot) || memcmp(slot, digest, SHA256_DIGEST_LENGTH) == 0)
+            return i;
+        i = (i + 1) & (set->size - 1);
+    }
+}
+
+static int digest_set_contains(const struct DIGEST_SET *set, const unsigned char *digest) {
+    if (set->size == 0)
+        return 0;
+    size_t i = digest_slot(set, digest);
+    return memcmp(set->slots + i * SHA256_DIGEST_LENGTH, digest, SHA256_DIGEST_LENGTH) == 0;
+}
+
+static int digest_set_add(struct DIGEST_SET *set, const unsigned char *digest) {
+    // kept at most half full, so lookups stay short
+    if ((set->count + 1) * 2 > set->size) {
+        struct DIGEST_SET grown;
+        size_t i;
+        grown.size = set->size ? set->size * 2 : 4096;
+        grown.count = set->count;
+        grown.slots = (unsigned char*) calloc(grown.size, SHA256_DIGEST_LENGTH);
+        if (grown.slots == NULL)
+            return 1;
+        for (i = 0; i < set->size; i++) {
+            unsigned char *slot = set->slots + i * SHA256_DIGEST_LENGTH;
+            if (!digest_is_empty(slot)) {
+                size_t j = digest_slot(&grown, slot);
+                memcpy(grown.slots + j * SHA256_DIGEST_LENGTH, slot, SHA256_DIGEST_LENGTH);
+            }
         }
+        free(set->slots);
+        *set = grown;
+    }
+    size_t i = digest_slot(set, digest);
+    unsigned char *slot = set->slots + i * SHA256_DIGEST_LENGTH;
+    if (memcmp(slot, digest, SHA256_DIGEST_LENGTH) != 0) {
+        memcpy(slot, digest, SHA256_DIGEST_LENGTH);
+        set->count++;
     }
+    return 0;
+}
 
-    SHA256_Final(rptr, &c);
+// Blob names are the lower case hex digest of their contents.
+static int parse_digest(const char *hex, unsigned char *digest) {
+    int i;
+    for (i = 0; i < SHA256_DIGEST_LENGTH * 2; i++) {
+        char c = hex[i];
+        int v;
+        if (c >= '0' && c <= '9')
+            v = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            v = c - 'a' + 10;
+        else
+            return 1;
+        if (i % 2 == 0)
+            digest[i / 2] = v << 4;
+        else
+            digest[i / 2] |= v;
+    }
+    return hex[i] != '\0';
 }
 
-static int do_sha256sum_file(const char* filename, unsigned char *rptr) {
-    FILE *f = fopen(filename, "rb");
-    if (f == NULL) {
-        fprintf(stderr, "Unable to open file: %s\n", filename);
+static int load_blob_digests(struct DIGEST_SET *set, const char *blob_dir) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    DIR *dp = opendir(blob_dir);
+    if (dp == NULL) {
+        fprintf(stderr, "Error opening directory: %s\n", blob_dir);
         return 1;
     }
-    do_sha256sum(f, rptr);
-    fclose(f);
+    struct dirent *ep;
+    while ((ep = readdir(dp)) != NULL) {
+        if (parse_digest(ep->d_name, digest) != 0)
+            continue;
+        if (digest_set_add(set, digest) != 0) {
+            fprintf(stderr, "Out of memory\n");
+            closedir(dp);
+            return 1;
+        }
+    }
+    closedir(dp);
     return 0;
 }
 
 static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* s);
 
-void print_stat(struct DEDUPE_STORE_CONTEXT *context, char type, struct stat st, const char *f) {
-    fprintf(context->output_manifest, "%c\t%o\t%d\t%d\t%s\t", type, st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID), st.st_uid, st.st_gid, f);
+// Makes room for one more of the 'count' items in 'table'.
+static int grow_table(void **table, uint32_t *alloc, uint32_t count, size_t size) {
+    if (count < *alloc)
+        return 0;
+    uint32_t grown_alloc = *alloc ? *alloc * 2 : 1024;
+    void *grown = grown_alloc > *alloc ? realloc(*table, (size_t)grown_alloc * size) : NULL;
+    if (grown == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    *table = grown;
+    *alloc = grown_alloc;
+    return 0;
+}
+
+static int builder_add_string(struct MANIFEST_BUILDER *b, const char *s, uint32_t *offset) {
+    size_t len = strlen(s) + 1;
+    if ((uint64_t)b->strings_size + len > b->strings_alloc) {
+        uint64_t grown_alloc = b->strings_alloc ? b->strings_alloc : 64 * 1024;
+        while (grown_alloc < (uint64_t)b->strings_size + len)
+            grown_alloc *= 2;
+        char *grown = grown_alloc <= UINT32_MAX ? (char*) realloc(b->strings, grown_alloc) : NULL;
+        if (grown == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        b->strings = grown;
+        b->strings_alloc = grown_alloc;
+    }
+    memcpy(b->strings + b->strings_size, s, len);
+    *offset = b->strings_size;
+    b->strings_size += len;
+    return 0;
+}
+
+static int builder_add_entry(struct MANIFEST_BUILDER *b, char type, unsigned int mode, unsigned int uid, unsigned int gid, const char *path, const char *link, uint64_t size) {
+    struct MANIFEST_ENTRY e;
+    memset(&e, 0, sizeof(e));
+    // offset 0 is the empty string, the link of everything but a symlink
+    if (b->strings_size == 0 && builder_add_string(b, "", &e.link))
+        return 1;
+    if (grow_table((void**)&b->entries, &b->entry_alloc, b->entry_count, sizeof(e)) ||
+            builder_add_string(b, path, &e.path) ||
+            (link != NULL && builder_add_string(b, link, &e.link)))
+        return 1;
+    e.type = type;
+    e.mode = mode;
+    e.uid = uid;
+    e.gid = gid;
+    e.first_chunk = b->chunk_count;
+    e.size = size;
+    b->entries[b->entry_count++] = e;
+    return 0;
+}
+
+// Adds a blob to the last entry.
+static int builder_add_chunk(struct MANIFEST_BUILDER *b, const unsigned char *digest, uint64_t size) {
+    if (grow_table((void**)&b->chunks, &b->chunk_alloc, b->chunk_count, sizeof(struct MANIFEST_CHUNK)))
+        return 1;
+    memcpy(b->chunks[b->chunk_count].digest, digest, SHA256_DIGEST_LENGTH);
+    b->chunks[b->chunk_count].size = size;
+    b->chunk_count++;
+    b->entries[b->entry_count - 1].chunk_count++;
+    return 0;
+}
+
+static const struct MANIFEST *sorting;
+
+static int compare_index(const void *a, const void *b) {
+    return strcmp(sorting->strings + sorting->entries[*(const uint32_t*)a].path,
+            sorting->strings + sorting->entries[*(const uint32_t*)b].path);
+}
+
+// Points the tables of 'm' at its builder, and sorts the index.
+static int manifest_use_builder(struct MANIFEST *m) {
+    struct MANIFEST_BUILDER *b = &m->builder;
+    uint32_t i;
+    m->entries = b->entries;
+    m->entry_count = b->entry_count;
+    m->chunks = b->chunks;
+    m->chunk_count = b->chunk_count;
+    m->strings = b->strings;
+    m->strings_size = b->strings_size;
+    m->sorted = (uint32_t*) malloc((b->entry_count + 1) * sizeof(uint32_t));
+    if (m->sorted == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (i = 0; i < b->entry_count; i++)
+        m->sorted[i] = i;
+    sorting = m;
+    qsort(m->sorted, b->entry_count, sizeof(uint32_t), compare_index);
+    m->index = m->sorted;
+    return 0;
 }
 
-static int store_file(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* f) {
-    printf("%s\n", f);
-    unsigned char sumdata[SHA256_DIGEST_LENGTH];
+static int manifest_write(const struct MANIFEST *m, FILE *f) {
+    struct MANIFEST_HEADER h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MANIFEST_MAGIC, sizeof(h.magic));
+    h.version = MANIFEST_VERSION;
+    h.entry_size = sizeof(struct MANIFEST_ENTRY);
+    h.entry_count = m->entry_count;
+    h.chunk_count = m->chunk_count;
+    h.strings_size = m->strings_size;
+    h.entries_offset = sizeof(h);
+    h.chunks_offset = h.entries_offset + (uint64_t)m->entry_count * sizeof(struct MANIFEST_ENTRY);
+    h.index_offset = h.chunks_offset + (uint64_t)m->chunk_count * sizeof(struct MANIFEST_CHUNK);
+    h.strings_offset = h.index_offset + (uint64_t)m->entry_count * sizeof(uint32_t);
+    if (fwrite(&h, sizeof(h), 1, f) != 1 ||
+            fwrite(m->entries, sizeof(struct MANIFEST_ENTRY), m->entry_count, f) != m->entry_count ||
+            fwrite(m->chunks, sizeof(struct MANIFEST_CHUNK), m->chunk_count, f) != m->chunk_count ||
+            fwrite(m->index, sizeof(uint32_t), m->entry_count, f) != m->entry_count ||
+            fwrite(m->strings, 1, m->strings_size, f) != m->strings_size)
+        return 1;
+    return 0;
+}
+
+static int table_fits(uint64_t offset, uint32_t count, size_t size, size_t align, size_t file_size) {
+    return offset % align == 0 && offset <= file_size && (file_size - offset) / size >= count;
+}
+
+// Checks every offset of a mapped manifest once, so that reading it later
+// never leaves the file.
+static int manifest_map(struct MANIFEST *m, int fd, size_t size, const char *file) {
+    uint32_t i;
+    m->map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m->map == MAP_FAILED) {
+        m->map = NULL;
+        fprintf(stderr, "Unable to map manifest %s\n", file);
+        return 1;
+    }
+    m->map_size = size;
+    const struct MANIFEST_HEADER *h = (const struct MANIFEST_HEADER*) m->map;
+    if (h->version != MANIFEST_VERSION || h->entry_size != sizeof(struct MANIFEST_ENTRY)) {
+        fprintf(stderr, "Unsupported manifest version %u in %s\n", h->version, file);
+        return 1;
+    }
+    if (!table_fits(h->entries_offset, h->entry_count, sizeof(struct MANIFEST_ENTRY), 8, size) ||
+            !table_fits(h->chunks_offset, h->chunk_count, sizeof(struct MANIFEST_CHUNK), 8, size) ||
+            !table_fits(h->index_offset, h->entry_count, sizeof(uint32_t), 4, size) ||
+            !table_fits(h->strings_offset, h->strings_size, 1, 1, size) ||
+            h->strings_size == 0)
+        goto corrupt;
+    m->entries = (const struct MANIFEST_ENTRY*) ((const char*) m->map + h->entries_offset);
+    m->entry_count = h->entry_count;
+    m->chunks = (const struct MANIFEST_CHUNK*) ((const char*) m->map + h->chunks_offset);
+    m->chunk_count = h->chunk_count;
+    m->index = (const uint32_t*) ((const char*) m->map + h->index_offset);
+    m->strings = (const char*) m->map + h->strings_offset;
+    m->strings_size = h->strings_size;
+    if (m->strings[m->strings_size - 1] != '\0')
+        goto corrupt;
+    for (i = 0; i < m->entry_count; i++) {
+        const struct MANIFEST_ENTRY *e = &m->entries[i];
+        int is_file = e->type == 'f' || e->type == 'c';
+        if ((e->type != 'd' && e->type != 'l' && !is_file) ||
+                e->path >= m->strings_size || e->link >= m->strings_size ||
+                (uint64_t)e->first_chunk + e->chunk_count > m->chunk_count ||
+                (e->type == 'f' ? e->chunk_count != 1 : !is_file && e->chunk_count != 0) ||
+                m->index[i] >= m->entry_count)
+            goto corrupt;
+        if (i > 0 && m->index[i - 1] < m->entry_count &&
+                strcmp(m->strings + m->entries[m->index[i - 1]].path, m->strings + m->entries[m->index[i]].path) > 0)
+            goto corrupt;
+    }
+    return 0;
+corrupt:
+    fprintf(stderr, "Corrupt manifest %s\n", file);
+    return 1;
+}
+
+// Splits a text manifest line at its tabs. Returns the number of fields.
+static int split_fields(char *line, char **fields, int max) {
+    int count = 0;
+    while (count < max) {
+        char *tab = strchr(line, '\t');
+        if (tab == NULL)
+            break;
+        *tab = '\0';
+        fields[count++] = line;
+        line = tab + 1;
+    }
+    return count;
+}
+
+// Reads a text manifest of older versions, a tab terminated line per
+// entry with the mode in octal:
+//
+//   d mode uid gid path
+//   l mode uid gid path target
+//   f mode uid gid path sha256 size
+//   c mode uid gid path size count, followed by count "sha256 length" lines
+static int manifest_read_text(struct MANIFEST_BUILDER *b, FILE *f, const char *file) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    char *fields[8];
+    int line_number = 0;
+    int ret = 1;
+    char *line = (char*) malloc(MANIFEST_TEXT_LINE);
+    if (line == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    while (fgets(line, MANIFEST_TEXT_LINE, f)) {
+        line_number++;
+        int count = split_fields(line, fields, 8);
+        if (count < 5 || strlen(fields[0]) != 1)
+            goto bad;
+        char type = fields[0][0];
+        unsigned int mode = strtoul(fields[1], NULL, 8);
+        unsigned int uid = strtoul(fields[2], NULL, 10);
+        unsigned int gid = strtoul(fields[3], NULL, 10);
+        const char *link = NULL;
+        uint64_t size = 0;
+        int chunks = 0;
+        int i;
+        switch (type) {
+            case 'd':
+                break;
+            case 'l':
+                if (count < 6)
+                    goto bad;
+                link = fields[5];
+                break;
+            case 'f':
+                if (count < 7 || parse_digest(fields[5], digest) != 0)
+                    goto bad;
+                size = strtoull(fields[6], NULL, 10);
+                break;
+            case 'c':
+                if (count < 7 || (chunks = atoi(fields[6])) < 0)
+                    goto bad;
+                size = strtoull(fields[5], NULL, 10);
+                break;
+            default:
+                goto bad;
+        }
+        if (builder_add_entry(b, type, mode, uid, gid, fields[4], link, size))
+            goto done;
+        if (type == 'f' && builder_add_chunk(b, digest, size))
+            goto done;
+        for (i = 0; i < chunks; i++) {
+            if (!fgets(line, MANIFEST_TEXT_LINE, f))
+                goto bad;
+            line_number++;
+            if (split_fields(line, fields, 2) != 2 || parse_digest(fields[0], digest) != 0)
+                goto bad;
+            if (builder_add_chunk(b, digest, strtoull(fields[1], NULL, 10)))
+                goto done;
+        }
+    }
+    if (ferror(f)) {
+        fprintf(stderr, "Error reading %s\n", file);
+        goto done;
+    }
+    ret = 0;
+    goto done;
+bad:
+    fprintf(stderr, "%s:%d: not a manifest line\n", file, line_number);
+done:
+    free(line);
+    return ret;
+}
+
+static void manifest_close(struct MANIFEST *m) {
+    if (m->map != NULL)
+        munmap(m->map, m->map_size);
+    free(m->builder.entries);
+    free(m->builder.chunks);
+    free(m->builder.strings);
+    free(m->sorted);
+    memset(m, 0, sizeof(*m));
+}
+
+// Maps a binary manifest, or reads a text one into memory.
+static int manifest_open(struct MANIFEST *m, const char *file) {
+    struct stat st;
+    char magic[sizeof(((struct MANIFEST_HEADER*)0)->magic)];
     int ret;
-    if (ret = do_sha256sum_file(f, sumdata)) {
-        fprintf(stderr, "Error calculating sha256sum of %s\n", f);
-        return ret; 
+    memset(m, 0, sizeof(*m));
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open manifest %s\n", file);
+        return 1;
     }
-    char psum[128];
-    int j;
-    for (j = 0; j < SHA256_DIGEST_LENGTH; j++)
-        sprintf(&psum[(j*2)], "%02x", (int)sumdata[j]);
-    psum[(SHA256_DIGEST_LENGTH * 2)] = '\0';
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(struct MANIFEST_HEADER) &&
+            read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+            memcmp(magic, MANIFEST_MAGIC, sizeof(magic)) == 0) {
+        ret = manifest_map(m, fd, st.st_size, file);
+        close(fd);
+    }
+    else {
+        FILE *f = lseek(fd, 0, SEEK_SET) == 0 ? fdopen(fd, "rb") : NULL;
+        if (f == NULL) {
+            fprintf(stderr, "Unable to read manifest %s\n", file);
+            close(fd);
+            return 1;
+        }
+        ret = manifest_read_text(&m->builder, f, file);
+        fclose(f);
+        if (ret == 0)
+            ret = manifest_use_builder(m);
+    }
+    if (ret != 0)
+        manifest_close(m);
+    return ret;
+}
+
+// Binary search on the index.
+static const struct MANIFEST_ENTRY* manifest_find(const struct MANIFEST *m, const char *path) {
+    uint32_t low = 0;
+    uint32_t high = m->entry_count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        const struct MANIFEST_ENTRY *e = &m->entries[m->index[mid]];
+        int cmp = strcmp(m->strings + e->path, path);
+        if (cmp == 0)
+            return e;
+        if (cmp < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return NULL;
+}
+
+// Prints an entry the way text manifests had it.
+static void print_entry(const struct MANIFEST *m, const struct MANIFEST_ENTRY *e) {
+    char psum[SHA256_DIGEST_LENGTH * 2 + 1];
+    uint32_t i;
+    printf("%c\t%o\t%u\t%u\t%s\t", (char)e->type, e->mode, e->uid, e->gid, m->strings + e->path);
+    switch (e->type) {
+        case 'l':
+            printf("%s\t\n", m->strings + e->link);
+            break;
+        case 'f':
+            digest_to_hex(m->chunks[e->first_chunk].digest, psum);
+            printf("%s\t%lld\t\n", psum, (long long)e->size);
+            break;
+        case 'c':
+            printf("%lld\t%u\t\n", (long long)e->size, e->chunk_count);
+            for (i = 0; i < e->chunk_count; i++) {
+                digest_to_hex(m->chunks[e->first_chunk + i].digest, psum);
+                printf("%s\t%lld\t\n", psum, (long long)m->chunks[e->first_chunk + i].size);
+            }
+            break;
+        default:
+            printf("\n");
+    }
+}
 
+// Hashes 'f' and stores it under its digest in a single read. Larger files
+// are written to a temporary blob while they are hashed, which is renamed
+// to the digest once it is known, or dropped if that blob exists already.
+static int hash_and_store(struct DEDUPE_STORE_CONTEXT *context, struct DEDUPE_WORKER *worker, const char *f, unsigned char *digest, int *is_new) {
+    char tmp_blob[PATH_MAX];
     char out_blob[PATH_MAX];
+    char psum[SHA256_DIGEST_LENGTH * 2 + 1];
+    unsigned char *buf = worker->buffer;
+    size_t have = 0;
+    ssize_t len;
+    int dstfd = -1;
+    int ret = 1;
+    SHA256_CTX c;
+
+    *is_new = 0;
+    int srcfd = open(f, O_RDONLY);
+    if (srcfd < 0) {
+        fprintf(stderr, "Unable to open file: %s\n", f);
+        return 1;
+    }
+    sprintf(tmp_blob, "%s/.incoming-%d-%d", context->blob_dir, getpid(), worker->index);
+    SHA256_Init(&c);
+    while ((len = read(srcfd, buf + have, DEDUPE_BUFFER_SIZE - have)) != 0) {
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0) {
+            fprintf(stderr, "Error reading %s\n", f);
+            goto done;
+        }
+        SHA256_Update(&c, buf + have, len);
+        have += len;
+        if (have < DEDUPE_BUFFER_SIZE)
+            continue;
+        if (dstfd < 0 && (dstfd = open(tmp_blob, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+            fprintf(stderr, "Unable to create %s\n", tmp_blob);
+            goto done;
+        }
+        if (write_fully(dstfd, buf, have)) {
+            fprintf(stderr, "Error writing %s\n", tmp_blob);
+            goto done;
+        }
+        have = 0;
+    }
+    SHA256_Final(digest, &c);
+
+    pthread_mutex_lock(&context->pool.lock);
+    *is_new = !digest_set_contains(&context->blobs, digest);
+    pthread_mutex_unlock(&context->pool.lock);
+    if (*is_new) {
+        // blobs only ever appear complete under their digest
+        if (dstfd < 0 && (dstfd = open(tmp_blob, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+            fprintf(stderr, "Unable to create %s\n", tmp_blob);
+            goto done;
+        }
+        if (write_fully(dstfd, buf, have) || close(dstfd) != 0) {
+            dstfd = -1;
+            fprintf(stderr, "Error writing %s\n", tmp_blob);
+            goto done;
+        }
+        dstfd = -1;
+        digest_to_hex(digest, psum);
+        sprintf(out_blob, "%s/%s", context->blob_dir, psum);
+        if (rename(tmp_blob, out_blob) != 0) {
+            fprintf(stderr, "Error storing blob %s\n", out_blob);
+            goto done;
+        }
+        pthread_mutex_lock(&context->pool.lock);
+        int added = digest_set_add(&context->blobs, digest);
+        pthread_mutex_unlock(&context->pool.lock);
+        if (added != 0) {
+            fprintf(stderr, "Out of memory\n");
+            goto done;
+        }
+    }
+    ret = 0;
+done:
+    if (dstfd >= 0)
+        close(dstfd);
+    if (ret != 0 || !*is_new)
+        unlink(tmp_blob);
+    close(srcfd);
+    return ret;
+}
+
+static uint32_t gear[256];
+
+// Fixed pseudo random table (xorshift32), the same on every run and host.
+static void init_gear() {
+    uint32_t x = 0x9e3779b9;
+    int i;
+    for (i = 0; i < 256; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        gear[i] = x;
+    }
+}
+
+// Length of the chunk at the start of 'data'; 'len' bytes are available.
+static size_t find_chunk_end(const unsigned char *data, size_t len) {
+    uint32_t hash = 0;
+    size_t i;
+    if (len <= DEDUPE_CHUNK_MIN)
+        return len;
+    if (len > DEDUPE_CHUNK_MAX)
+        len = DEDUPE_CHUNK_MAX;
+    for (i = DEDUPE_CHUNK_MIN; i < len; i++) {
+        hash = (hash << 1) + gear[data[i]];
+        if ((hash & DEDUPE_CHUNK_MASK) == 0)
+            return i + 1;
+    }
+    return len;
+}
+
+static int store_chunk(struct DEDUPE_STORE_CONTEXT *context, struct DEDUPE_WORKER *worker, const unsigned char *data, size_t len, struct CHUNK *chunk) {
+    char tmp_blob[PATH_MAX];
+    char out_blob[PATH_MAX];
+    char psum[SHA256_DIGEST_LENGTH * 2 + 1];
+
+    SHA256(data, len, chunk->digest);
+    chunk->len = len;
+    pthread_mutex_lock(&context->pool.lock);
+    chunk->is_new = !digest_set_contains(&context->blobs, chunk->digest);
+    pthread_mutex_unlock(&context->pool.lock);
+    if (!chunk->is_new)
+        return 0;
+
+    sprintf(tmp_blob, "%s/.incoming-%d-%d", context->blob_dir, getpid(), worker->index);
+    digest_to_hex(chunk->digest, psum);
     sprintf(out_blob, "%s/%s", context->blob_dir, psum);
-    if (ret = copy_file(out_blob, f)) {
-        fprintf(stderr, "Error copying blob %s\n", f);
-        return ret;
+    int fd = open(tmp_blob, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to create %s\n", tmp_blob);
+        return 1;
+    }
+    int written = write_fully(fd, data, len) == 0;
+    if (close(fd) != 0 || !written || rename(tmp_blob, out_blob) != 0) {
+        fprintf(stderr, "Error storing blob %s\n", out_blob);
+        unlink(tmp_blob);
+        return 1;
+    }
+    pthread_mutex_lock(&context->pool.lock);
+    int added = digest_set_add(&context->blobs, chunk->digest);
+    pthread_mutex_unlock(&context->pool.lock);
+    if (added != 0) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
     }
-    
-    fprintf(context->output_manifest, "%s\t%d\t\n", psum, st.st_size);
     return 0;
 }
 
-static int store_dir(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* d) {
-    printf("%s\n", d);
+// Cuts the file of 'r' into chunks and stores the ones that are new. The
+// buffer is refilled whenever less than a maximal chunk is left in it.
+static int chunk_and_store(struct DEDUPE_STORE_CONTEXT *context, struct DEDUPE_WORKER *worker, struct MANIFEST_RECORD *r) {
+    unsigned char *buf = worker->buffer;
+    size_t have = 0, pos = 0;
+    int eof = 0, alloc = 0, ret = 0;
+    int fd = open(r->path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open file: %s\n", r->path);
+        return 1;
+    }
+    for (;;) {
+        if (!eof && have - pos < DEDUPE_CHUNK_MAX) {
+            memmove(buf, buf + pos, have - pos);
+            have -= pos;
+            pos = 0;
+            while (!eof && have < DEDUPE_BUFFER_SIZE) {
+                ssize_t len = read(fd, buf + have, DEDUPE_BUFFER_SIZE - have);
+                if (len < 0 && errno == EINTR)
+                    continue;
+                if (len < 0) {
+                    fprintf(stderr, "Error reading %s\n", r->path);
+                    ret = 1;
+                    goto done;
+                }
+                if (len == 0)
+                    eof = 1;
+                have += len;
+            }
+        }
+        if (pos == have)
+            break;
+        if (r->chunk_count == alloc) {
+            alloc = alloc ? alloc * 2 : 64;
+            struct CHUNK *chunks = (struct CHUNK*) realloc(r->chunks, alloc * sizeof(struct CHUNK));
+            if (chunks == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                ret = 1;
+                goto done;
+            }
+            r->chunks = chunks;
+        }
+        size_t len = find_chunk_end(buf + pos, have - pos);
+        if ((ret = store_chunk(context, worker, buf + pos, len, &r->chunks[r->chunk_count])) != 0)
+            goto done;
+        r->chunk_count++;
+        pos += len;
+    }
+done:
+    close(fd);
+    return ret;
+}
+
+static int store_job(struct DEDUPE_WORKER *worker, void *job) {
+    struct DEDUPE_STORE_CONTEXT *context = (struct DEDUPE_STORE_CONTEXT*) worker->pool->context;
+    struct MANIFEST_RECORD *r = (struct MANIFEST_RECORD*) job;
+    int ret;
+    if (r->chunked)
+        ret = chunk_and_store(context, worker, r);
+    else
+        ret = hash_and_store(context, worker, r->path, r->digest, &r->is_new);
+    if (ret != 0)
+        fprintf(stderr, "Error storing %s\n", r->path);
+    pthread_mutex_lock(&context->pool.lock);
+    r->ret = ret;
+    r->done = 1;
+    pthread_cond_broadcast(&context->pool.cond);
+    pthread_mutex_unlock(&context->pool.lock);
+    return ret;
+}
+
+static int write_record(struct DEDUPE_STORE_CONTEXT *context, struct MANIFEST_RECORD *r) {
+    struct MANIFEST_BUILDER *b = &context->manifest.builder;
+    printf("%s\n", r->path);
+    if (r->ret != 0)
+        return r->ret;
+    if (builder_add_entry(b, r->type, r->mode, r->uid, r->gid, r->path, r->link, r->is_file ? r->size : 0))
+        return 1;
+    if (!r->is_file)
+        return 0;
+
+    if (r->chunked) {
+        int i, stored = 0;
+        for (i = 0; i < r->chunk_count; i++) {
+            struct CHUNK *c = &r->chunks[i];
+            if (!c->is_new) {
+                context->bytes_saved += c->len;
+            }
+            else {
+                context->bytes_stored += c->len;
+                stored = 1;
+            }
+            if (builder_add_chunk(b, c->digest, c->len))
+                return 1;
+        }
+        // a file counts as stored if any of its chunks was new
+        if (stored)
+            context->files_stored++;
+        else
+            context->files_skipped++;
+        return 0;
+    }
+    if (!r->is_new) {
+        context->files_skipped++;
+        context->bytes_saved += r->size;
+    }
+    else {
+        context->files_stored++;
+        context->bytes_stored += r->size;
+    }
+    return builder_add_chunk(b, r->digest, r->size);
+}
+
+// Writes out the records whose files are stored, waiting for them if
+// 'all' is set or too many are held back.
+static int flush_records(struct DEDUPE_STORE_CONTEXT *context, int all) {
+    int ret = 0;
+    while (ret == 0) {
+        pthread_mutex_lock(&context->pool.lock);
+        struct MANIFEST_RECORD *r = context->first;
+        while (r != NULL && !r->done && (all || context->pending > DEDUPE_MAX_PENDING))
+            pthread_cond_wait(&context->pool.cond, &context->pool.lock);
+        if (r == NULL || !r->done) {
+            pthread_mutex_unlock(&context->pool.lock);
+            break;
+        }
+        context->first = r->next;
+        if (context->first == NULL)
+            context->last = NULL;
+        context->pending--;
+        pthread_mutex_unlock(&context->pool.lock);
+
+        ret = write_record(context, r);
+        free(r->path);
+        free(r->link);
+        free(r->chunks);
+        free(r);
+    }
+    return ret;
+}
+
+static int add_record(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char *path, char type, const char *link) {
+    struct MANIFEST_RECORD *r = (struct MANIFEST_RECORD*) calloc(1, sizeof(struct MANIFEST_RECORD));
+    if (r == NULL || (r->path = strdup(path)) == NULL || (link != NULL && (r->link = strdup(link)) == NULL)) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    int is_file = type == 'f' || type == 'c';
+    r->type = type;
+    r->mode = st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID);
+    r->uid = st.st_uid;
+    r->gid = st.st_gid;
+    r->is_file = is_file;
+    r->chunked = type == 'c';
+    r->size = st.st_size;
+    r->done = !is_file;
+
+    pthread_mutex_lock(&context->pool.lock);
+    if (context->last != NULL)
+        context->last->next = r;
+    else
+        context->first = r;
+    context->last = r;
+    context->pending++;
+    pthread_mutex_unlock(&context->pool.lock);
+
+    int ret;
+    if (is_file && (ret = pool_submit(&context->pool, r)) != 0)
+        return ret;
+    return flush_records(context, 0);
+}
+
+static int store_dir(struct DEDUPE_STORE_CONTEXT *context, const char* d) {
     DIR *dp = opendir(d);
-    if (d == NULL) {
+    if (dp == NULL) {
         fprintf(stderr, "Error opening directory: %s\n", d);
         return 1;
     }
     struct dirent *ep;
     char full_path[PATH_MAX];
-    while (ep = readdir(dp)) {
+    while ((ep = readdir(dp)) != NULL) {
         if (strcmp(ep->d_name, ".") == 0)
             continue;
         if (strcmp(ep->d_name, "..") == 0)
             continue;
         struct stat cst;
         int ret;
+        int i;
         sprintf(full_path, "%s/%s", d, ep->d_name);
+        for (i = 0; i < context->exclude_count; i++) {
+            if (strcmp(full_path, context->excludes[i]) == 0)
+                break;
+        }
+        if (i < context->exclude_count)
+            continue;
         if (0 != (ret = lstat(full_path, &cst))) {
             fprintf(stderr, "Error opening: %s\n", ep->d_name);
             closedir(dp);
             return ret;
         }
         
-        if (ret = store_st(context, cst, full_path))
+        if ((ret = store_st(context, cst, full_path)) != 0) {
+            closedir(dp);
             return ret;
+        }
     }
     closedir(dp);
     return 0;
 }
 
-static int store_link(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* l) {
-    printf("%s\n", l);
-    char link[PATH_MAX];
-    int ret = readlink(l, link, PATH_MAX);
-    if (ret < 0) {
-        fprintf(stderr, "Error reading symlink\n");
-        return errno;
-    }
-    link[ret] = '\0';
-    fprintf(context->output_manifest, "%s\t\n", link);
-    return 0;
-}
-
 static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* s) {
+    int ret;
     if (S_ISREG(st.st_mode)) {
-        print_stat(context, 'f', st, s);
-        return store_file(context, st, s);
+        int chunked = context->chunking && st.st_size >= DEDUPE_CHUNK_MIN_FILE;
+        return add_record(context, st, s, chunked ? 'c' : 'f', NULL);
     }
     else if (S_ISDIR(st.st_mode)) {
-        print_stat(context, 'd', st, s);
-        fprintf(context->output_manifest, "\n");
-        return store_dir(context, st, s);
+        if ((ret = add_record(context, st, s, 'd', NULL)) != 0)
+            return ret;
+        return store_dir(context, s);
     }
     else if (S_ISLNK(st.st_mode)) {
-        print_stat(context, 'l', st, s);
-        return store_link(context, st, s);
+        char link[PATH_MAX];
+        ret = readlink(s, link, PATH_MAX - 1);
+        if (ret < 0) {
+            fprintf(stderr, "Error reading symlink\n");
+            return errno;
+        }
+        link[ret] = '\0';
+        return add_record(context, st, s, 'l', link);
     }
     else {
         fprintf(stderr, "Skipping special: %s\n", s);
@@ -171,45 +1192,160 @@ static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const
     }
 }
 
-void get_full_path(char *out_path, char *rel_path) {
+// A missing folder would otherwise resolve to the current directory.
+int get_full_path(char *out_path, char *rel_path) {
     char tmp[PATH_MAX];
     getcwd(tmp, PATH_MAX);
-    chdir(rel_path);
+    if (chdir(rel_path) != 0) {
+        fprintf(stderr, "Error opening directory: %s\n", rel_path);
+        return 1;
+    }
     getcwd(out_path, PATH_MAX);
     chdir(tmp);
+    return 0;
 }
 
-static char* tokenize(char *out, const char* line, const char sep) {
-    while (*line != sep) {
-        if (*line == '\0') {
-            return NULL;
+// Remove every blob that is not referenced by one of the given manifests.
+static int collect_garbage(const char *blob_dir, char **manifests, int manifest_count) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    struct DIGEST_SET refs;
+    struct MANIFEST m;
+    uint32_t j;
+    int i;
+    memset(&refs, 0, sizeof(refs));
+    for (i = 0; i < manifest_count; i++) {
+        if (manifest_open(&m, manifests[i]) != 0) {
+            free(refs.slots);
+            return 1;
         }
-        
-        *out = *line;
-        out++;
-        line++;
+        for (j = 0; j < m.chunk_count; j++) {
+            if (digest_set_add(&refs, m.chunks[j].digest) != 0) {
+                fprintf(stderr, "Out of memory\n");
+                manifest_close(&m);
+                free(refs.slots);
+                return 1;
+            }
+        }
+        manifest_close(&m);
     }
-    
-    *out = '\0';
-    // resume at the next char
-    return ++line;
+
+    DIR *dp = opendir(blob_dir);
+    if (dp == NULL) {
+        fprintf(stderr, "Error opening directory: %s\n", blob_dir);
+        free(refs.slots);
+        return 1;
+    }
+    struct dirent *ep;
+    char blob[PATH_MAX];
+    int removed = 0;
+    while ((ep = readdir(dp)) != NULL) {
+        if (ep->d_name[0] == '.')
+            continue;
+        if (parse_digest(ep->d_name, digest) == 0 && digest_set_contains(&refs, digest))
+            continue;
+        sprintf(blob, "%s/%s", blob_dir, ep->d_name);
+        if (unlink(blob) == 0)
+            removed++;
+    }
+    closedir(dp);
+    printf("Removed %d unreferenced blobs\n", removed);
+    free(refs.slots);
+    return 0;
 }
 
-static int dec_to_oct(int dec) {
+// Lists a manifest, or looks up the given paths in it.
+static int list_manifest(const char *file, char **paths, int path_count) {
+    struct MANIFEST m;
+    uint32_t j;
+    int i, ret = 0;
+    if (manifest_open(&m, file) != 0)
+        return 1;
+    for (j = 0; path_count == 0 && j < m.entry_count; j++)
+        print_entry(&m, &m.entries[j]);
+    for (i = 0; i < path_count; i++) {
+        const struct MANIFEST_ENTRY *e = manifest_find(&m, paths[i]);
+        if (e == NULL) {
+            fprintf(stderr, "%s is not in %s\n", paths[i], file);
+            ret = 1;
+            continue;
+        }
+        print_entry(&m, e);
+    }
+    manifest_close(&m);
+    return ret;
+}
+
+// Writes any manifest, text ones included, in the binary format.
+static int convert_manifest(const char *input, const char *output) {
+    struct MANIFEST m;
+    if (manifest_open(&m, input) != 0)
+        return 1;
     int ret = 0;
-    int mult = 1;
-    while (dec != 0) {
-        int rem = dec % 10;
-        ret += (rem * mult);
-        dec /= 10;
-        mult *= 8;
+    FILE *f = fopen(output, "wb");
+    if (f == NULL || manifest_write(&m, f) != 0)
+        ret = 1;
+    if (f != NULL && fclose(f) != 0)
+        ret = 1;
+    if (ret != 0)
+        fprintf(stderr, "Error writing %s\n", output);
+    manifest_close(&m);
+    return ret;
+}
+
+struct EXTRACT_CONTEXT {
+    const struct MANIFEST *manifest;
+    char blob_dir[PATH_MAX];
+};
+
+static int extract_job(struct DEDUPE_WORKER *worker, void *job) {
+    struct EXTRACT_CONTEXT *context = (struct EXTRACT_CONTEXT*) worker->pool->context;
+    const struct MANIFEST_ENTRY *e = (const struct MANIFEST_ENTRY*) job;
+    const char *filename = context->manifest->strings + e->path;
+    int ret = copy_blobs(filename, context->blob_dir, context->manifest->chunks + e->first_chunk, e->chunk_count, worker->buffer, DEDUPE_BUFFER_SIZE);
+    if (ret != 0) {
+        fprintf(stderr, "Unable to copy file %s\n", filename);
+    }
+    else {
+        // chown clears the set-id bits, so it goes first
+        chown(filename, e->uid, e->gid);
+        chmod(filename, e->mode);
     }
-    
     return ret;
 }
 
 int main(int argc, char** argv) {
-    if (argc != 5) {
+    if (argc >= 3 && strcmp(argv[1], "gc") == 0)
+        return collect_garbage(argv[2], argv + 3, argc - 3);
+    if (argc >= 3 && strcmp(argv[1], "t") == 0)
+        return list_manifest(argv[2], argv + 3, argc - 3);
+    if (argc == 4 && strcmp(argv[1], "convert") == 0)
+        return convert_manifest(argv[2], argv[3]);
+
+    // options come right after the command, and are dropped from argv
+    int jobs = 1;
+    int chunking = 0;
+    while (argc >= 3 && argv[2][0] == '-') {
+        int used = 1;
+        if (strcmp(argv[2], "-j") == 0 && argc >= 4) {
+            jobs = atoi(argv[3]);
+            if (jobs < 1)
+                jobs = 1;
+            if (jobs > DEDUPE_MAX_JOBS)
+                jobs = DEDUPE_MAX_JOBS;
+            used = 2;
+        }
+        else if (strcmp(argv[2], "-c") == 0) {
+            chunking = 1;
+        }
+        else {
+            usage(argv);
+            return 1;
+        }
+        memmove(argv + 2, argv + 2 + used, (argc - 2 - used + 1) * sizeof(char*));
+        argc -= used;
+    }
+
+    if (argc < 5 || (argc != 5 && strcmp(argv[1], "c") != 0)) {
         usage(argv);
         return 1;
     }
@@ -229,99 +1365,95 @@ int main(int argc, char** argv) {
         
         char blob_dir[PATH_MAX];
         struct DEDUPE_STORE_CONTEXT context;
+        memset(&context, 0, sizeof(context));
         context.output_manifest = fopen(argv[4], "wb");
         if (context.output_manifest == NULL) {
             fprintf(stderr, "Unable to open output file %s\n", argv[4]);
             return 1;
         }
-        get_full_path(context.blob_dir, argv[3]);
+        if (get_full_path(context.blob_dir, argv[3]) != 0)
+            return 1;
+        context.excludes = argv + 5;
+        context.exclude_count = argc - 5;
+        context.chunking = chunking;
+        init_gear();
+        if ((ret = load_blob_digests(&context.blobs, context.blob_dir)) != 0)
+            return ret;
+        if ((ret = pool_start(&context.pool, jobs, store_job, &context)) != 0)
+            return ret;
         chdir(argv[2]);
         
-        return store_dir(&context, st, ".");
+        printf(".\n");
+        ret = store_dir(&context, ".");
+        // a failed walk still waits for the files already handed out
+        int flushed = flush_records(&context, 1);
+        int stored = pool_finish(&context.pool);
+        if (ret == 0)
+            ret = flushed != 0 ? flushed : stored;
+        // stdout lists the stored files, the totals go to the log
+        fprintf(stderr, "Stored %d files (%lld new bytes), %d files were already stored (%lld bytes reused)\n",
+                context.files_stored, context.bytes_stored, context.files_skipped, context.bytes_saved);
+        free(context.blobs.slots);
+        if (ret == 0 && (ret = manifest_use_builder(&context.manifest)) == 0 &&
+                manifest_write(&context.manifest, context.output_manifest) != 0)
+            ret = 1;
+        if (fclose(context.output_manifest) != 0 && ret == 0)
+            ret = 1;
+        if (ret == 1)
+            fprintf(stderr, "Error writing %s\n", argv[4]);
+        manifest_close(&context.manifest);
+        return ret;
     }
     else if (strcmp(argv[1], "x") == 0) {
-        FILE *input_manifest = fopen(argv[2], "rb");
-        if (input_manifest == NULL) {
-            fprintf(stderr, "Unable to open input manifest %s\n", argv[2]);
+        struct EXTRACT_CONTEXT context;
+        struct MANIFEST manifest;
+        if (manifest_open(&manifest, argv[2]) != 0)
             return 1;
-        }
+        context.manifest = &manifest;
 
-        char blob_dir[PATH_MAX];
         char *output_dir = argv[4];
-        get_full_path(blob_dir, argv[3]);
+        if (get_full_path(context.blob_dir, argv[3]) != 0) {
+            manifest_close(&manifest);
+            return 1;
+        }
     
         printf("%s\n" , output_dir);
         chdir(output_dir);
-        
-        char line[PATH_MAX];
-        while (fgets(line, PATH_MAX, input_manifest)) {
-            //printf("%s", line);
-            
-            char type[4];
-            char mode[8];
-            char uid[32];
-            char gid[32];
-            char filename[PATH_MAX];
-            
-            char *token = line;
-            token = tokenize(type, token, '\t');
-            token = tokenize(mode, token, '\t');
-            token = tokenize(uid, token, '\t');
-            token = tokenize(gid, token, '\t');
-            token = tokenize(filename, token, '\t');
-            
-            int mode_oct = dec_to_oct(atoi(mode));
-            int uid_int = atoi(uid);
-            int gid_int = atoi(gid);
-            int ret;
-            printf("%s\t%s\t%s\t%s\t%s\t", type, mode, uid, gid, filename);
-            if (strcmp(type, "f") == 0) {
-                char sha256[128];
-                token = tokenize(sha256, token, '\t');
-                char sizeStr[32];
-                token = tokenize(sizeStr, token, '\t');
-                int size = atoi(sizeStr);
-                printf("%s\t%d\n", sha256, size);
-                
-                char blob_file[PATH_MAX];
-                sprintf(blob_file, "%s/%s", blob_dir, sha256);
-                if (ret = copy_file(filename, blob_file)) {
-                    fprintf(stderr, "Unable to copy file %s\n", filename);
-                    fclose(input_manifest);
-                    return ret;
-                }
-                
-                chmod(filename, mode_oct);
-                chown(filename, uid_int, gid_int);
-            }
-            else if (strcmp(type, "l") == 0) {
-                char link[41];
-                token = tokenize(link, token, '\t');
-                printf("%s\n", link);
-                
-                symlink(link, filename);
-
-                // Android has no lchmod, and chmod follows symlinks
-                //chmod(filename, mode_oct);
-                lchown(filename, uid_int, gid_int);
-            }
-            else if (strcmp(type, "d") == 0) {
-                printf("\n");
 
-                mkdir(filename, mode_oct);
+        // directories and links are made here, before anything inside them
+        struct DEDUPE_POOL pool;
+        int ret;
+        if ((ret = pool_start(&pool, jobs, extract_job, &context)) != 0) {
+            manifest_close(&manifest);
+            return ret;
+        }
 
-                chmod(filename, mode_oct);
-                chown(filename, uid_int, gid_int);
-            }
-            else {
-                fprintf(stderr, "Unknown type %s\n", type);
-                fclose(input_manifest);
-                return 1;
+        uint32_t i;
+        for (i = 0; i < manifest.entry_count && ret == 0; i++) {
+            const struct MANIFEST_ENTRY *e = &manifest.entries[i];
+            const char *filename = manifest.strings + e->path;
+            printf("%s\n", filename);
+            switch (e->type) {
+                case 'f':
+                case 'c':
+                    ret = pool_submit(&pool, (void*) e);
+                    break;
+                case 'l':
+                    symlink(manifest.strings + e->link, filename);
+                    // Android has no lchmod, and chmod follows symlinks
+                    lchown(filename, e->uid, e->gid);
+                    break;
+                case 'd':
+                    mkdir(filename, e->mode);
+                    chmod(filename, e->mode);
+                    chown(filename, e->uid, e->gid);
+                    break;
             }
         }
-        
-        fclose(input_manifest);
-        return 0;
+
+        int extracted = pool_finish(&pool);
+        manifest_close(&manifest);
+        return ret != 0 ? ret : extracted;
     }
     else {
         usage(argv);
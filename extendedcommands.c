@@ -976,6 +976,7 @@ void show_nandroid_restore_delete_menu(unsigned int mode)
                     ui_print("Failed deleting %s\n",file);
                 }else{
                     ui_print("Successfully deleted %s\n",file);                    
+                    nandroid_dedupe_gc("/sdcard/clockworkmod/blobs");
                 }
             }else{
             ui_print("Path not verified: %s, exiting...\n",file);
@@ -1049,6 +1050,115 @@ void show_nandroid_menu()
     }
 }
 
+void show_nandroid_backup_format_menu()
+{
+    static char* headers[] = {  "NANDROID BACKUP FORMAT",
+                                "",
+                                "Compressed backups are smaller and",
+                                "often faster on slow sdcards.",
+                                "Incremental backups only store files",
+                                "that changed since earlier backups.",
+                                "",
+                                NULL
+    };
+
+    static char* list[] = { "tar (uncompressed)",
+                            "tar.gz (compressed)",
+                            "dup (incremental)",
+                            NULL
+    };
+
+    int format = nandroid_get_default_backup_format();
+    ui_print("\nCurrent backup format: %s\n", list[format]);
+    int chosen_item = get_menu_selection(headers, list, 0, format);
+    switch (chosen_item)
+    {
+        case 0:
+            format = NANDROID_BACKUP_FORMAT_TAR;
+            break;
+        case 1:
+            format = NANDROID_BACKUP_FORMAT_TGZ;
+            break;
+        case 2:
+            format = NANDROID_BACKUP_FORMAT_DUP;
+            break;
+        default:
+            return;
+    }
+    if (0 != nandroid_set_default_backup_format(format))
+        ui_print("Unable to save backup format!\n");
+    else
+        ui_print("Backup format set to %s\n", list[format]);
+}
+
+void show_nandroid_restore_app_menu()
+{
+    if (ensure_path_mounted("/sdcard") != 0) {
+        LOGE ("Can't mount /sdcard\n");
+        return;
+    }
+
+    static char* headers[] = {  "CHOOSE A BACKUP",
+                                "",
+                                "Choose the backup to take",
+                                "the app data from.",
+                                NULL
+    };
+    static char* appheaders[] = {  "CHOOSE AN APP TO RESTORE",
+                                "",
+                                "Only the data of this app",
+                                "is restored.",
+                                NULL
+    };
+
+    char* file = choose_file_menu("/sdcard/clockworkmod/backup/", NULL, headers);
+    if (file == NULL)
+        return;
+
+    char** apps = nandroid_list_apps(file);
+    if (apps == NULL || apps[0] == NULL) {
+        ui_print("No indexed /data backup found.\n");
+        free_string_array(apps);
+        return;
+    }
+
+    int chosen_item = get_menu_selection(appheaders, apps, 0, 0);
+    if (chosen_item >= 0) {
+        char confirm[PATH_MAX];
+        sprintf(confirm, "Yes - restore %s", apps[chosen_item]);
+        if (confirm_selection("Confirm restoring app data?", confirm))
+            nandroid_restore_app(file, apps[chosen_item]);
+    }
+    free_string_array(apps);
+}
+
+void show_nandroid_restore_mode_menu()
+{
+    static char* headers[] = {  "NANDROID RESTORE MODE",
+                                "",
+                                "Differential restores keep the",
+                                "partition and only rewrite files",
+                                "that changed since the backup.",
+                                "",
+                                NULL
+    };
+
+    static char* list[] = { "full (format + extract)",
+                            "differential (changed files only)",
+                            NULL
+    };
+
+    int differential = nandroid_get_differential_restore();
+    ui_print("\nCurrent restore mode: %s\n", list[differential]);
+    int chosen_item = get_menu_selection(headers, list, 0, differential);
+    if (chosen_item != 0 && chosen_item != 1)
+        return;
+    if (0 != nandroid_set_differential_restore(chosen_item))
+        ui_print("Unable to save restore mode!\n");
+    else
+        ui_print("Restore mode set to %s\n", list[chosen_item]);
+}
+
 void wipe_battery_stats()
 {
     ensure_path_mounted("/data");
@@ -1365,36 +1475,13 @@ void process_volumes() {
     if (device_flash_type() != BML)
         return;
 
-    ui_print("Checking for ext4 partitions...\n");
-    int ret = 0;
-    ret = bml_check_volume("/system");
-    ret |= bml_check_volume("/data");
-    if (has_datadata())
-        ret |= bml_check_volume("/dbdata");
-    ret |= bml_check_volume("/cache");
-    
-    if (ret == 0) {
-        ui_print("Done!\n");
-        return;
-    }
-    
     char backup_path[PATH_MAX];
-    time_t t = time(NULL);
-    char backup_name[PATH_MAX];
     struct timeval tp;
     gettimeofday(&tp, NULL);
-    sprintf(backup_name, "before-ext4-convert-%d", tp.tv_sec);
-    sprintf(backup_path, "/sdcard/clockworkmod/backup/%s", backup_name);
+    sprintf(backup_path, "/sdcard/clockworkmod/backup/before-ext4-convert-%d", tp.tv_sec);
 
     ui_set_show_text(1);
-    ui_print("Filesystems need to be converted to ext4.\n");
-    ui_print("A backup and restore will now take place.\n");
-    ui_print("If anything goes wrong, your backup will be\n");
-    ui_print("named %s. Try restoring it\n", backup_name);
-    ui_print("in case of error.\n");
-
-    nandroid_backup(backup_path);
-    nandroid_restore(backup_path, 1, 1, 1, 1, 1, 0);
+    nandroid_convert_ext4(backup_path);
     ui_set_show_text(0);
 }
 
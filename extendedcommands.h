@@ -22,6 +22,15 @@ show_nandroid_restore_delete_menu(unsigned int);
 void
 show_nandroid_menu();
 
+void
+show_nandroid_backup_format_menu();
+
+void
+show_nandroid_restore_mode_menu();
+
+void
+show_nandroid_restore_app_menu();
+
 void
 show_partition_menu();
 
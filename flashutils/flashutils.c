@@ -1,10 +1,17 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <stdio.h>
 
 #include "flashutils/flashutils.h"
+#include "mtdutils/mtdutils.h"
 
 #ifndef BOARD_BML_BOOT
 #define BOARD_BML_BOOT              "/dev/block/bml7"
@@ -14,6 +21,16 @@
 #define BOARD_BML_RECOVERY          "/dev/block/bml8"
 #endif
 
+#define BML_UNLOCK_ALL              0x8A29
+#define BML_PAGE_SIZE               4096
+
+// mtdutils flashes the first 2k last, see cmd_mtd_restore_raw_partition
+#define MTD_HEADER_SIZE             2048
+
+// mtd images are dumped and flashed through mtdutils, so sparse images are
+// converted from and to a plain image here.
+#define SPARSE_TEMP_IMAGE           "/tmp/sparse-restore.img"
+
 int the_flash_type = UNKNOWN;
 
 int device_flash_type()
@@ -64,9 +81,248 @@ static int detect_partition(const char *partitionType, const char *partition)
 
     return type;
 }
-int restore_raw_partition(const char* partitionType, const char *partition, const char *filename)
+// The block device that backs a bml or emmc partition, for reading and
+// writing it directly. mtd partitions have none.
+static int get_raw_device(int type, const char *partition, char *device)
 {
-    int type = detect_partition(partitionType, partition);
+    if (type == MTD)
+        return -1;
+    if (partition[0] == '/') {
+        strcpy(device, partition);
+        return 0;
+    }
+    if (type == MMC)
+        return cmd_mmc_get_partition_device(partition, device);
+    if (type == BML && strcmp(partition, "boot") == 0) {
+        strcpy(device, BOARD_BML_BOOT);
+        return 0;
+    }
+    if (type == BML && (strcmp(partition, "recovery") == 0 || strcmp(partition, "recoveryonly") == 0)) {
+        strcpy(device, BOARD_BML_RECOVERY);
+        return 0;
+    }
+    return -1;
+}
+
+// 'type' is UNKNOWN when 'device' is a plain image file to create.
+static int replay_sparse_stream(raw_read_func read_func, void *in, const char *device, int type)
+{
+    int flags = O_RDWR | O_LARGEFILE;
+    if (type == UNKNOWN)
+        flags |= O_CREAT | O_TRUNC;
+    int out = open(device, flags, 0600);
+    if (out < 0) {
+        printf("error opening %s\n", device);
+        return -1;
+    }
+    int ret = -1;
+    if (type == BML && ioctl(out, BML_UNLOCK_ALL, 0))
+        printf("error unlocking %s\n", device);
+    else if (0 == (ret = sparse_image_replay(read_func, in, out)))
+        ret = fsync(out);
+    if (close(out) != 0)
+        ret = -1;
+    return ret;
+}
+
+static int replay_sparse_image(const char *filename, const char *device, int type)
+{
+    int in = raw_open(filename, O_RDONLY, 0);
+    if (in < 0) {
+        printf("error opening %s\n", filename);
+        return -1;
+    }
+    int ret = replay_sparse_stream(raw_fd_read, &in, device, type);
+    close(in);
+    return ret;
+}
+
+// Plain image to block device, or back.
+static int copy_stream(raw_read_func read_func, void *in, const char *dst, int type)
+{
+    int out = raw_open(dst, type == UNKNOWN ? O_WRONLY | O_CREAT | O_TRUNC : O_RDWR, 0666);
+    if (out < 0) {
+        printf("error opening %s\n", dst);
+        return -1;
+    }
+    int ret = -1;
+    uint64_t copied;
+    if (type == BML && ioctl(out, BML_UNLOCK_ALL, 0)) {
+        printf("error unlocking %s\n", dst);
+    }
+    else if (0 == (ret = raw_copy(read_func, in, raw_fd_write, &out, &copied))) {
+        // bml is written in whole 4k pages, the same as restore_internal
+        static const char zero[BML_PAGE_SIZE];
+        if (type == BML && copied % BML_PAGE_SIZE != 0)
+            ret = raw_fd_write(&out, zero, BML_PAGE_SIZE - copied % BML_PAGE_SIZE);
+        if (ret == 0)
+            ret = fsync(out);
+    }
+    if (close(out) != 0)
+        ret = -1;
+    if (ret != 0 && type == UNKNOWN)
+        unlink(dst);
+    return ret;
+}
+
+static int copy_image(const char *src, const char *dst, int type)
+{
+    int in = raw_open(src, O_RDONLY, 0);
+    if (in < 0) {
+        printf("error opening %s\n", src);
+        return -1;
+    }
+    int ret = copy_stream(raw_fd_read, &in, dst, type);
+    close(in);
+    return ret;
+}
+
+struct mtd_source {
+    MtdReadContext *ctx;
+    size_t left;
+};
+
+static ssize_t mtd_source_read(void *cookie, char *data, size_t len)
+{
+    struct mtd_source *s = (struct mtd_source*) cookie;
+    if (len > s->left)
+        len = s->left;
+    if (len == 0)
+        return 0;
+    ssize_t r = mtd_read_data(s->ctx, data, len);
+    if (r > 0)
+        s->left -= r;
+    return r;
+}
+
+struct mtd_sink {
+    MtdWriteContext *ctx;
+    size_t header;
+};
+
+static int mtd_sink_write(void *cookie, const char *data, size_t len)
+{
+    struct mtd_sink *s = (struct mtd_sink*) cookie;
+    if (s->header > 0) {
+        // the header goes out zeroed and is written last, so an interrupted
+        // flash does not leave a bootable half written image behind
+        char zero[MTD_HEADER_SIZE];
+        size_t n = len < s->header ? len : s->header;
+        memset(zero, 0, n);
+        if (mtd_write_data(s->ctx, zero, n) != (ssize_t) n)
+            return -1;
+        s->header -= n;
+        data += n;
+        len -= n;
+    }
+    return mtd_write_data(s->ctx, data, len) == (ssize_t) len ? 0 : -1;
+}
+
+static int mtd_backup(const char *partition_name, const char *filename)
+{
+    size_t partition_size;
+    if (mtd_scan_partitions() <= 0) {
+        printf("error scanning partitions");
+        return -1;
+    }
+    const MtdPartition *partition = mtd_find_partition_by_name(partition_name);
+    if (partition == NULL || mtd_partition_info(partition, &partition_size, NULL, NULL)) {
+        printf("can't find %s partition", partition_name);
+        return -1;
+    }
+    int out = raw_open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out < 0) {
+        printf("error opening %s", filename);
+        return -1;
+    }
+    struct mtd_source src;
+    src.left = partition_size;
+    src.ctx = mtd_read_partition(partition);
+    if (src.ctx == NULL) {
+        close(out);
+        unlink(filename);
+        printf("error opening %s: %s\n", partition_name, strerror(errno));
+        return -1;
+    }
+    int ret = raw_copy(mtd_source_read, &src, raw_fd_write, &out, NULL);
+    mtd_read_close(src.ctx);
+    if (close(out) != 0)
+        ret = -1;
+    if (ret != 0)
+        unlink(filename);
+    return ret;
+}
+
+static int mtd_restore(const char *partition_name, const char *filename)
+{
+    size_t block_size;
+    if (mtd_scan_partitions() <= 0) {
+        printf("error scanning partitions");
+        return -1;
+    }
+    const MtdPartition *partition = mtd_find_partition_by_name(partition_name);
+    if (partition == NULL || mtd_partition_info(partition, NULL, &block_size, NULL)) {
+        printf("can't find %s partition", partition_name);
+        return -1;
+    }
+    int in = raw_open(filename, O_RDONLY, 0);
+    if (in < 0) {
+        printf("error opening %s", filename);
+        return -1;
+    }
+
+    printf("flashing %s from %s\n", partition_name, filename);
+    struct mtd_sink sink;
+    sink.header = MTD_HEADER_SIZE;
+    sink.ctx = mtd_write_partition(partition);
+    int ret = -1;
+    if (sink.ctx == NULL) {
+        printf("error writing %s", partition_name);
+        goto done;
+    }
+    ret = raw_copy(raw_fd_read, &in, mtd_sink_write, &sink, NULL);
+    if (mtd_write_close(sink.ctx) || ret != 0) {
+        printf("error writing %s", partition_name);
+        ret = -1;
+        goto done;
+    }
+
+    // Now come back and write the first block, header included
+    char *block = (char*) malloc(block_size);
+    ssize_t len = block == NULL ? -1 : pread(in, block, block_size, 0);
+    sink.ctx = len <= 0 ? NULL : mtd_write_partition(partition);
+    if (sink.ctx == NULL || mtd_write_data(sink.ctx, block, len) != len || mtd_write_close(sink.ctx)) {
+        printf("error re-writing %s", partition_name);
+        ret = -1;
+    }
+    free(block);
+done:
+    close(in);
+    return ret;
+}
+
+// Plain image restore for everything except sparse images. bml keeps the
+// targets of cmd_bml_restore_raw_partition: boot and recovery are the same
+// on some samsung phones, so recovery is flashed to both.
+static int restore_image(int type, const char *partition, const char *filename)
+{
+    char device[PATH_MAX];
+    int ret;
+    if (filename == NULL || (type == BML && partition[0] != '/' &&
+            strcmp(partition, "boot") != 0 && strcmp(partition, "recovery") != 0 &&
+            strcmp(partition, "recoveryonly") != 0))
+        goto fallback;
+    if (type == BML && strcmp(partition, "recovery") == 0) {
+        if (0 != (ret = copy_image(filename, BOARD_BML_BOOT, type)))
+            return ret;
+        return copy_image(filename, BOARD_BML_RECOVERY, type);
+    }
+    if (get_raw_device(type, partition, device) == 0)
+        return copy_image(filename, device, type);
+    if (type == MTD)
+        return mtd_restore(partition, filename);
+
+fallback:
     switch (type) {
         case MTD:
             return cmd_mtd_restore_raw_partition(partition, filename);
@@ -79,12 +335,64 @@ int restore_raw_partition(const char* partitionType, const char *partition, cons
     }
 }
 
+static int restore_sparse_partition(int type, const char *partition, const char *filename)
+{
+    char device[PATH_MAX];
+    int ret;
+    if (type == BML && strcmp(partition, "recovery") == 0) {
+        if (0 != (ret = replay_sparse_image(filename, BOARD_BML_BOOT, type)))
+            return ret;
+        return replay_sparse_image(filename, BOARD_BML_RECOVERY, type);
+    }
+    if (get_raw_device(type, partition, device) == 0)
+        return replay_sparse_image(filename, device, type);
+
+    if (0 != (ret = replay_sparse_image(filename, SPARSE_TEMP_IMAGE, UNKNOWN)))
+        return ret;
+    ret = restore_image(type, partition, SPARSE_TEMP_IMAGE);
+    unlink(SPARSE_TEMP_IMAGE);
+    return ret;
+}
+
+int restore_raw_partition(const char* partitionType, const char *partition, const char *filename)
+{
+    int type = detect_partition(partitionType, partition);
+    if (filename != NULL && is_sparse_image(filename))
+        return restore_sparse_partition(type, partition, filename);
+    return restore_image(type, partition, filename);
+}
+
+// bml recovery is flashed twice and mtd rewrites its first block at the
+// end, those and the partitions without a block device need the file.
+int raw_partition_streamable(const char* partitionType, const char *partition)
+{
+    char device[PATH_MAX];
+    int type = detect_partition(partitionType, partition);
+    if (type == BML && strcmp(partition, "recovery") == 0)
+        return 0;
+    return get_raw_device(type, partition, device) == 0;
+}
+
+int restore_raw_partition_stream(const char* partitionType, const char *partition, int sparse, raw_read_func read_func, void* in)
+{
+    char device[PATH_MAX];
+    int type = detect_partition(partitionType, partition);
+    if (!raw_partition_streamable(partitionType, partition) || get_raw_device(type, partition, device) != 0)
+        return -1;
+    if (sparse)
+        return replay_sparse_stream(read_func, in, device, type);
+    return copy_stream(read_func, in, device, type);
+}
+
 int backup_raw_partition(const char* partitionType, const char *partition, const char *filename)
 {
+    char device[PATH_MAX];
     int type = detect_partition(partitionType, partition);
+    if (get_raw_device(type, partition, device) == 0)
+        return copy_image(device, filename, UNKNOWN);
     switch (type) {
         case MTD:
-            return cmd_mtd_backup_raw_partition(partition, filename);
+            return mtd_backup(partition, filename);
         case MMC:
             return cmd_mmc_backup_raw_partition(partition, filename);
         case BML:
@@ -95,6 +403,57 @@ int backup_raw_partition(const char* partitionType, const char *partition, const
     }
 }
 
+int backup_raw_partition_sparse_to(const char* partitionType, const char *partition, const char *filename, raw_write_func write_func, void* out)
+{
+    int type = detect_partition(partitionType, partition);
+    char device[PATH_MAX];
+    char raw[PATH_MAX];
+    const char* src = device;
+    int ret = -1;
+
+    if (get_raw_device(type, partition, device) != 0) {
+        // no block device to read, so dump a plain image next to the sparse one
+        sprintf(raw, "%s.raw", filename);
+        if (0 != (ret = backup_raw_partition(partitionType, partition, raw))) {
+            unlink(raw);
+            return ret;
+        }
+        src = raw;
+        ret = -1;
+    }
+
+    int in = raw_open(src, O_RDONLY, 0);
+    if (in < 0) {
+        printf("error opening %s\n", src);
+        goto done;
+    }
+    off64_t size = lseek64(in, 0, SEEK_END);
+    if (size >= 0 && lseek64(in, 0, SEEK_SET) == 0)
+        ret = sparse_image_encode(raw_fd_read, &in, size, write_func, out);
+    close(in);
+done:
+    if (src == raw)
+        unlink(raw);
+    return ret;
+}
+
+int backup_raw_partition_sparse(const char* partitionType, const char *partition, const char *filename)
+{
+    int out = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0666);
+    if (out < 0) {
+        printf("error opening %s\n", filename);
+        return -1;
+    }
+    int ret = backup_raw_partition_sparse_to(partitionType, partition, filename, raw_fd_write, &out);
+    if (ret == 0)
+        ret = fsync(out);
+    if (close(out) != 0)
+        ret = -1;
+    if (ret != 0)
+        unlink(filename);
+    return ret;
+}
+
 int erase_raw_partition(const char* partitionType, const char *partition)
 {
     int type = detect_partition(partitionType, partition);
@@ -1,6 +1,9 @@
 #ifndef FLASHUTILS_H
 #define FLASHUTILS_H
 
+#include <stdint.h>
+#include <sys/types.h>
+
 int restore_raw_partition(const char* partitionType, const char *partition, const char *filename);
 int backup_raw_partition(const char* partitionType, const char *partition, const char *filename);
 int erase_raw_partition(const char* partitionType, const char *partition);
@@ -8,6 +11,47 @@ int erase_partition(const char *partition, const char *filesystem);
 int mount_partition(const char *partition, const char *mount_point, const char *filesystem, int read_only);
 int get_partition_device(const char *partition, char *device);
 
+// Sparse raw images store runs of all 0x00 or all 0xff blocks as a count.
+// backup_raw_partition_sparse writes one, restore_raw_partition replays
+// either kind of image.
+#define SPARSE_IMAGE_MAGIC  "NANDSPRS"
+#define SPARSE_BLOCK_SIZE   4096
+
+int backup_raw_partition_sparse(const char* partitionType, const char *partition, const char *filename);
+int is_sparse_image(const char* filename);
+
+// Copies everything 'read_func' returns to 'write_func', with the reads done
+// on a separate thread into a ring of buffers. 'copied', if not NULL, gets
+// the number of bytes written. Returns 0 on success.
+typedef ssize_t (*raw_read_func)(void* cookie, char* data, size_t len);
+typedef int (*raw_write_func)(void* cookie, const char* data, size_t len);
+
+// Both go through raw_copy: the encoder works on the buffers of its reader
+// thread, and the replay expands the image on that thread while the caller
+// writes to 'out'.
+int sparse_image_encode(raw_read_func read_func, void* in, uint64_t size, raw_write_func write_func, void* out);
+int sparse_image_replay(raw_read_func read_func, void* in, int out);
+
+int raw_copy(raw_read_func read_func, void* in, raw_write_func write_func, void* out, uint64_t* copied);
+
+// restore_raw_partition, but the sparse or plain image comes from
+// 'read_func'. Only partitions that raw_partition_streamable says so about
+// can be restored this way.
+int raw_partition_streamable(const char* partitionType, const char *partition);
+int restore_raw_partition_stream(const char* partitionType, const char *partition, int sparse, raw_read_func read_func, void* in);
+
+// backup_raw_partition_sparse, but the image goes to 'write_func'. 'filename'
+// only names the plain dump made when the partition has no block device.
+int backup_raw_partition_sparse_to(const char* partitionType, const char *partition, const char *filename, raw_write_func write_func, void* out);
+
+// open() for raw copies: block devices get O_DIRECT when available, and
+// everything is read ahead sequentially.
+int raw_open(const char* path, int flags, int mode);
+
+// raw_copy callbacks for a file descriptor, passed as an int*.
+ssize_t raw_fd_read(void* cookie, char* data, size_t len);
+int raw_fd_write(void* cookie, const char* data, size_t len);
+
 #define FLASH_MTD 0
 #define FLASH_MMC 1
 #define FLASH_BML 2
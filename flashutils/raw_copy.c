@@ -0,0 +1,211 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include "flashutils/flashutils.h"
+
+// A reader thread fills a ring of large aligned buffers while the calling
+// thread drains them, so flash and sdcard latencies overlap instead of
+// adding up.
+
+#define RAW_COPY_BUFFERS    4
+#define RAW_COPY_CHUNK      (1024 * 1024)
+#define RAW_COPY_ALIGN      4096
+
+#ifndef POSIX_FADV_SEQUENTIAL
+#define POSIX_FADV_SEQUENTIAL 2
+#endif
+
+struct raw_pipe {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char* data[RAW_COPY_BUFFERS];
+    ssize_t len[RAW_COPY_BUFFERS];
+    int head;       // next buffer the reader fills
+    int tail;       // next buffer the writer drains
+    int count;      // filled buffers
+    int eof;
+    int error;
+    int abort;
+    raw_read_func read_func;
+    void* in;
+};
+
+// bionic has no posix_fadvise, so go through the syscall. The arm variant
+// takes the advice second, with every argument passed as a 32 bit word.
+static void fadvise_sequential(int fd) {
+#if defined(__NR_arm_fadvise64_64)
+    syscall(__NR_arm_fadvise64_64, fd, POSIX_FADV_SEQUENTIAL, 0, 0, 0, 0);
+#elif defined(__NR_fadvise64)
+    syscall(__NR_fadvise64, fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+int raw_open(const char* path, int flags, int mode) {
+    int fd = -1;
+#if !defined(BOARD_RAW_COPY_NO_O_DIRECT) && defined(O_DIRECT)
+    struct stat st;
+    // only the flash side bypasses the page cache, and only if it can
+    if ((flags & O_CREAT) == 0 && stat(path, &st) == 0 && S_ISBLK(st.st_mode))
+        fd = open(path, flags | O_LARGEFILE | O_DIRECT, mode);
+#endif
+    if (fd < 0)
+        fd = open(path, flags | O_LARGEFILE, mode);
+    if (fd >= 0)
+        fadvise_sequential(fd);
+    return fd;
+}
+
+// O_DIRECT transfers must be aligned; the last one of an image often is
+// not, so drop O_DIRECT and retry once when the kernel refuses.
+static int clear_direct(int fd) {
+#ifdef O_DIRECT
+    int flags = fcntl(fd, F_GETFL);
+    if (flags != -1 && (flags & O_DIRECT) != 0)
+        return fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+#endif
+    return -1;
+}
+
+ssize_t raw_fd_read(void* cookie, char* data, size_t len) {
+    int fd = *(int*)cookie;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = read(fd, data + done, len - done);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0 && errno == EINVAL && clear_direct(fd) == 0)
+            continue;
+        if (r < 0)
+            return -1;
+        if (r == 0)
+            break;
+        done += r;
+    }
+    return done;
+}
+
+int raw_fd_write(void* cookie, const char* data, size_t len) {
+    int fd = *(int*)cookie;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t w = write(fd, data + done, len - done);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w < 0 && errno == EINVAL && clear_direct(fd) == 0)
+            continue;
+        if (w <= 0)
+            return -1;
+        done += w;
+    }
+    return 0;
+}
+
+static void* raw_reader(void* cookie) {
+    struct raw_pipe* p = (struct raw_pipe*) cookie;
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        while (p->count == RAW_COPY_BUFFERS && !p->abort)
+            pthread_cond_wait(&p->cond, &p->lock);
+        int slot = p->head;
+        int abort = p->abort;
+        pthread_mutex_unlock(&p->lock);
+        if (abort)
+            break;
+
+        ssize_t len = p->read_func(p->in, p->data[slot], RAW_COPY_CHUNK);
+
+        pthread_mutex_lock(&p->lock);
+        if (len <= 0) {
+            p->error = len < 0;
+            p->eof = 1;
+        }
+        else {
+            p->len[slot] = len;
+            p->head = (slot + 1) % RAW_COPY_BUFFERS;
+            p->count++;
+        }
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+        if (len <= 0)
+            break;
+    }
+    return NULL;
+}
+
+int raw_copy(raw_read_func read_func, void* in, raw_write_func write_func, void* out, uint64_t* copied) {
+    struct raw_pipe p;
+    pthread_t reader;
+    uint64_t total = 0;
+    int i, ret = 0;
+
+    memset(&p, 0, sizeof(p));
+    p.read_func = read_func;
+    p.in = in;
+    for (i = 0; i < RAW_COPY_BUFFERS; i++) {
+        p.data[i] = (char*) memalign(RAW_COPY_ALIGN, RAW_COPY_CHUNK);
+        if (p.data[i] == NULL) {
+            printf("out of memory for the copy buffers\n");
+            ret = -1;
+            goto done;
+        }
+    }
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.cond, NULL);
+    if (pthread_create(&reader, NULL, raw_reader, &p) != 0) {
+        ret = -1;
+        goto destroy;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&p.lock);
+        while (p.count == 0 && !p.eof)
+            pthread_cond_wait(&p.cond, &p.lock);
+        int slot = p.tail;
+        int count = p.count;
+        pthread_mutex_unlock(&p.lock);
+        if (count == 0)
+            break;
+
+        if (write_func(out, p.data[slot], p.len[slot]) != 0) {
+            printf("error writing at %llu: %s\n", total, strerror(errno));
+            ret = -1;
+            break;
+        }
+        total += p.len[slot];
+
+        pthread_mutex_lock(&p.lock);
+        p.tail = (slot + 1) % RAW_COPY_BUFFERS;
+        p.count--;
+        pthread_cond_broadcast(&p.cond);
+        pthread_mutex_unlock(&p.lock);
+    }
+
+    pthread_mutex_lock(&p.lock);
+    p.abort = 1;
+    pthread_cond_broadcast(&p.cond);
+    pthread_mutex_unlock(&p.lock);
+    pthread_join(reader, NULL);
+    if (p.error) {
+        printf("error reading at %llu\n", total);
+        ret = -1;
+    }
+destroy:
+    pthread_cond_destroy(&p.cond);
+    pthread_mutex_destroy(&p.lock);
+done:
+    for (i = 0; i < RAW_COPY_BUFFERS; i++)
+        free(p.data[i]);
+    if (copied != NULL)
+        *copied = total;
+    return ret;
+}
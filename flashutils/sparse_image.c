@@ -0,0 +1,353 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "flashutils/flashutils.h"
+
+// Sparse raw image layout, all fields little endian:
+//
+//   header: magic[8] block_size(4) reserved(4) size(8)
+//   chunk:  type(4) blocks(4), followed by the data for SPARSE_DATA
+//
+// Chunks cover the image in order until 'size' bytes are accounted for.
+// Only the last block may be partial, and a data chunk that ends the image
+// carries just the bytes up to 'size'.
+
+#define SPARSE_DATA         0
+#define SPARSE_FILL_00      1
+#define SPARSE_FILL_FF      2
+
+#define SPARSE_BUFFER_BLOCKS 256
+
+struct sparse_header {
+    char magic[8];
+    uint32_t block_size;
+    uint32_t reserved;
+    uint64_t size;
+};
+
+struct sparse_chunk {
+    uint32_t type;
+    uint32_t blocks;
+};
+
+static ssize_t read_full(int fd, void* data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = read(fd, (char*)data + done, len - done);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            return -1;
+        if (r == 0)
+            break;
+        done += r;
+    }
+    return done;
+}
+
+static int write_full(int fd, const void* data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t w = write(fd, (const char*)data + done, len - done);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return -1;
+        done += w;
+    }
+    return 0;
+}
+
+static int block_type(const unsigned char* block, size_t len) {
+    if (block[0] != 0x00 && block[0] != 0xff)
+        return SPARSE_DATA;
+    if (len > 1 && memcmp(block, block + 1, len - 1) != 0)
+        return SPARSE_DATA;
+    return block[0] == 0x00 ? SPARSE_FILL_00 : SPARSE_FILL_FF;
+}
+
+int is_sparse_image(const char* filename) {
+    struct sparse_header h;
+    int fd = open(filename, O_RDONLY | O_LARGEFILE);
+    if (fd < 0)
+        return 0;
+    int ret = read_full(fd, &h, sizeof(h)) == sizeof(h) &&
+            memcmp(h.magic, SPARSE_IMAGE_MAGIC, sizeof(h.magic)) == 0;
+    close(fd);
+    return ret;
+}
+
+// The encoder is raw_copy's writer: it gets the image in the reader's
+// buffers and writes the chunks out as it goes. A buffer that does not end
+// on a block keeps its tail in 'carry' for the next one.
+struct sparse_encoder {
+    raw_write_func write_func;
+    void* out;
+    uint64_t size;
+    uint64_t done;
+    struct sparse_chunk run;
+    unsigned char* carry;
+    size_t carry_len;
+};
+
+static int encoder_write(struct sparse_encoder* e, const void* data, size_t len) {
+    return e->write_func(e->out, (const char*)data, len);
+}
+
+static int write_chunk(struct sparse_encoder* e, uint32_t type, uint32_t blocks, const void* data, size_t len) {
+    struct sparse_chunk c;
+    c.type = type;
+    c.blocks = blocks;
+    if (encoder_write(e, &c, sizeof(c)) != 0)
+        return -1;
+    if (type == SPARSE_DATA && encoder_write(e, data, len) != 0)
+        return -1;
+    return 0;
+}
+
+// Fill runs may span several buffers, data runs are written per buffer.
+// Only the last block of the image may be short.
+static int encode_blocks(struct sparse_encoder* e, const unsigned char* buf, size_t len) {
+    const size_t bs = SPARSE_BLOCK_SIZE;
+    size_t i, data_start = 0, data_count = 0;
+    size_t count = (len + bs - 1) / bs;
+    if (e->done + len > e->size) {
+        printf("raw image larger than the %llu bytes expected\n", e->size);
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        size_t blen = len - i * bs < bs ? len - i * bs : bs;
+        int type = block_type(buf + i * bs, blen);
+        if (type == SPARSE_DATA) {
+            if (e->run.blocks != 0 && write_chunk(e, e->run.type, e->run.blocks, NULL, 0) != 0)
+                return -1;
+            e->run.blocks = 0;
+            if (data_count++ == 0)
+                data_start = i;
+            continue;
+        }
+        if (data_count != 0) {
+            if (write_chunk(e, SPARSE_DATA, data_count, buf + data_start * bs, data_count * bs) != 0)
+                return -1;
+            data_count = 0;
+        }
+        if (e->run.blocks != 0 && e->run.type != (uint32_t)type) {
+            if (write_chunk(e, e->run.type, e->run.blocks, NULL, 0) != 0)
+                return -1;
+            e->run.blocks = 0;
+        }
+        e->run.type = type;
+        e->run.blocks++;
+    }
+    if (data_count != 0 &&
+            write_chunk(e, SPARSE_DATA, data_count, buf + data_start * bs, len - data_start * bs) != 0)
+        return -1;
+    e->done += len;
+    return 0;
+}
+
+static int sparse_encoder_write(void* cookie, const char* data, size_t len) {
+    struct sparse_encoder* e = (struct sparse_encoder*)cookie;
+    const size_t bs = SPARSE_BLOCK_SIZE;
+    const unsigned char* p = (const unsigned char*)data;
+    if (e->carry_len != 0) {
+        size_t n = bs - e->carry_len < len ? bs - e->carry_len : len;
+        memcpy(e->carry + e->carry_len, p, n);
+        e->carry_len += n;
+        p += n;
+        len -= n;
+        if (e->carry_len < bs)
+            return 0;
+        if (encode_blocks(e, e->carry, bs) != 0)
+            return -1;
+        e->carry_len = 0;
+    }
+    size_t whole = len - len % bs;
+    if (whole != 0 && encode_blocks(e, p, whole) != 0)
+        return -1;
+    memcpy(e->carry, p + whole, len - whole);
+    e->carry_len = len - whole;
+    return 0;
+}
+
+int sparse_image_encode(raw_read_func read_func, void* in, uint64_t size, raw_write_func write_func, void* out) {
+    struct sparse_encoder e;
+    struct sparse_header h;
+    int ret = -1;
+
+    memset(&e, 0, sizeof(e));
+    e.write_func = write_func;
+    e.out = out;
+    e.size = size;
+    e.run.type = SPARSE_DATA;
+    e.carry = (unsigned char*) malloc(SPARSE_BLOCK_SIZE);
+    if (e.carry == NULL)
+        return -1;
+
+    memcpy(h.magic, SPARSE_IMAGE_MAGIC, sizeof(h.magic));
+    h.block_size = SPARSE_BLOCK_SIZE;
+    h.reserved = 0;
+    h.size = size;
+    if (encoder_write(&e, &h, sizeof(h)) != 0)
+        goto done;
+    if (raw_copy(read_func, in, sparse_encoder_write, &e, NULL) != 0)
+        goto done;
+    if (e.carry_len != 0 && encode_blocks(&e, e.carry, e.carry_len) != 0)
+        goto done;
+    if (e.done != size) {
+        printf("raw image ended at %llu of %llu bytes\n", e.done, size);
+        goto done;
+    }
+    if (e.run.blocks != 0 && write_chunk(&e, e.run.type, e.run.blocks, NULL, 0) != 0)
+        goto done;
+    ret = 0;
+done:
+    free(e.carry);
+    return ret;
+}
+
+// The decoder is raw_copy's reader: it expands the sparse image from
+// 'read_func' into the reader's buffers, holes included, and the writer
+// puts them on the device.
+struct sparse_decoder {
+    raw_read_func read_func;
+    void* in;
+    struct sparse_header h;
+    uint32_t type;
+    uint64_t left;      // of the current chunk
+    uint64_t offset;
+};
+
+static ssize_t read_exactly(struct sparse_decoder* d, void* data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = d->read_func(d->in, (char*)data + done, len - done);
+        if (r < 0)
+            return -1;
+        if (r == 0)
+            break;
+        done += r;
+    }
+    return done;
+}
+
+static ssize_t sparse_decoder_read(void* cookie, char* data, size_t len) {
+    struct sparse_decoder* d = (struct sparse_decoder*)cookie;
+    size_t done = 0;
+    while (done < len && d->offset < d->h.size) {
+        if (d->left == 0) {
+            struct sparse_chunk c;
+            if (read_exactly(d, &c, sizeof(c)) != sizeof(c) || c.blocks == 0 || c.type > SPARSE_FILL_FF) {
+                printf("sparse image truncated or corrupt at %llu\n", d->offset);
+                return -1;
+            }
+            d->type = c.type;
+            d->left = (uint64_t)c.blocks * d->h.block_size;
+            if (d->left > d->h.size - d->offset)
+                d->left = d->h.size - d->offset;
+        }
+        size_t n = len - done < d->left ? len - done : d->left;
+        if (d->type != SPARSE_DATA) {
+            memset(data + done, d->type == SPARSE_FILL_00 ? 0x00 : 0xff, n);
+        }
+        else if (read_exactly(d, data + done, n) != (ssize_t)n) {
+            printf("sparse image truncated at %llu\n", d->offset);
+            return -1;
+        }
+        done += n;
+        d->left -= n;
+        d->offset += n;
+    }
+    return done;
+}
+
+// Blocks that only hold a fill byte are compared to what the device has
+// and left alone if they match, which spares the flash the writes on an
+// erased or zeroed partition.
+struct replay_sink {
+    int fd;
+    uint64_t offset;
+    unsigned char* scratch;
+};
+
+static int replay_write_at(struct replay_sink* s, uint64_t offset, const void* data, size_t len) {
+    if (lseek64(s->fd, offset, SEEK_SET) != (off64_t)offset || write_full(s->fd, data, len) != 0) {
+        printf("error writing at %llu: %s\n", offset, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int replay_sink_write(void* cookie, const char* data, size_t len) {
+    struct replay_sink* s = (struct replay_sink*)cookie;
+    const size_t bs = SPARSE_BLOCK_SIZE;
+    const unsigned char* p = (const unsigned char*)data;
+    size_t i = 0;
+    while (i < len) {
+        // a run of data blocks goes out in one write
+        size_t start = i;
+        while (i < len && block_type(p + i, len - i < bs ? len - i : bs) == SPARSE_DATA)
+            i += len - i < bs ? len - i : bs;
+        if (i > start && replay_write_at(s, s->offset + start, p + start, i - start) != 0)
+            return -1;
+        // then a run of fill blocks, checked against the device first
+        start = i;
+        while (i < len && i - start < bs * SPARSE_BUFFER_BLOCKS &&
+                block_type(p + i, len - i < bs ? len - i : bs) != SPARSE_DATA)
+            i += len - i < bs ? len - i : bs;
+        if (i == start)
+            continue;
+        ssize_t have = 0;
+        if (lseek64(s->fd, s->offset + start, SEEK_SET) == (off64_t)(s->offset + start))
+            have = read_full(s->fd, s->scratch, i - start);
+        if (have < 0)
+            have = 0;
+        size_t j;
+        for (j = start; j < i; j += bs) {
+            size_t blen = i - j < bs ? i - j : bs;
+            if (j - start + blen <= (size_t)have && memcmp(s->scratch + j - start, p + j, blen) == 0)
+                continue;
+            if (replay_write_at(s, s->offset + j, p + j, blen) != 0)
+                return -1;
+        }
+    }
+    s->offset += len;
+    return 0;
+}
+
+int sparse_image_replay(raw_read_func read_func, void* in, int out) {
+    struct sparse_decoder d;
+    struct replay_sink sink;
+    uint64_t copied = 0;
+    int ret = -1;
+
+    memset(&d, 0, sizeof(d));
+    d.read_func = read_func;
+    d.in = in;
+    if (read_exactly(&d, &d.h, sizeof(d.h)) != sizeof(d.h) ||
+            memcmp(d.h.magic, SPARSE_IMAGE_MAGIC, sizeof(d.h.magic)) != 0 ||
+            d.h.block_size != SPARSE_BLOCK_SIZE) {
+        printf("not a sparse image\n");
+        return -1;
+    }
+    sink.fd = out;
+    sink.offset = 0;
+    sink.scratch = (unsigned char*) malloc(SPARSE_BLOCK_SIZE * SPARSE_BUFFER_BLOCKS);
+    if (sink.scratch == NULL)
+        return -1;
+    if (raw_copy(sparse_decoder_read, &d, replay_sink_write, &sink, &copied) == 0) {
+        if (copied != d.h.size)
+            printf("sparse image truncated at %llu\n", copied);
+        else
+            ret = 0;
+    }
+    free(sink.scratch);
+    return ret;
+}
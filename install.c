@@ -36,6 +36,7 @@
 #include "firmware.h"
 
 #include "extendedcommands.h"
+#include "midnight.h"
 
 
 #define ASSUMED_UPDATE_BINARY_NAME  "META-INF/com/google/android/update-binary"
@@ -326,8 +327,8 @@ exit:
     return NULL;
 }
 
-int
-install_package(const char *path)
+static int
+really_install_package(const char *path)
 {
     ui_set_background(BACKGROUND_ICON_INSTALLING);
     ui_print("Finding update package...\n");
@@ -381,3 +382,12 @@ install_package(const char *path)
     ui_print("Installing update...\n");
     return try_update_binary(path, &zip);
 }
+
+int
+install_package(const char *path)
+{
+    performance_profile_begin();
+    int result = really_install_package(path);
+    performance_profile_end();
+    return result;
+}
@@ -32,10 +32,13 @@
  */
 
 #include <sys/param.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 
 #include <signal.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -50,6 +53,30 @@ static struct pid {
 	pid_t pid;
 } *pidlist;
 
+/*
+ * Nandroid runs several backups at once, so the list is guarded. Both
+ * ends of a new pipe are close-on-exec from the start, so children forked
+ * meanwhile by other threads (__popen or __system) never inherit them.
+ * Without pipe2 the flags are set right after pipe(), and __system takes
+ * the same lock around its vfork to stay out of that window.
+ */
+pthread_mutex_t __popen_lock = PTHREAD_MUTEX_INITIALIZER;
+#define pidlist_lock __popen_lock
+
+static int
+pipe_cloexec(int pdes[2])
+{
+#if defined(__NR_pipe2) && defined(O_CLOEXEC)
+	if (syscall(__NR_pipe2, pdes, O_CLOEXEC) == 0)
+		return (0);
+#endif
+	if (pipe(pdes) < 0)
+		return (-1);
+	(void)fcntl(pdes[0], F_SETFD, FD_CLOEXEC);
+	(void)fcntl(pdes[1], F_SETFD, FD_CLOEXEC);
+	return (0);
+}
+
 FILE *
 __popen(const char *program, const char *type)
 {
@@ -66,13 +93,16 @@ __popen(const char *program, const char *type)
 	if ((cur = malloc(sizeof(struct pid))) == NULL)
 		return (NULL);
 
-	if (pipe(pdes) < 0) {
+	pthread_mutex_lock(&pidlist_lock);
+	if (pipe_cloexec(pdes) < 0) {
+		pthread_mutex_unlock(&pidlist_lock);
 		free(cur);
 		return (NULL);
 	}
 
 	switch (pid = vfork()) {
 	case -1:			/* Error. */
+		pthread_mutex_unlock(&pidlist_lock);
 		(void)close(pdes[0]);
 		(void)close(pdes[1]);
 		free(cur);
@@ -96,17 +126,20 @@ __popen(const char *program, const char *type)
 			 * We must NOT modify pdes, due to the
 			 * semantics of vfork.
 			 */
+			/* dup2 leaves the copy open across exec */
 			if (tpdes1 != STDOUT_FILENO) {
 				(void)dup2(tpdes1, STDOUT_FILENO);
 				(void)close(tpdes1);
 				tpdes1 = STDOUT_FILENO;
-			}
+			} else
+				(void)fcntl(tpdes1, F_SETFD, 0);
 		} else {
 			(void)close(pdes[1]);
 			if (pdes[0] != STDIN_FILENO) {
 				(void)dup2(pdes[0], STDIN_FILENO);
 				(void)close(pdes[0]);
-			}
+			} else
+				(void)fcntl(pdes[0], F_SETFD, 0);
 		}
 		execl(_PATH_BSHELL, "sh", "-c", program, (char *)NULL);
 		_exit(127);
@@ -122,12 +155,12 @@ __popen(const char *program, const char *type)
 		iop = fdopen(pdes[1], type);
 		(void)close(pdes[0]);
 	}
-
 	/* Link into list of file descriptors. */
 	cur->fp = iop;
 	cur->pid =  pid;
 	cur->next = pidlist;
 	pidlist = cur;
+	pthread_mutex_unlock(&pidlist_lock);
 
 	return (iop);
 }
@@ -145,24 +178,27 @@ __pclose(FILE *iop)
 	pid_t pid;
 
 	/* Find the appropriate file pointer. */
+	pthread_mutex_lock(&pidlist_lock);
 	for (last = NULL, cur = pidlist; cur; last = cur, cur = cur->next)
 		if (cur->fp == iop)
 			break;
 
-	if (cur == NULL)
+	if (cur == NULL) {
+		pthread_mutex_unlock(&pidlist_lock);
 		return (-1);
-
-	(void)fclose(iop);
-
-	do {
-		pid = waitpid(cur->pid, &pstat, 0);
-	} while (pid == -1 && errno == EINTR);
+	}
 
 	/* Remove the entry from the linked list. */
 	if (last == NULL)
 		pidlist = cur->next;
 	else
 		last->next = cur->next;
+	(void)fclose(iop);
+	pthread_mutex_unlock(&pidlist_lock);
+
+	do {
+		pid = waitpid(cur->pid, &pstat, 0);
+	} while (pid == -1 && errno == EINTR);
 	free(cur);
 
 	return (pid == -1 ? -1 : pstat);
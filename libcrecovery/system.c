@@ -29,6 +29,7 @@
  */
 
 #include <sys/types.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -38,6 +39,8 @@
 #include "defines.h"
 
 extern char **environ;
+/* see popen.c, keeps this vfork out of a pipe's setup in __popen */
+extern pthread_mutex_t __popen_lock;
 
 int
 __system(const char *command)
@@ -56,8 +59,10 @@ __system(const char *command)
 	sigemptyset(&mask);
 	sigaddset(&mask, SIGCHLD);
 	sigprocmask(SIG_BLOCK, &mask, &omask);
+	pthread_mutex_lock(&__popen_lock);
 	switch (pid = vfork()) {
 	case -1:			/* error */
+		pthread_mutex_unlock(&__popen_lock);
 		sigprocmask(SIG_SETMASK, &omask, NULL);
 		return(-1);
 	case 0:				/* child */
@@ -65,6 +70,7 @@ __system(const char *command)
 		execve(_PATH_BSHELL, argp, environ);
     _exit(127);
   }
+	pthread_mutex_unlock(&__popen_lock);
 
 	intsave = (sig_t)  bsd_signal(SIGINT, SIG_IGN);
 	quitsave = (sig_t) bsd_signal(SIGQUIT, SIG_IGN);
@@ -16,6 +16,7 @@
  */
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
@@ -1063,3 +1064,154 @@ void mngb_menu() {
 
 }
 
+/*
+ * Throughput profile for nandroid, installs and wipes. The governor, max.
+ * frequency and I/O scheduler chosen in the menus above are for the booted
+ * system; while a long operation runs recovery switches the live kernel to
+ * the performance governor, pinned at the max. frequency already set,
+ * deadline (or noop) scheduling and a large readahead on the sdcard, then
+ * puts back whatever was there.
+ * Calls nest, only the outermost pair switches. Touch
+ * /sdcard/clockworkmod/.noperformanceprofile to leave the settings alone.
+ */
+
+#define PROFILE_MAX_SETTINGS    32
+#define PROFILE_READAHEAD_KB    2048
+
+struct profile_setting {
+    char path[PATH_MAX];
+    char value[64];
+};
+
+static struct profile_setting profile_saved[PROFILE_MAX_SETTINGS];
+static int profile_saved_count = 0;
+static int profile_depth = 0;
+
+static int read_setting(const char* path, char* value, int size) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    if (fgets(value, size, f) == NULL) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    value[strcspn(value, "\n")] = '\0';
+    return 0;
+}
+
+static int write_setting(const char* path, const char* value) {
+    FILE* f = fopen(path, "w");
+    if (f == NULL)
+        return -1;
+    int ret = fprintf(f, "%s\n", value) < 0;
+    if (fclose(f) != 0)
+        ret = -1;
+    return ret;
+}
+
+// Remembers the current value of 'path' and writes 'value' over it.
+static void profile_set(const char* path, const char* current, const char* value) {
+    if (strcmp(current, value) == 0 || profile_saved_count == PROFILE_MAX_SETTINGS)
+        return;
+    if (write_setting(path, value) != 0) {
+        LOGW("Unable to set %s to %s\n", path, value);
+        return;
+    }
+    struct profile_setting* p = &profile_saved[profile_saved_count++];
+    strcpy(p->path, path);
+    strncpy(p->value, current, sizeof(p->value) - 1);
+    p->value[sizeof(p->value) - 1] = '\0';
+}
+
+// The max. frequency the user chose stays the cap: overclocked kernels
+// report more than is safe in cpuinfo_max_freq.
+static void profile_set_cpu(int cpu) {
+    char path[PATH_MAX];
+    char current[64];
+    char max[64];
+    sprintf(path, "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_max_freq", cpu);
+    if (read_setting(path, max, sizeof(max)) != 0)
+        return;
+    sprintf(path, "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_governor", cpu);
+    if (read_setting(path, current, sizeof(current)) == 0)
+        profile_set(path, current, "performance");
+    // holds the cap even where the governor could not be switched
+    sprintf(path, "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_min_freq", cpu);
+    if (read_setting(path, current, sizeof(current)) == 0)
+        profile_set(path, current, max);
+}
+
+// 'available' reads like "noop [deadline] cfq", the bracketed one is active.
+static void profile_set_scheduler(const char* device) {
+    char path[PATH_MAX];
+    char available[128];
+    char current[64];
+    sprintf(path, "/sys/block/%s/queue/scheduler", device);
+    if (read_setting(path, available, sizeof(available)) != 0)
+        return;
+    char* start = strchr(available, '[');
+    char* end = start != NULL ? strchr(start, ']') : NULL;
+    if (end == NULL)
+        return;
+    *end = '\0';
+    strcpy(current, start + 1);
+    *end = ']';
+    if (strstr(available, "deadline") != NULL)
+        profile_set(path, current, "deadline");
+    else if (strstr(available, "noop") != NULL)
+        profile_set(path, current, "noop");
+}
+
+static void profile_set_readahead(const char* device) {
+    char path[PATH_MAX];
+    char current[64];
+    char value[16];
+    sprintf(path, "/sys/block/%s/queue/read_ahead_kb", device);
+    if (read_setting(path, current, sizeof(current)) != 0 || atoi(current) >= PROFILE_READAHEAD_KB)
+        return;
+    sprintf(value, "%d", PROFILE_READAHEAD_KB);
+    profile_set(path, current, value);
+}
+
+void performance_profile_begin(void) {
+    struct stat file_info;
+    if (profile_depth++ != 0)
+        return;
+    profile_saved_count = 0;
+    if (stat("/sdcard/clockworkmod/.noperformanceprofile", &file_info) == 0)
+        return;
+
+    int cpu;
+    for (cpu = 0; cpu < 8; cpu++)
+        profile_set_cpu(cpu);
+
+    DIR* dir = opendir("/sys/block");
+    if (dir == NULL)
+        return;
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strncmp(de->d_name, "mmcblk", 6) != 0 && strncmp(de->d_name, "mtdblock", 8) != 0 &&
+                strncmp(de->d_name, "stl", 3) != 0 && strncmp(de->d_name, "bml", 3) != 0)
+            continue;
+        profile_set_scheduler(de->d_name);
+        // the sdcard and internal storage; flash partitions gain nothing
+        if (strncmp(de->d_name, "mmcblk", 6) == 0)
+            profile_set_readahead(de->d_name);
+    }
+    closedir(dir);
+    if (profile_saved_count != 0)
+        LOGI("Performance profile on, %d settings changed\n", profile_saved_count);
+}
+
+void performance_profile_end(void) {
+    if (profile_depth == 0 || --profile_depth != 0)
+        return;
+    // in reverse, so scaling_min_freq drops back while the performance
+    // governor still runs, and the old governor starts from its own floor
+    while (profile_saved_count > 0) {
+        struct profile_setting* p = &profile_saved[--profile_saved_count];
+        if (write_setting(p->path, p->value) != 0)
+            LOGW("Unable to restore %s to %s\n", p->path, p->value);
+    }
+}
@@ -32,4 +32,9 @@ int get_partition_free(const char *partition);
 int file_exists(const char *filename);
 int show_file_exists(const char *pre, const char *filename, const char *ui_filename, const char *post, const char *post_no);
 
+// Switch the running kernel to a throughput profile for the duration of a
+// nandroid, install or wipe. Calls nest.
+void performance_profile_begin(void);
+void performance_profile_end(void);
+
 #endif //_MIDNIGHT_H
@@ -406,6 +406,7 @@ static int write_block(MtdWriteContext *ctx, const char *data)
     if (pos == (off_t) -1) return 1;
 
     ssize_t size = partition->erase_size;
+    int erased = data[0] == (char) 0xff && memcmp(data, data + 1, size - 1) == 0;
     while (pos + size <= (int) partition->size) {
         loff_t bpos = pos;
         int ret = ioctl(fd, MEMGETBADBLOCK, &bpos);
@@ -428,8 +429,10 @@ static int write_block(MtdWriteContext *ctx, const char *data)
                         pos, strerror(errno));
                 continue;
             }
-            if (lseek(fd, pos, SEEK_SET) != pos ||
-                write(fd, data, size) != size) {
+            // an erased block already reads back as all 0xff
+            if (!erased &&
+                (lseek(fd, pos, SEEK_SET) != pos ||
+                 write(fd, data, size) != size)) {
                 fprintf(stderr, "mtd: write error at 0x%08lx (%s)\n",
                         pos, strerror(errno));
             }
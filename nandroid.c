@@ -19,6 +19,7 @@
 
 #include <signal.h>
 #include <sys/wait.h>
+#include <pthread.h>
 
 #include "bootloader.h"
 #include "common.h"
@@ -33,13 +34,23 @@
 #include "../../external/yaffs2/yaffs2/utils/mkyaffs2image.h"
 #include "../../external/yaffs2/yaffs2/utils/unyaffs.h"
 
+#include <sys/mount.h>
+#include <sys/sysinfo.h>
 #include <sys/vfs.h>
 
 #include "extendedcommands.h"
+#include "midnight.h"
 #include "nandroid.h"
+#include "nandroid_gzip.h"
+#include "nandroid_journal.h"
+#include "nandroid_md5.h"
+#include "nandroid_stats.h"
+#include "nandroid_stream.h"
+#include "nandroid_tar.h"
 #include "mounts.h"
 
 #include "flashutils/flashutils.h"
+#include "make_ext4fs.h"
 #include <libgen.h>
 
 void nandroid_generate_timestamp_path(const char* backup_path)
@@ -63,69 +74,368 @@ static int print_and_error(const char* message) {
     return 1;
 }
 
-static int yaffs_files_total = 0;
-static int yaffs_files_count = 0;
+// Backups of several partitions may run at once and share the progress bar.
+// It counts the bytes read from the partitions, which grows far more evenly
+// than a file count on /data, and lets the remaining time be estimated.
+static pthread_mutex_t yaffs_progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t progress_bytes_total = 0;
+static uint64_t progress_bytes_done = 0;
+static uint64_t progress_start = 0;
+
+static void progress_reset(uint64_t total)
+{
+    pthread_mutex_lock(&yaffs_progress_lock);
+    progress_bytes_total = total;
+    progress_bytes_done = 0;
+    progress_start = nandroid_stats_now();
+    pthread_mutex_unlock(&yaffs_progress_lock);
+}
+
+// Adds 'bytes' and shows 'name' (if not NULL) with the time left. Restores
+// do not know their total, they only show the names.
+static void progress_add_locked(uint64_t bytes, const char* name)
+{
+    progress_bytes_done += bytes;
+    uint64_t done = progress_bytes_done < progress_bytes_total ? progress_bytes_done : progress_bytes_total;
+    if (progress_bytes_total != 0)
+        ui_set_progress((float)done / (float)progress_bytes_total);
+    if (name == NULL)
+        return;
+
+    char eta[32];
+    uint64_t elapsed_ms = (nandroid_stats_now() - progress_start) / 1000;
+    eta[0] = '\0';
+    if (progress_bytes_total != 0 && done > progress_bytes_total / 100 && elapsed_ms > 3000) {
+        unsigned int left = (unsigned int)(elapsed_ms * (progress_bytes_total - done) / done / 1000);
+        sprintf(eta, "ETA %u:%02u ", left / 60, left % 60);
+    }
+    if (strlen(name) < 30)
+        ui_print("%s%s", eta, name);
+    ui_reset_text_col();
+}
+
+static void progress_add(uint64_t bytes)
+{
+    pthread_mutex_lock(&yaffs_progress_lock);
+    progress_add_locked(bytes, NULL);
+    pthread_mutex_unlock(&yaffs_progress_lock);
+}
+
+// Tools that only report file names (mkyaffs2image, unyaffs, dedupe): the
+// size is looked up, if the name is a path that can be found.
 static void yaffs_callback(const char* filename)
 {
     if (filename == NULL)
         return;
-    const char* justfile = basename(filename);
+    struct stat st;
     char tmp[PATH_MAX];
-    strcpy(tmp, justfile);
-    if (tmp[strlen(tmp) - 1] == '\n')
-        tmp[strlen(tmp) - 1] = NULL;
-    if (strlen(tmp) < 30)
-        ui_print("%s", tmp);
-    yaffs_files_count++;
-    if (yaffs_files_total != 0)
-        ui_set_progress((float)yaffs_files_count / (float)yaffs_files_total);
-    ui_reset_text_col();
+    strcpy(tmp, filename);
+    if (tmp[0] != '\0' && tmp[strlen(tmp) - 1] == '\n')
+        tmp[strlen(tmp) - 1] = '\0';
+    uint64_t bytes = lstat(tmp, &st) == 0 && S_ISREG(st.st_mode) ? st.st_size : 0;
+    pthread_mutex_lock(&yaffs_progress_lock);
+    progress_add_locked(bytes, basename(tmp));
+    pthread_mutex_unlock(&yaffs_progress_lock);
 }
 
-static void compute_directory_stats(const char* directory)
+// Everything below a folder, counted in one walk: entries the way find
+// counts them (the folder included), bytes of regular files, and the
+// space allocated for them. 'exclude' is a top level child to leave out.
+struct directory_stats {
+    uint64_t entries;
+    uint64_t bytes;
+    uint64_t used;
+};
+
+static void walk_directory(const char* path, const char* exclude, struct directory_stats* stats)
 {
-    char tmp[PATH_MAX];
-    sprintf(tmp, "find %s | wc -l > /tmp/dircount", directory);
-    __system(tmp);
-    char count_text[100];
-    FILE* f = fopen("/tmp/dircount", "r");
-    fread(count_text, 1, sizeof(count_text), f);
-    fclose(f);
-    yaffs_files_count = 0;
-    yaffs_files_total = atoi(count_text);
-    ui_reset_progress();
-    ui_show_progress(1, 0);
+    char child[PATH_MAX];
+    struct dirent* de;
+    struct stat st;
+    if (lstat(path, &st) != 0)
+        return;
+    stats->entries++;
+    stats->used += (uint64_t)st.st_blocks * 512;
+    if (S_ISREG(st.st_mode))
+        stats->bytes += st.st_size;
+    if (!S_ISDIR(st.st_mode))
+        return;
+    DIR* dir = opendir(path);
+    if (dir == NULL)
+        return;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        if (exclude != NULL && strcmp(de->d_name, exclude) == 0)
+            continue;
+        snprintf(child, sizeof(child), "%s/%s", path, de->d_name);
+        walk_directory(child, NULL, stats);
+    }
+    closedir(dir);
 }
 
 typedef void (*file_event_callback)(const char* filename);
 typedef int (*nandroid_backup_handler)(const char* backup_path, const char* backup_file_image, int callback);
 
+#define YAFFS_FIFO "/tmp/nandroid-yaffs2.fifo"
+
+struct yaffs_sink {
+    int fd;
+    struct md5_file *f;
+    int ret;
+};
+
+// Copies what mkyaffs2image writes into the fifo to the image, hashing it
+// on the way. Keeps draining after an error so mkyaffs2image never blocks.
+static void* yaffs_sink_thread(void* cookie) {
+    struct yaffs_sink *sink = (struct yaffs_sink*)cookie;
+    char buf[65536];
+    ssize_t r;
+    while ((r = read(sink->fd, buf, sizeof(buf))) != 0) {
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            sink->ret = -1;
+            break;
+        }
+        if (sink->ret == 0 && 0 != md5_file_write(sink->f, buf, r))
+            sink->ret = -1;
+    }
+    return NULL;
+}
+
+// mkyaffs2image writes its image in one pass, so it gets a fifo instead of
+// the file and the image is hashed as it goes to the sdcard.
 static int mkyaffs2image_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
     char backup_file_image_with_extension[PATH_MAX];
     sprintf(backup_file_image_with_extension, "%s.img", backup_file_image);
-    return mkyaffs2image(backup_path, backup_file_image_with_extension, 0, callback ? yaffs_callback : NULL);
+    struct yaffs_sink sink;
+    pthread_t thread;
+    int ret = -1;
+
+    unlink(YAFFS_FIFO);
+    if (mkfifo(YAFFS_FIFO, 0600) != 0) {
+        LOGE("Unable to create %s: %s\n", YAFFS_FIFO, strerror(errno));
+        return -1;
+    }
+    // our own write end keeps the fifo open until mkyaffs2image is done,
+    // even if it fails before opening it
+    sink.ret = 0;
+    sink.fd = open(YAFFS_FIFO, O_RDONLY | O_NONBLOCK);
+    int keep = sink.fd < 0 ? -1 : open(YAFFS_FIFO, O_WRONLY);
+    if (keep < 0 || fcntl(sink.fd, F_SETFL, 0) != 0) {
+        LOGE("Unable to open %s: %s\n", YAFFS_FIFO, strerror(errno));
+        goto fail;
+    }
+    if (NULL == (sink.f = md5_file_open(backup_file_image_with_extension)))
+        goto fail;
+    if (pthread_create(&thread, NULL, yaffs_sink_thread, &sink) != 0) {
+        LOGE("Unable to start the yaffs2 writer\n");
+        md5_file_close(sink.f);
+        unlink(backup_file_image_with_extension);
+        goto fail;
+    }
+
+    ret = mkyaffs2image(backup_path, YAFFS_FIFO, 0, callback ? yaffs_callback : NULL);
+    close(keep);
+    keep = -1;
+    pthread_join(thread, NULL);
+    if (sink.ret != 0 || 0 != md5_file_close(sink.f)) {
+        ui_print("Error writing %s\n", backup_file_image_with_extension);
+        ret = -1;
+    }
+fail:
+    if (keep >= 0)
+        close(keep);
+    if (sink.fd >= 0)
+        close(sink.fd);
+    unlink(YAFFS_FIFO);
+    return ret;
 }
 
-static int tar_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
+// 'cookie' holds the archive bytes already counted.
+static void tar_compress_callback(const char* name, uint64_t bytes, void* cookie) {
+    uint64_t* counted = (uint64_t*)cookie;
     char tmp[PATH_MAX];
+    strcpy(tmp, name);
+    pthread_mutex_lock(&yaffs_progress_lock);
+    progress_add_locked(bytes - *counted, basename(tmp));
+    pthread_mutex_unlock(&yaffs_progress_lock);
+    *counted = bytes;
+}
+
+static const char* tar_exclude(const char* backup_path) {
     if (strcmp(backup_path, "/data") == 0 && volume_for_path("/sdcard") == NULL)
-      sprintf(tmp, "cd $(dirname %s) ; tar cvf %s.tar --exclude 'media' $(basename %s) ; exit $?", backup_path, backup_file_image, backup_path);
-    else
-      sprintf(tmp, "cd $(dirname %s) ; tar cvf %s.tar $(basename %s) ; exit $?", backup_path, backup_file_image, backup_path);
+        return "media";
+    return NULL;
+}
+
+// Every tar backup gets an index next to it, so single files and apps can
+// be restored without reading the whole archive.
+static int tar_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
+    char tmp[PATH_MAX];
+    char index[PATH_MAX];
+    sprintf(tmp, "%s.tar", backup_file_image);
+    sprintf(index, "%s" NANDROID_INDEX_SUFFIX, tmp);
+    uint64_t counted = 0;
+    struct md5_file *f = md5_file_open(tmp);
+    if (f == NULL)
+        return -1;
+    int ret = tar_create_stream(md5_file_write, f, backup_path, tar_exclude(backup_path), index, callback ? tar_compress_callback : NULL, &counted);
+    if (0 != md5_file_close(f)) {
+        ui_print("Error writing %s\n", tmp);
+        ret = -1;
+    }
+    return ret;
+}
+
+static int tar_gz_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
+    char tmp[PATH_MAX];
+    char index[PATH_MAX];
+    sprintf(tmp, "%s.tar.gz", backup_file_image);
+    sprintf(index, "%s" NANDROID_INDEX_SUFFIX, tmp);
+    uint64_t counted = 0;
+    struct md5_file *f = md5_file_open(tmp);
+    if (f == NULL)
+        return -1;
+    struct gz_writer *w = gz_writer_open_stream(md5_file_write, f, 0);
+    if (w == NULL) {
+        md5_file_close(f);
+        return -1;
+    }
+    int ret = tar_create_stream(gz_writer_write, w, backup_path, tar_exclude(backup_path), index, callback ? tar_compress_callback : NULL, &counted);
+    if (0 != gz_writer_close(w) || 0 != md5_file_close(f)) {
+        ui_print("Error writing %s\n", tmp);
+        ret = -1;
+    }
+    return ret;
+}
+
+int nandroid_get_default_backup_format() {
+    char fmt[16];
+    FILE* f = fopen(NANDROID_BACKUP_FORMAT_FILE, "r");
+    if (f == NULL)
+        return NANDROID_BACKUP_FORMAT_TAR;
+    int len = fread(fmt, 1, sizeof(fmt) - 1, f);
+    fclose(f);
+    fmt[len < 0 ? 0 : len] = '\0';
+    if (strncmp(fmt, "tgz", 3) == 0)
+        return NANDROID_BACKUP_FORMAT_TGZ;
+    if (strncmp(fmt, "dup", 3) == 0)
+        return NANDROID_BACKUP_FORMAT_DUP;
+    return NANDROID_BACKUP_FORMAT_TAR;
+}
+
+int nandroid_set_default_backup_format(int format) {
+    const char* fmt = "tar";
+    if (format == NANDROID_BACKUP_FORMAT_TGZ)
+        fmt = "tgz";
+    else if (format == NANDROID_BACKUP_FORMAT_DUP)
+        fmt = "dup";
+    if (ensure_path_mounted("/sdcard") != 0)
+        return -1;
+    mkdir("/sdcard/clockworkmod", 0755);
+    FILE* f = fopen(NANDROID_BACKUP_FORMAT_FILE, "w");
+    if (f == NULL)
+        return -1;
+    fprintf(f, "%s\n", fmt);
+    return fclose(f);
+}
 
+int nandroid_get_differential_restore() {
+    struct stat st;
+    return stat(NANDROID_RESTORE_MODE_FILE, &st) == 0;
+}
+
+int nandroid_set_differential_restore(int differential) {
+    if (ensure_path_mounted("/sdcard") != 0)
+        return -1;
+    if (!differential)
+        return unlink(NANDROID_RESTORE_MODE_FILE) == 0 || errno == ENOENT ? 0 : -1;
+    mkdir("/sdcard/clockworkmod", 0755);
+    FILE* f = fopen(NANDROID_RESTORE_MODE_FILE, "w");
+    if (f == NULL)
+        return -1;
+    return fclose(f);
+}
+
+static void ensure_directory(const char* dir);
+
+// Blobs are shared by all backups: <root>/backup/<name>/<partition>.<fs>
+// stores its content in <root>/blobs.
+static void nandroid_blob_dir(const char* backup_file_image, char* blob_dir) {
+    int i;
+    strcpy(blob_dir, backup_file_image);
+    for (i = 0; i < 3; i++) {
+        char* slash = strrchr(blob_dir, '/');
+        if (slash == NULL)
+            break;
+        *slash = '\0';
+    }
+    strcat(blob_dir, "/blobs");
+}
+
+// dedupe workers: one per core hashes, a second one per core keeps the
+// flash queue busy meanwhile.
+static int dedupe_jobs() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus * 2 : 2;
+}
+
+static int dedupe_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
+    char tmp[PATH_MAX];
+    char blob_dir[PATH_MAX];
+    nandroid_blob_dir(backup_file_image, blob_dir);
+    ensure_directory(blob_dir);
+
+    // large files are split into content defined chunks when asked to
+    struct stat st;
+    const char* chunking = stat("/sdcard/clockworkmod/.dedupechunks", &st) == 0 ? "-c " : "";
+    sprintf(tmp, "dedupe c -j %d %s%s %s %s.dup %s ; exit $?", dedupe_jobs(), chunking, backup_path, blob_dir, backup_file_image, tar_exclude(backup_path) != NULL ? "./media" : "");
     FILE *fp = __popen(tmp, "r");
     if (fp == NULL) {
-        ui_print("Unable to execute tar.\n");
+        ui_print("Unable to execute dedupe.\n");
         return -1;
     }
 
     while (fgets(tmp, PATH_MAX, fp) != NULL) {
         tmp[PATH_MAX - 1] = NULL;
-        if (callback)
+        if (!callback)
+            continue;
+        // dedupe names entries relative to the input folder
+        if (tmp[0] != '/') {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", backup_path, tmp);
+            yaffs_callback(path);
+        }
+        else
             yaffs_callback(tmp);
     }
 
-    return __pclose(fp);
+    int ret = __pclose(fp);
+    if (ret == 0) {
+        // the blobs are named after their SHA-256, only the manifest needs a sum
+        sprintf(tmp, "%s.dup", backup_file_image);
+        ret = nandroid_md5_add_file(tmp);
+    }
+    return ret;
+}
+
+static nandroid_backup_handler default_tar_handler() {
+    switch (nandroid_get_default_backup_format()) {
+        case NANDROID_BACKUP_FORMAT_TGZ:
+            return tar_gz_compress_wrapper;
+        case NANDROID_BACKUP_FORMAT_DUP:
+            return dedupe_compress_wrapper;
+    }
+    return tar_compress_wrapper;
+}
+
+int nandroid_dedupe_gc(const char* blob_dir) {
+    char tmp[PATH_MAX];
+    ui_print("Freeing space...\n");
+    sprintf(tmp, "dedupe gc %s $(find $(dirname %s)/backup -name '*.dup')", blob_dir, blob_dir);
+    return __system(tmp);
 }
 
 static nandroid_backup_handler get_backup_handler(const char *backup_path) {
@@ -141,7 +451,7 @@ static nandroid_backup_handler get_backup_handler(const char *backup_path) {
     }
 
     if (strcmp(backup_path, "/data") == 0 && is_data_media()) {
-        return tar_compress_wrapper;
+        return default_tar_handler();
     }
 
     // cwr5, we prefer tar for everything except yaffs2
@@ -156,75 +466,615 @@ static nandroid_backup_handler get_backup_handler(const char *backup_path) {
         return mkyaffs2image_wrapper;
     }
 
-    return tar_compress_wrapper;
+    return default_tar_handler();
 }
 
 
-int nandroid_backup_partition_extended(const char* backup_path, const char* mount_point, int umount_when_finished) {
-    int ret = 0;
-    char* name = basename(mount_point);
+// Partition backup scheduler.
+//
+// All volumes are mounted and measured up front, then the backups run on a
+// small pool of workers so raw dumps and archives of different partitions
+// overlap. Jobs that share state which is not reentrant (the flash dumpers
+// and mkyaffs2image) are kept in a lane and never run at the same time.
+#define BACKUP_LANE_NONE    -1
+#define BACKUP_LANE_RAW     0
+#define BACKUP_LANE_YAFFS   1
+
+#define BACKUP_TASK_PENDING 0
+#define BACKUP_TASK_RUNNING 1
+#define BACKUP_TASK_DONE    2
+
+#define MAX_BACKUP_TASKS    16
+
+struct backup_task {
+    char mount_point[PATH_MAX];
+    char image[PATH_MAX];
+    char name[PATH_MAX];
+    Volume* raw;
+    nandroid_backup_handler handler;
+    int umount_when_finished;
+    int callback;
+    int lane;
+    int entries;
+    uint64_t bytes;     // to read, for the progress bar
+    uint64_t used;      // allocated on the partition, for the estimate
+    uint64_t estimate;
+    struct nandroid_stats stats;
+    int state;
+    int ret;
+};
+
+struct backup_scheduler {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct backup_task tasks[MAX_BACKUP_TASKS];
+    int count;
+    int lanes_busy;
+    int failed;
+    const char* journal;    // backup folder, if the tasks are journaled
+};
+
+static void backup_scheduler_init(struct backup_scheduler* s) {
+    memset(s, 0, sizeof(*s));
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+}
+
+static struct backup_task* backup_scheduler_new_task(struct backup_scheduler* s) {
+    if (s->count == MAX_BACKUP_TASKS)
+        return NULL;
+    struct backup_task* t = &s->tasks[s->count++];
+    t->lane = BACKUP_LANE_NONE;
+    return t;
+}
+
+static uint64_t raw_partition_size(Volume* v);
+
+static int add_raw_backup_task(struct backup_scheduler* s, Volume* vol, const char* name, const char* image) {
+    struct backup_task* t = backup_scheduler_new_task(s);
+    if (t == NULL)
+        return print_and_error("Too many partitions to back up!\n");
+    strcpy(t->mount_point, vol->mount_point);
+    strcpy(t->image, image);
+    strcpy(t->name, name);
+    strncpy(t->stats.name, name, sizeof(t->stats.name) - 1);
+    t->raw = vol;
+    t->lane = BACKUP_LANE_RAW;
+    t->entries = 1;
+    // raw partitions are read in full
+    t->bytes = raw_partition_size(vol);
+    t->stats.files = 1;
+    return 0;
+}
 
+static int add_backup_task(struct backup_scheduler* s, const char* backup_path, const char* mount_point, int umount_when_finished) {
     struct stat file_info;
-    int callback = stat("/sdcard/clockworkmod/.hidenandroidprogress", &file_info) != 0;
-    
-    ui_print("Backing up %s...\n", name);
+    struct backup_task* t = backup_scheduler_new_task(s);
+    if (t == NULL)
+        return print_and_error("Too many partitions to back up!\n");
+    strcpy(t->mount_point, mount_point);
+    strcpy(t->name, basename(mount_point));
+    strncpy(t->stats.name, t->name, sizeof(t->stats.name) - 1);
+    t->umount_when_finished = umount_when_finished;
+    t->callback = stat("/sdcard/clockworkmod/.hidenandroidprogress", &file_info) != 0;
+
+    int ret;
+    uint64_t start = nandroid_stats_now();
     if (0 != (ret = ensure_path_mounted(mount_point) != 0)) {
         ui_print("Can't mount %s!\n", mount_point);
         return ret;
     }
-    compute_directory_stats(mount_point);
-    char tmp[PATH_MAX];
+    nandroid_stats_add(&t->stats, NANDROID_PHASE_MOUNT, start);
+    start = nandroid_stats_now();
+    struct directory_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    walk_directory(mount_point, tar_exclude(mount_point), &stats);
+    t->entries = stats.entries;
+    t->bytes = stats.bytes;
+    t->used = stats.used;
+    t->stats.files = t->entries;
+    nandroid_stats_add(&t->stats, NANDROID_PHASE_SCAN, start);
     scan_mounted_volumes();
     Volume *v = volume_for_path(mount_point);
     MountedVolume *mv = NULL;
     if (v != NULL)
         mv = find_mounted_volume_by_mount_point(v->mount_point);
     if (mv == NULL || mv->filesystem == NULL)
-        sprintf(tmp, "%s/%s.auto", backup_path, name);
+        sprintf(t->image, "%s/%s.auto", backup_path, t->name);
     else
-        sprintf(tmp, "%s/%s.%s", backup_path, name, mv->filesystem);
-    nandroid_backup_handler backup_handler = get_backup_handler(mount_point);
-    if (backup_handler == NULL) {
+        sprintf(t->image, "%s/%s.%s", backup_path, t->name, mv->filesystem);
+    t->handler = get_backup_handler(mount_point);
+    if (t->handler == NULL) {
         ui_print("Error finding an appropriate backup handler.\n");
         return -2;
     }
-    ret = backup_handler(mount_point, tmp, callback);
-    if (umount_when_finished) {
-        ensure_path_unmounted(mount_point);
-    }
-    if (0 != ret) {
-        ui_print("Error while making a backup image of %s!\n", mount_point);
-        return ret;
-    }
+    if (t->handler == mkyaffs2image_wrapper)
+        t->lane = BACKUP_LANE_YAFFS;
     return 0;
 }
 
-int nandroid_backup_partition(const char* backup_path, const char* root) {
+static int add_partition_backup_task(struct backup_scheduler* s, const char* backup_path, const char* root) {
     Volume *vol = volume_for_path(root);
     // make sure the volume exists before attempting anything...
     if (vol == NULL || vol->fs_type == NULL)
-        return NULL;
+        return 0;
 
     // see if we need a raw backup (mtd)
-    char tmp[PATH_MAX];
-    int ret;
     if (strcmp(vol->fs_type, "mtd") == 0 ||
             strcmp(vol->fs_type, "bml") == 0 ||
             strcmp(vol->fs_type, "emmc") == 0) {
+        char tmp[PATH_MAX];
         const char* name = basename(root);
-        sprintf(tmp, "%s/%s.img", backup_path, name);
-        ui_print("Backing up %s image...\n", name);
-        if (0 != (ret = backup_raw_partition(vol->fs_type, vol->device, tmp))) {
-            ui_print("Error while backing up %s image!", name);
+        sprintf(tmp, "%s/%s" NANDROID_SPARSE_SUFFIX, backup_path, name);
+        return add_raw_backup_task(s, vol, name, tmp);
+    }
+
+    return add_backup_task(s, backup_path, root, 1);
+}
+
+// Raw dumps are short and use the flash while archives wait on the sdcard,
+// so they go first; after that the biggest archive is started first.
+static struct backup_task* backup_scheduler_next(struct backup_scheduler* s) {
+    for (;;) {
+        struct backup_task* best = NULL;
+        int pending = 0;
+        int i;
+        if (s->failed)
+            return NULL;
+        for (i = 0; i < s->count; i++) {
+            struct backup_task* t = &s->tasks[i];
+            if (t->state != BACKUP_TASK_PENDING)
+                continue;
+            pending = 1;
+            if (t->lane != BACKUP_LANE_NONE && (s->lanes_busy & (1 << t->lane)))
+                continue;
+            if (t->raw != NULL)
+                return t;
+            if (best == NULL || t->bytes > best->bytes)
+                best = t;
+        }
+        if (best != NULL || !pending)
+            return best;
+        pthread_cond_wait(&s->cond, &s->lock);
+    }
+}
+
+static void backup_task_output(struct backup_task* t, char* path);
+
+// raw_write_func for md5_file, the raw images are hashed as they are written.
+static int md5_raw_write(void* cookie, const char* data, size_t len) {
+    return md5_file_write(cookie, data, len);
+}
+
+static int run_backup_task(struct backup_task* t) {
+    char path[PATH_MAX];
+    struct stat st;
+    int ret;
+    uint64_t start = nandroid_stats_now();
+    if (t->raw != NULL) {
+        ui_print("Backing up %s image...\n", t->name);
+        struct md5_file *f = md5_file_open(t->image);
+        if (f == NULL)
+            return -1;
+        ret = backup_raw_partition_sparse_to(t->raw->fs_type, t->raw->device, t->image, md5_raw_write, f);
+        if (0 != md5_file_close(f))
+            ret = -1;
+        nandroid_stats_add(&t->stats, NANDROID_PHASE_DATA, start);
+        if (ret != 0) {
+            ui_print("Error while backing up %s image!\n", t->name);
+            unlink(t->image);
             return ret;
         }
+        progress_add(t->bytes);
+    }
+    else {
+        ui_print("Backing up %s...\n", t->name);
+        if (0 != (ret = t->handler(t->mount_point, t->image, t->callback)))
+            ui_print("Error while making a backup image of %s!\n", t->mount_point);
+        nandroid_stats_add(&t->stats, NANDROID_PHASE_DATA, start);
+    }
+    backup_task_output(t, path);
+    if (stat(path, &st) == 0)
+        t->stats.bytes = st.st_size;
+    return ret;
+}
+
+static void backup_task_output(struct backup_task* t, char* path) {
+    const char* extension = "";
+    if (t->raw != NULL)
+        extension = "";
+    else if (t->handler == mkyaffs2image_wrapper)
+        extension = ".img";
+    else if (t->handler == tar_compress_wrapper)
+        extension = ".tar";
+    else if (t->handler == tar_gz_compress_wrapper)
+        extension = ".tar.gz";
+    else if (t->handler == dedupe_compress_wrapper)
+        extension = ".dup";
+    sprintf(path, "%s%s", t->image, extension);
+}
+
+// Once a task's file is on the sdcard it is recorded in the journal with
+// its size and digest, so an interrupted backup does not redo it.
+static void backup_task_commit(struct backup_scheduler* s, struct backup_task* t) {
+    char path[PATH_MAX];
+    char data[64];
+    char hex[33];
+    struct stat st;
+    backup_task_output(t, path);
+    if (stat(path, &st) != 0 || nandroid_md5_get_hex(path, hex) != 0)
+        return;
+    uint64_t start = nandroid_stats_now();
+    sync();
+    nandroid_stats_add(&t->stats, NANDROID_PHASE_SYNC, start);
+    sprintf(data, "%lld %s", (long long)st.st_size, hex);
+    pthread_mutex_lock(&s->lock);
+    journal_append(s->journal, NANDROID_BACKUP_JOURNAL, "done", basename(path), data);
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Skips the tasks an interrupted run of this backup already finished.
+static void backup_scheduler_resume(struct backup_scheduler* s) {
+    char path[PATH_MAX];
+    char data[64];
+    char hex[33];
+    long long size;
+    struct stat st;
+    int i;
+    for (i = 0; i < s->count; i++) {
+        struct backup_task* t = &s->tasks[i];
+        backup_task_output(t, path);
+        if (journal_find(s->journal, NANDROID_BACKUP_JOURNAL, "done", basename(path), data, sizeof(data)) != 0)
+            continue;
+        if (sscanf(data, "%lld %32s", &size, hex) != 2 || stat(path, &st) != 0 || st.st_size != size)
+            continue;
+        if (nandroid_md5_add_hex(path, hex) != 0)
+            continue;
+        ui_print("%s was backed up already, skipping.\n", t->name);
+        t->state = BACKUP_TASK_DONE;
+        t->ret = 0;
+        t->entries = 0;
+        t->bytes = 0;
+    }
+}
+
+static void* backup_worker(void* cookie) {
+    struct backup_scheduler* s = (struct backup_scheduler*)cookie;
+    struct backup_task* t;
+    pthread_mutex_lock(&s->lock);
+    while ((t = backup_scheduler_next(s)) != NULL) {
+        t->state = BACKUP_TASK_RUNNING;
+        if (t->lane != BACKUP_LANE_NONE)
+            s->lanes_busy |= 1 << t->lane;
+        pthread_mutex_unlock(&s->lock);
+
+        int ret = run_backup_task(t);
+        if (ret == 0 && s->journal != NULL)
+            backup_task_commit(s, t);
+        if (ret == 0) {
+            pthread_mutex_lock(&yaffs_progress_lock);
+            nandroid_stats_print(&t->stats);
+            pthread_mutex_unlock(&yaffs_progress_lock);
+        }
+
+        pthread_mutex_lock(&s->lock);
+        t->ret = ret;
+        t->state = BACKUP_TASK_DONE;
+        if (t->lane != BACKUP_LANE_NONE)
+            s->lanes_busy &= ~(1 << t->lane);
+        if (ret != 0)
+            s->failed = 1;
+        pthread_cond_broadcast(&s->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+static int nandroid_backup_jobs() {
+    char value[PROPERTY_VALUE_MAX];
+    property_get("ro.cwm.nandroid_jobs", value, "2");
+    int jobs = atoi(value);
+    return jobs < 1 ? 1 : jobs;
+}
+
+static int backup_scheduler_run(struct backup_scheduler* s) {
+    pthread_t workers[MAX_BACKUP_TASKS];
+    int jobs = nandroid_backup_jobs();
+    int i, started = 0, ret = 0;
+    if (jobs > s->count)
+        jobs = s->count;
+
+    uint64_t total = 0;
+    for (i = 0; i < s->count; i++) {
+        struct backup_task* t = &s->tasks[i];
+        if (t->state == BACKUP_TASK_PENDING)
+            total += t->bytes;
+    }
+    progress_reset(total);
+    ui_reset_progress();
+    ui_show_progress(1, 0);
+
+    for (i = 1; i < jobs; i++) {
+        if (pthread_create(&workers[started], NULL, backup_worker, s) == 0)
+            started++;
+    }
+    backup_worker(s);
+    for (i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+
+    for (i = 0; i < s->count; i++) {
+        struct backup_task* t = &s->tasks[i];
+        if (ret == 0 && t->state == BACKUP_TASK_DONE)
+            ret = t->ret;
+        // tasks skipped by a resume or the preflight have nothing to report
+        if (t->state == BACKUP_TASK_DONE && t->ret == 0 && t->stats.phase_us[NANDROID_PHASE_DATA] != 0) {
+            char dir[PATH_MAX];
+            strcpy(dir, t->image);
+            nandroid_stats_write(dirname(dir), "backup", &t->stats, 1);
+        }
+    }
+    return ret;
+}
+
+static void backup_scheduler_destroy(struct backup_scheduler* s) {
+    int i;
+    for (i = 0; i < s->count; i++) {
+        if (s->tasks[i].umount_when_finished)
+            ensure_path_unmounted(s->tasks[i].mount_point);
+    }
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->lock);
+}
+
+// Preflight space check. Estimates come from the allocated sizes and entry
+// counts gathered while queueing the tasks, so no files are read. They err
+// on the large side: used blocks include the slack of the last block of
+// every file. Raw partitions are small and are encoded once, without
+// writing anything, to get the size of their sparse images.
+
+// Share of the input a tar.gz is expected to take, in percent.
+#define BACKUP_GZIP_RATIO   75
+// Room left for nandroid.md5 and filesystem overhead on the sdcard.
+#define BACKUP_SPACE_MARGIN (4 * 1024 * 1024)
+
+static uint64_t raw_partition_size(Volume* v) {
+    if (v->device[0] == '/') {
+        int fd = open(v->device, O_RDONLY);
+        if (fd < 0)
+            return 0;
+        off64_t size = lseek64(fd, 0, SEEK_END);
+        close(fd);
+        return size < 0 ? 0 : size;
+    }
+
+    // mtd partitions are named, look them up in /proc/mtd
+    char line[128], name[64];
+    unsigned int size, erasesize;
+    uint64_t ret = 0;
+    FILE* f = fopen("/proc/mtd", "r");
+    if (f == NULL)
+        return 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "mtd%*d: %x %x \"%63[^\"]\"", &size, &erasesize, name) == 3 &&
+                strcmp(name, v->device) == 0) {
+            ret = size;
+            break;
+        }
+    }
+    fclose(f);
+    return ret;
+}
+
+static int count_write(void* cookie, const char* data, size_t len) {
+    *(uint64_t*)cookie += len;
+    return 0;
+}
+
+// Size of the sparse image of 'v', or of the whole partition when it has no
+// block device to read (mtd partitions are named, not opened).
+static uint64_t raw_partition_estimate(Volume* v) {
+    uint64_t size = raw_partition_size(v);
+    uint64_t bytes = 0;
+    if (v->device[0] != '/' || size == 0)
+        return size;
+    int fd = raw_open(v->device, O_RDONLY, 0);
+    if (fd < 0)
+        return size;
+    int ret = sparse_image_encode(raw_fd_read, &fd, size, count_write, &bytes);
+    close(fd);
+    return ret == 0 ? bytes : size;
+}
+
+// Bytes of the files in the newest manifest of the same partition in
+// another backup. gc keeps the blobs of every manifest, so those are in the
+// store and only what changed since is written again.
+static uint64_t dedupe_previous_bytes(const char* image) {
+    char root[PATH_MAX];
+    char manifest[PATH_MAX];
+    char line[PATH_MAX];
+    time_t newest = 0;
+    struct dirent* de;
+    struct stat st;
+
+    // image is <root>/backup/<name>/<partition>.<fs>
+    strcpy(root, image);
+    char* file = strrchr(root, '/');
+    if (file == NULL)
+        return 0;
+    *file++ = '\0';
+    char* name = strrchr(root, '/');
+    if (name == NULL)
+        return 0;
+    *name++ = '\0';
+    DIR* dir = opendir(root);
+    if (dir == NULL)
+        return 0;
+    manifest[0] = '\0';
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.' || strcmp(de->d_name, name) == 0)
+            continue;
+        snprintf(line, sizeof(line), "%s/%s/%s.dup", root, de->d_name, file);
+        if (stat(line, &st) == 0 && st.st_mtime >= newest) {
+            newest = st.st_mtime;
+            strcpy(manifest, line);
+        }
+    }
+    closedir(dir);
+    if (manifest[0] == '\0')
+        return 0;
+
+    // "f mode uid gid path digest size" and "c mode uid gid path size chunks",
+    // tab separated; the chunk lines that follow a 'c' are skipped
+    uint64_t bytes = 0;
+    int partial = 0;
+    sprintf(line, "dedupe t %s", manifest);
+    FILE* fp = __popen(line, "r");
+    if (fp == NULL)
+        return 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        int skip = partial;
+        partial = strchr(line, '\n') == NULL;
+        if (skip || (line[0] != 'f' && line[0] != 'c') || line[1] != '\t')
+            continue;
+        char* field = line;
+        int i;
+        for (i = 0; i < (line[0] == 'f' ? 6 : 5) && field != NULL; i++) {
+            field = strchr(field, '\t');
+            if (field != NULL)
+                field++;
+        }
+        if (field != NULL)
+            bytes += strtoull(field, NULL, 10);
+    }
+    if (__pclose(fp) != 0)
         return 0;
+    return bytes;
+}
+
+static uint64_t estimate_backup_task(struct backup_task* t) {
+    if (t->raw != NULL)
+        return raw_partition_estimate(t->raw);
+
+    // the scan already left /data/media out
+    uint64_t used = t->used;
+    uint64_t entries = t->entries;
+
+    if (t->handler == mkyaffs2image_wrapper)
+        return used / 2048 * 2112 + entries * 2112;
+    if (t->handler == dedupe_compress_wrapper) {
+        // what the previous backup stored is not written again; files that
+        // changed since are not told apart, so this can fall a bit short
+        uint64_t stored = dedupe_previous_bytes(t->image);
+        return (stored < used ? used - stored : 0) + entries * 128;
     }
+    if (t->handler == tar_gz_compress_wrapper)
+        return (used + entries * 512) * BACKUP_GZIP_RATIO / 100;
+    return used + entries * 512;
+}
 
-    return nandroid_backup_partition_extended(backup_path, root, 1);
+static uint64_t backup_scheduler_estimate(struct backup_scheduler* s) {
+    uint64_t total = 0;
+    int i;
+    for (i = 0; i < s->count; i++) {
+        if (s->tasks[i].state == BACKUP_TASK_PENDING)
+            total += s->tasks[i].estimate;
+    }
+    return total;
 }
 
-int nandroid_backup(const char* backup_path)
+static int nandroid_interactive = 1;
+
+// Journals the tasks, or picks up where an interrupted backup stopped.
+static int backup_journal_start(struct backup_scheduler* s, const char* backup_path, const char* type) {
+    s->journal = backup_path;
+    if (journal_exists(backup_path, NANDROID_BACKUP_JOURNAL)) {
+        ui_print("Resuming interrupted backup...\n");
+        backup_scheduler_resume(s);
+        return 0;
+    }
+    return journal_create(backup_path, NANDROID_BACKUP_JOURNAL, type);
+}
+
+// Returns 0 if the pending tasks fit on the sdcard, possibly after the user
+// chose to leave some partitions out.
+static int backup_preflight(struct backup_scheduler* s, const char* backup_path) {
+    struct statfs st;
+    int i;
+    if (statfs(backup_path, &st) != 0)
+        return print_and_error("Unable to stat /sdcard\n");
+    uint64_t free_space = (uint64_t)st.f_bavail * st.f_bsize;
+
+    for (i = 0; i < s->count; i++) {
+        uint64_t start = nandroid_stats_now();
+        s->tasks[i].estimate = estimate_backup_task(&s->tasks[i]);
+        nandroid_stats_add(&s->tasks[i].stats, NANDROID_PHASE_SCAN, start);
+    }
+
+    for (;;) {
+        uint64_t needed = backup_scheduler_estimate(s) + BACKUP_SPACE_MARGIN;
+        ui_print("Estimated backup size: %lluMB\n", needed / (1024 * 1024));
+        if (needed <= free_space)
+            return 0;
+
+        ui_print("Not enough free space on /sdcard for this backup!\n");
+        if (!nandroid_interactive)
+            return -1;
+
+        char title[64];
+        char* headers[] = { title, "Leave out a partition to continue:", "", NULL };
+        char* items[MAX_BACKUP_TASKS + 2];
+        char labels[MAX_BACKUP_TASKS][64];
+        int index[MAX_BACKUP_TASKS];
+        int count = 0;
+        sprintf(title, "Need %lluMB, %lluMB free.", needed / (1024 * 1024), free_space / (1024 * 1024));
+        items[count] = "Cancel backup";
+        for (i = 0; i < s->count; i++) {
+            struct backup_task* t = &s->tasks[i];
+            if (t->state != BACKUP_TASK_PENDING || t->estimate == 0)
+                continue;
+            sprintf(labels[count], "Skip %s (%lluMB)", t->name, t->estimate / (1024 * 1024));
+            index[count] = i;
+            items[count + 1] = labels[count];
+            count++;
+        }
+        items[count + 1] = NULL;
+
+        int chosen_item = get_menu_selection(headers, items, 0, 0);
+        if (chosen_item < 1 || chosen_item > count)
+            return -1;
+        struct backup_task* t = &s->tasks[index[chosen_item - 1]];
+        ui_print("Skipping %s.\n", t->name);
+        t->state = BACKUP_TASK_DONE;
+        t->ret = 0;
+        t->entries = 0;
+    }
+}
+
+int nandroid_backup_partition_extended(const char* backup_path, const char* mount_point, int umount_when_finished) {
+    struct backup_scheduler s;
+    backup_scheduler_init(&s);
+    int ret = add_backup_task(&s, backup_path, mount_point, umount_when_finished);
+    if (ret == 0)
+        ret = backup_preflight(&s, backup_path);
+    if (ret == 0)
+        ret = backup_scheduler_run(&s);
+    backup_scheduler_destroy(&s);
+    return ret;
+}
+
+int nandroid_backup_partition(const char* backup_path, const char* root) {
+    struct backup_scheduler s;
+    backup_scheduler_init(&s);
+    int ret = add_partition_backup_task(&s, backup_path, root);
+    if (ret == 0)
+        ret = backup_preflight(&s, backup_path);
+    if (ret == 0)
+        ret = backup_scheduler_run(&s);
+    backup_scheduler_destroy(&s);
+    return ret;
+}
+
+static int really_nandroid_backup(const char* backup_path)
 {
     ui_set_background(BACKGROUND_ICON_INSTALLING);
     
@@ -246,41 +1096,41 @@ int nandroid_backup(const char* backup_path)
     uint64_t sdcard_free = bavail * bsize;
     uint64_t sdcard_free_mb = sdcard_free / (uint64_t)(1024 * 1024);
     ui_print("SD Card space free: %lluMB\n", sdcard_free_mb);
-    if (sdcard_free_mb < 150)
-        ui_print("There may not be enough free space to complete backup... continuing...\n");
     
     char tmp[PATH_MAX];
     sprintf(tmp, "mkdir -p %s", backup_path);
     __system(tmp);
+    nandroid_md5_reset();
 
-    if (0 != (ret = nandroid_backup_partition(backup_path, "/boot")))
-        return ret;
+    struct backup_scheduler sched;
+    backup_scheduler_init(&sched);
 
-    if (0 != (ret = nandroid_backup_partition(backup_path, "/recovery")))
-        return ret;
+    if (0 != (ret = add_partition_backup_task(&sched, backup_path, "/boot")))
+        goto fail;
+
+    if (0 != (ret = add_partition_backup_task(&sched, backup_path, "/recovery")))
+        goto fail;
 
     Volume *vol = volume_for_path("/wimax");
     if (vol != NULL && 0 == stat(vol->device, &s))
     {
         char serialno[PROPERTY_VALUE_MAX];
-        ui_print("Backing up WiMAX...\n");
         serialno[0] = 0;
         property_get("ro.serialno", serialno, "");
-        sprintf(tmp, "%s/wimax.%s.img", backup_path, serialno);
-        ret = backup_raw_partition(vol->fs_type, vol->device, tmp);
-        if (0 != ret)
-            return print_and_error("Error while dumping WiMAX image!\n");
+        sprintf(tmp, "%s/wimax.%s" NANDROID_SPARSE_SUFFIX, backup_path, serialno);
+        if (0 != (ret = add_raw_backup_task(&sched, vol, "WiMAX", tmp)))
+            goto fail;
     }
 
-    if (0 != (ret = nandroid_backup_partition(backup_path, "/system")))
-        return ret;
+    if (0 != (ret = add_partition_backup_task(&sched, backup_path, "/system")))
+        goto fail;
 
-    if (0 != (ret = nandroid_backup_partition(backup_path, "/data")))
-        return ret;
+    if (0 != (ret = add_partition_backup_task(&sched, backup_path, "/data")))
+        goto fail;
 
     if (has_datadata()) {
-        if (0 != (ret = nandroid_backup_partition(backup_path, "/dbdata")))
-            return ret;
+        if (0 != (ret = add_partition_backup_task(&sched, backup_path, "/dbdata")))
+            goto fail;
     }
 
     if (0 != stat("/sdcard/.android_secure", &s))
@@ -289,11 +1139,23 @@ int nandroid_backup(const char* backup_path)
     }
     else
     {
-        if (0 != (ret = nandroid_backup_partition_extended(backup_path, "/sdcard/.android_secure", 0)))
-            return ret;
+        if (0 != (ret = add_backup_task(&sched, backup_path, "/sdcard/.android_secure", 0)))
+            goto fail;
     }
 
-    if (0 != (ret = nandroid_backup_partition_extended(backup_path, "/cache", 0)))
+    if (0 != (ret = add_backup_task(&sched, backup_path, "/cache", 0)))
+        goto fail;
+
+    if (0 != (ret = backup_journal_start(&sched, backup_path, "full")))
+        goto fail;
+
+    if (0 != (ret = backup_preflight(&sched, backup_path)))
+        goto fail;
+
+    ret = backup_scheduler_run(&sched);
+fail:
+    backup_scheduler_destroy(&sched);
+    if (0 != ret)
         return ret;
 
     /*
@@ -312,11 +1174,11 @@ int nandroid_backup(const char* backup_path)
     }
     */
     ui_print("Generating md5 sum...\n");
-    sprintf(tmp, "nandroid-md5.sh %s", backup_path);
-    if (0 != (ret = __system(tmp))) {
+    if (0 != (ret = nandroid_md5_write(backup_path))) {
         ui_print("Error while generating md5 sum!\n");
         return ret;
     }
+    journal_remove(backup_path, NANDROID_BACKUP_JOURNAL);
     
     sync();
     ui_set_background(BACKGROUND_ICON_NONE);
@@ -325,7 +1187,15 @@ int nandroid_backup(const char* backup_path)
     return 0;
 }
 
-int nandroid_backup_selective(const char* backup_path, const int backuptype)
+int nandroid_backup(const char* backup_path)
+{
+    performance_profile_begin();
+    int ret = really_nandroid_backup(backup_path);
+    performance_profile_end();
+    return ret;
+}
+
+static int really_nandroid_backup_selective(const char* backup_path, const int backuptype)
 {
     ui_set_background(BACKGROUND_ICON_INSTALLING);
     ui_print("\nNandroid partition backup\n");
@@ -345,19 +1215,38 @@ int nandroid_backup_selective(const char* backup_path, const int backuptype)
     char tmp[PATH_MAX];
     sprintf(tmp, "mkdir -p %s", backup_path);
     __system(tmp);
+    nandroid_md5_reset();
     
     if(backuptype == 2){        // data + dbdata
         ui_print("Starting /data + /dbdata backup...\n");        
-        if (0 != (ret = nandroid_backup_partition(backup_path, "/data")))
+        struct backup_scheduler sched;
+        backup_scheduler_init(&sched);
+        ret = add_partition_backup_task(&sched, backup_path, "/data");
+        if (ret == 0 && has_datadata())
+            ret = add_partition_backup_task(&sched, backup_path, "/dbdata");
+        if (ret == 0)
+            ret = backup_journal_start(&sched, backup_path, "data");
+        if (ret == 0)
+            ret = backup_preflight(&sched, backup_path);
+        if (ret == 0)
+            ret = backup_scheduler_run(&sched);
+        backup_scheduler_destroy(&sched);
+        if (0 != ret)
             return ret;
-        if (has_datadata()) {
-            if (0 != (ret = nandroid_backup_partition(backup_path, "/dbdata")))
-                return ret;
-        }
     }else if (backuptype == 1){ // system
         ui_print("Starting /system backup...\n");        
-        if (0 != (ret = nandroid_backup_partition(backup_path, "/system")))
-            return ret;        
+        struct backup_scheduler sched;
+        backup_scheduler_init(&sched);
+        ret = add_partition_backup_task(&sched, backup_path, "/system");
+        if (ret == 0)
+            ret = backup_journal_start(&sched, backup_path, "system");
+        if (ret == 0)
+            ret = backup_preflight(&sched, backup_path);
+        if (ret == 0)
+            ret = backup_scheduler_run(&sched);
+        backup_scheduler_destroy(&sched);
+        if (0 != ret)
+            return ret;
     }else{
         ui_print("Backup type unsupported, exiting...");
         return -1;
@@ -365,11 +1254,11 @@ int nandroid_backup_selective(const char* backup_path, const int backuptype)
     
     
     ui_print("Generating md5 sum...\n");
-    sprintf(tmp, "nandroid-md5.sh %s", backup_path);
-    if (0 != (ret = __system(tmp))) {
+    if (0 != (ret = nandroid_md5_write(backup_path))) {
         ui_print("Error while generating md5 sum!\n");
         return ret;
     }
+    journal_remove(backup_path, NANDROID_BACKUP_JOURNAL);
     
     sync();
     ui_set_background(BACKGROUND_ICON_NONE);
@@ -378,6 +1267,56 @@ int nandroid_backup_selective(const char* backup_path, const int backuptype)
     return 0;
 }
 
+int nandroid_backup_selective(const char* backup_path, const int backuptype)
+{
+    performance_profile_begin();
+    int ret = really_nandroid_backup_selective(backup_path, backuptype);
+    performance_profile_end();
+    return ret;
+}
+
+// The most recent backup folder with a journal, ie. an unfinished backup.
+static int find_interrupted_backup(char* backup_path) {
+    const char* root = "/sdcard/clockworkmod/backup";
+    char path[PATH_MAX];
+    time_t newest = 0;
+    struct dirent* de;
+    struct stat st;
+    DIR* dir = opendir(root);
+    if (dir == NULL)
+        return -1;
+    backup_path[0] = '\0';
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s/%s", root, de->d_name, NANDROID_BACKUP_JOURNAL);
+        if (stat(path, &st) == 0 && st.st_mtime >= newest) {
+            newest = st.st_mtime;
+            snprintf(backup_path, PATH_MAX, "%s/%s", root, de->d_name);
+        }
+    }
+    closedir(dir);
+    return backup_path[0] != '\0' ? 0 : -1;
+}
+
+int nandroid_resume_backup()
+{
+    char backup_path[PATH_MAX];
+    char type[32];
+    if (ensure_path_mounted("/sdcard") != 0)
+        return print_and_error("Can't mount /sdcard\n");
+    if (0 != find_interrupted_backup(backup_path))
+        return print_and_error("No interrupted backup found.\n");
+    if (0 != journal_type(backup_path, NANDROID_BACKUP_JOURNAL, type, sizeof(type)))
+        return print_and_error("Unable to read backup journal!\n");
+    ui_print("Continuing %s\n", backup_path);
+    if (strcmp(type, "system") == 0)
+        return nandroid_backup_selective(backup_path, 1);
+    if (strcmp(type, "data") == 0)
+        return nandroid_backup_selective(backup_path, 2);
+    return nandroid_backup(backup_path);
+}
+
 typedef int (*format_function)(char* root);
 
 static void ensure_directory(const char* dir) {
@@ -388,27 +1327,287 @@ static void ensure_directory(const char* dir) {
 
 typedef int (*nandroid_restore_handler)(const char* backup_file_image, const char* backup_path, int callback);
 
-static int unyaffs_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
-    return unyaffs(backup_file_image, backup_path, callback ? yaffs_callback : NULL);
+// Timings of the partition being restored, NULL outside nandroid_restore.
+static struct nandroid_stats* restore_stats = NULL;
+
+struct tar_extract_progress {
+    struct md5_reader* src;
+    uint64_t files;
+};
+
+// Progress follows the backup file as it is read from the sdcard, which
+// works the same for plain and compressed archives.
+static void tar_extract_callback(const char* name, uint64_t bytes, void* cookie) {
+    struct tar_extract_progress* p = (struct tar_extract_progress*)cookie;
+    uint64_t done, total;
+    p->files++;
+    md5_reader_progress(p->src, &done, &total);
+    if (total != 0)
+        ui_set_progress((float)done / (float)total);
 }
 
-static int tar_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+static int tar_extract_archive(tar_read_func read_func, void* in, struct md5_reader* src, const char* backup_file_image, const char* backup_path, int callback, int differential) {
     char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; tar xvf %s ; exit $?", backup_path, backup_file_image);
-
-    char path[PATH_MAX];
-    FILE *fp = __popen(tmp, "r");
-    if (fp == NULL) {
-        ui_print("Unable to execute tar.\n");
+    strcpy(tmp, backup_path);
+    if (callback) {
+        ui_reset_progress();
+        ui_show_progress(1, 0);
+    }
+    // the callback also counts the files, progress only shows if enabled
+    struct tar_extract_progress progress;
+    progress.src = src;
+    progress.files = 0;
+    int ret;
+    if (differential) {
+        // media is never part of the /data backup
+        const char* exclude = strcmp(backup_path, "/data") == 0 && is_data_media() ? "media" : NULL;
+        // the md5s of the index spare reading the archive data of files
+        // that did not change
+        char index[PATH_MAX];
+        sprintf(index, "%s" NANDROID_INDEX_SUFFIX, backup_file_image);
+        ret = tar_update_stream(read_func, in, dirname(tmp), backup_path, exclude, index, tar_extract_callback, &progress);
+    }
+    else {
+        ret = tar_extract_stream(read_func, in, dirname(tmp), tar_extract_callback, &progress);
+    }
+    if (restore_stats != NULL)
+        restore_stats->files += progress.files;
+    return ret;
+}
+
+// The backup is verified on the same read that restores it. A mismatch is
+// only known once everything was extracted, so the partition has to be
+// reported as broken rather than restored.
+static int verify_restored(struct md5_reader* r, int ret, const char* backup_file_image) {
+    if (0 != md5_reader_close(r, ret == 0) && ret == 0) {
+        ui_print("MD5 mismatch on %s!\n", basename(backup_file_image));
+        ui_print("The partition may be incomplete, restore a good backup.\n");
+        ret = -1;
+    }
+    return ret;
+}
+
+struct yaffs_source {
+    struct md5_reader *r;
+    volatile int stop;
+};
+
+// Feeds the backup to unyaffs through the fifo, hashing it on the way.
+// Opening the write end waits for unyaffs to open the fifo, so a small
+// image is not done before there is anyone to read it.
+static void* yaffs_source_thread(void* cookie) {
+    struct yaffs_source *src = (struct yaffs_source*)cookie;
+    char buf[65536];
+    ssize_t r;
+    // unyaffs may stop reading early, the write then fails with EPIPE
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    int fd = open(YAFFS_FIFO, O_WRONLY);
+    if (fd < 0)
+        return NULL;
+    while (!src->stop && (r = md5_reader_read(src->r, buf, sizeof(buf))) > 0) {
+        char *p = buf;
+        while (r > 0) {
+            ssize_t w = write(fd, p, r);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w <= 0)
+                break;
+            p += w;
+            r -= w;
+        }
+        if (r > 0)
+            break;
+    }
+    // unyaffs sees the end of the image
+    close(fd);
+    return NULL;
+}
+
+// unyaffs reads the image front to back, so like mkyaffs2image_wrapper it
+// gets a fifo and the backup is verified on the read that restores it.
+static int unyaffs_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+    struct yaffs_source src;
+    pthread_t thread;
+    char buf[65536];
+    ssize_t r;
+    int ret = -1;
+
+    if (NULL == (src.r = md5_reader_open(backup_file_image)))
+        return -1;
+    unlink(YAFFS_FIFO);
+    if (mkfifo(YAFFS_FIFO, 0600) != 0) {
+        LOGE("Unable to create %s: %s\n", YAFFS_FIFO, strerror(errno));
+        md5_reader_close(src.r, 0);
+        return -1;
+    }
+    src.stop = 0;
+    if (pthread_create(&thread, NULL, yaffs_source_thread, &src) != 0) {
+        LOGE("Unable to start the yaffs2 reader\n");
+        unlink(YAFFS_FIFO);
+        md5_reader_close(src.r, 0);
+        return -1;
+    }
+
+    ret = unyaffs(YAFFS_FIFO, backup_path, callback ? yaffs_callback : NULL);
+    // our own read end lets the thread finish, even if unyaffs failed
+    // before opening the fifo or stopped reading it early
+    src.stop = 1;
+    int keep = open(YAFFS_FIFO, O_RDONLY | O_NONBLOCK);
+    if (keep >= 0 && fcntl(keep, F_SETFL, 0) == 0) {
+        while ((r = read(keep, buf, sizeof(buf))) > 0 || (r < 0 && errno == EINTR))
+            ;
+    }
+    pthread_join(thread, NULL);
+    if (keep >= 0)
+        close(keep);
+    unlink(YAFFS_FIFO);
+    return verify_restored(src.r, ret, backup_file_image);
+}
+
+static int tar_restore(const char* backup_file_image, const char* backup_path, int callback, int differential) {
+    struct md5_reader *r = md5_reader_open(backup_file_image);
+    if (r == NULL)
+        return -1;
+    int ret = tar_extract_archive(md5_reader_read, r, r, backup_file_image, backup_path, callback, differential);
+    return verify_restored(r, ret, backup_file_image);
+}
+
+static int tar_gz_restore(const char* backup_file_image, const char* backup_path, int callback, int differential) {
+    uint64_t done, total;
+    struct md5_reader *r = md5_reader_open(backup_file_image);
+    if (r == NULL)
         return -1;
+    md5_reader_progress(r, &done, &total);
+    struct gz_reader *gz = gz_reader_open_stream(md5_reader_read, r, total, 0);
+    if (gz == NULL) {
+        md5_reader_close(r, 0);
+        return -1;
+    }
+
+    int ret = tar_extract_archive(gz_reader_read, gz, r, backup_file_image, backup_path, callback, differential);
+    if (0 != gz_reader_close(gz) && ret == 0) {
+        ui_print("%s is corrupt or truncated!\n", basename(backup_file_image));
+        ret = -1;
     }
+    return verify_restored(r, ret, backup_file_image);
+}
+
+static int tar_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+    return tar_restore(backup_file_image, backup_path, callback, 0);
+}
+
+static int tar_gz_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+    return tar_gz_restore(backup_file_image, backup_path, callback, 0);
+}
 
+// Differential restores leave the partition as it is and only write the
+// files that differ from the backup.
+static int tar_update_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+    return tar_restore(backup_file_image, backup_path, callback, 1);
+}
+
+static int tar_gz_update_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+    return tar_gz_restore(backup_file_image, backup_path, callback, 1);
+}
+
+// A differential restore needs the partition to already carry the file
+// system the backup was taken from, anything else is formatted.
+static nandroid_restore_handler get_update_handler(nandroid_restore_handler handler, const char* mount_point, const char* backup_filesystem) {
+    if (handler != tar_extract_wrapper && handler != tar_gz_extract_wrapper)
+        return NULL;
+    if (!nandroid_get_differential_restore())
+        return NULL;
+    if (0 != ensure_path_mounted(mount_point))
+        return NULL;
+    if (backup_filesystem != NULL) {
+        scan_mounted_volumes();
+        MountedVolume *mv = find_mounted_volume_by_mount_point(mount_point);
+        if (mv == NULL || strcmp(mv->filesystem, backup_filesystem) != 0)
+            return NULL;
+    }
+    return handler == tar_gz_extract_wrapper ? tar_gz_update_wrapper : tar_update_wrapper;
+}
+
+static int verify_backup_file(const char* backup_file_image) {
+    ui_print("Checking MD5 sum of %s...\n", basename(backup_file_image));
+    if (0 != nandroid_md5_check_file(backup_file_image))
+        return print_and_error("MD5 mismatch!\n");
+    return 0;
+}
+
+#define DEDUPE_MANIFEST "/tmp/nandroid-restore.dup"
+
+// Only the manifest of a dedupe backup is in nandroid.md5, the blobs are
+// named after their hash. It is read once from the sdcard into /tmp and
+// verified there, dedupe then restores from the copy.
+static int copy_dedupe_manifest(const char* backup_file_image) {
+    struct md5_reader *r = md5_reader_open(backup_file_image);
+    if (r == NULL)
+        return -1;
+    int fd = open(DEDUPE_MANIFEST, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        LOGE("Unable to create %s: %s\n", DEDUPE_MANIFEST, strerror(errno));
+        md5_reader_close(r, 0);
+        return -1;
+    }
+    char buf[65536];
+    ssize_t len;
+    int ret = 0;
+    while ((len = md5_reader_read(r, buf, sizeof(buf))) > 0) {
+        if (write(fd, buf, len) != len) {
+            LOGE("Unable to write %s: %s\n", DEDUPE_MANIFEST, strerror(errno));
+            ret = -1;
+            break;
+        }
+    }
+    if (len < 0)
+        ret = -1;
+    if (close(fd) != 0)
+        ret = -1;
+    if (0 != md5_reader_close(r, ret == 0) && ret == 0)
+        ret = print_and_error("MD5 mismatch!\n");
+    if (ret != 0)
+        unlink(DEDUPE_MANIFEST);
+    return ret;
+}
+
+static int dedupe_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+    char tmp[PATH_MAX];
+    char blob_dir[PATH_MAX];
+    ui_print("Checking MD5 sum of %s...\n", basename(backup_file_image));
+    if (0 != copy_dedupe_manifest(backup_file_image))
+        return -1;
+    nandroid_blob_dir(backup_file_image, blob_dir);
+    sprintf(tmp, "dedupe x -j %d %s %s %s ; exit $?", dedupe_jobs(), DEDUPE_MANIFEST, blob_dir, backup_path);
+
+    char path[PATH_MAX];
+    FILE *fp = __popen(tmp, "r");
+    if (fp == NULL) {
+        ui_print("Unable to execute dedupe.\n");
+        unlink(DEDUPE_MANIFEST);
+        return -1;
+    }
+
+    // the restored entries, relative to backup_path
     while (fgets(path, PATH_MAX, fp) != NULL) {
-        if (callback)
+        if (!callback)
+            continue;
+        if (path[0] != '/') {
+            char full_path[PATH_MAX];
+            snprintf(full_path, sizeof(full_path), "%s/%s", backup_path, path);
+            yaffs_callback(full_path);
+        }
+        else
             yaffs_callback(path);
     }
 
-    return __pclose(fp);
+    int ret = __pclose(fp);
+    unlink(DEDUPE_MANIFEST);
+    return ret;
 }
 
 static nandroid_restore_handler get_restore_handler(const char *backup_path) {
@@ -443,6 +1642,111 @@ static nandroid_restore_handler get_restore_handler(const char *backup_path) {
     return tar_extract_wrapper;
 }
 
+// An ext4 /system can be restored without creating every file on the flash
+// one by one: the archive is unpacked into RAM, and make_ext4fs builds the
+// file system from there straight onto the device, front to back in large
+// writes. Only done when the unpacked archive comfortably fits in free RAM.
+#define SYSTEM_IMAGE_STAGE      "/tmp/system-image"
+#define SYSTEM_IMAGE_RESERVE    (16 * 1024 * 1024)
+
+static int system_image_fits(const char* backup_file_image) {
+    char index[PATH_MAX];
+    uint64_t bytes, entries;
+    struct sysinfo info;
+    sprintf(index, "%s" NANDROID_INDEX_SUFFIX, backup_file_image);
+    if (0 != tar_index_size(index, &bytes, &entries) || 0 != sysinfo(&info))
+        return 0;
+    // tmpfs takes at least a page for every file
+    uint64_t needed = bytes + entries * 4096 + SYSTEM_IMAGE_RESERVE;
+    uint64_t available = ((uint64_t)info.freeram + info.bufferram) * info.mem_unit;
+    if (needed > available) {
+        LOGI("%lluMB free, %lluMB needed for an image restore\n", available >> 20, needed >> 20);
+        return 0;
+    }
+    return 1;
+}
+
+// make_ext4fs keeps the modes but makes everything root's, so the owners
+// are copied from the unpacked tree once the file system is mounted.
+static int copy_owners(const char* from, const char* to) {
+    char child_from[PATH_MAX];
+    char child_to[PATH_MAX];
+    struct dirent* de;
+    struct stat st;
+    int ret = 0;
+    if (lstat(from, &st) != 0)
+        return -1;
+    if ((st.st_uid != 0 || st.st_gid != 0) && lchown(to, st.st_uid, st.st_gid) != 0) {
+        LOGE("Unable to set the owner of %s: %s\n", to, strerror(errno));
+        ret = -1;
+    }
+    // chown clears the set-id bits
+    if ((st.st_uid != 0 || st.st_gid != 0) && !S_ISLNK(st.st_mode) && (st.st_mode & (S_ISUID | S_ISGID)))
+        chmod(to, st.st_mode & 07777);
+    if (!S_ISDIR(st.st_mode))
+        return ret;
+    DIR* dir = opendir(from);
+    if (dir == NULL)
+        return -1;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        snprintf(child_from, sizeof(child_from), "%s/%s", from, de->d_name);
+        snprintf(child_to, sizeof(child_to), "%s/%s", to, de->d_name);
+        if (copy_owners(child_from, child_to) != 0)
+            ret = -1;
+    }
+    closedir(dir);
+    return ret;
+}
+
+// Returns 1 if the image restore can not be used and the partition was not
+// touched, otherwise the result of the restore.
+static int system_image_restore(const char* backup_file_image, nandroid_restore_handler handler, const char* device, int callback) {
+    char stage[PATH_MAX];
+    char mount_point[PATH_MAX];
+    int ret;
+    if (!system_image_fits(backup_file_image))
+        return 1;
+    mkdir(SYSTEM_IMAGE_STAGE, 0755);
+    if (0 != mount("tmpfs", SYSTEM_IMAGE_STAGE, "tmpfs", MS_NOATIME, "mode=0755")) {
+        LOGI("Unable to mount tmpfs on " SYSTEM_IMAGE_STAGE ": %s\n", strerror(errno));
+        return 1;
+    }
+
+    // the archive holds "system/...", so it unpacks into the stage's system
+    sprintf(stage, "%s/system", SYSTEM_IMAGE_STAGE);
+    uint64_t start = nandroid_stats_now();
+    if (0 != (ret = handler(backup_file_image, stage, callback))) {
+        ui_print("Error while unpacking %s!\n", basename(backup_file_image));
+        goto done;
+    }
+    nandroid_stats_add(restore_stats, NANDROID_PHASE_DATA, start);
+
+    start = nandroid_stats_now();
+    ui_print("Writing /system image...\n");
+    ensure_path_unmounted("/system");
+    strcpy(mount_point, "/system");
+    reset_ext4fs_info();
+    if (0 != (ret = make_ext4fs(device, stage, mount_point, 0, 0, 0))) {
+        ui_print("Error while writing the /system image!\n");
+        goto done;
+    }
+    if (0 != (ret = ensure_path_mounted("/system"))) {
+        ui_print("Can't mount /system!\n");
+        goto done;
+    }
+    if (0 != (ret = copy_owners(stage, "/system")))
+        ui_print("Error while setting owners on /system!\n");
+    nandroid_stats_add(restore_stats, NANDROID_PHASE_FORMAT, start);
+
+done:
+    if (0 != umount(SYSTEM_IMAGE_STAGE))
+        LOGW("Unable to unmount " SYSTEM_IMAGE_STAGE ": %s\n", strerror(errno));
+    rmdir(SYSTEM_IMAGE_STAGE);
+    return ret;
+}
+
 int nandroid_restore_partition_extended(const char* backup_path, const char* mount_point, int umount_when_finished) {
     int ret = 0;
     char* name = basename(mount_point);
@@ -474,7 +1778,19 @@ int nandroid_restore_partition_extended(const char* backup_path, const char* mou
             sprintf(tmp, "%s/%s.%s.tar", backup_path, name, filesystem);
             if (0 == (ret = statfs(tmp, &file_info))) {
                 backup_filesystem = filesystem;
-                restore_handler = tar_extract_wrapper;
+                restore_handler = gz_is_block_compressed(tmp) ? tar_gz_extract_wrapper : tar_extract_wrapper;
+                break;
+            }
+            sprintf(tmp, "%s/%s.%s.tar.gz", backup_path, name, filesystem);
+            if (0 == (ret = statfs(tmp, &file_info))) {
+                backup_filesystem = filesystem;
+                restore_handler = tar_gz_extract_wrapper;
+                break;
+            }
+            sprintf(tmp, "%s/%s.%s.dup", backup_path, name, filesystem);
+            if (0 == (ret = statfs(tmp, &file_info))) {
+                backup_filesystem = filesystem;
+                restore_handler = dedupe_extract_wrapper;
                 break;
             }
             i++;
@@ -503,22 +1819,46 @@ int nandroid_restore_partition_extended(const char* backup_path, const char* mou
     ensure_directory(mount_point);
 
     int callback = stat("/sdcard/clockworkmod/.hidenandroidprogress", &file_info) != 0;
-    ui_print("Restoring %s...\n", name);
-    if (backup_filesystem == NULL) {
-        if (0 != (ret = format_volume(mount_point))) {
+    uint64_t start = nandroid_stats_now();
+    nandroid_restore_handler update_handler = get_update_handler(restore_handler, mount_point, backup_filesystem);
+    nandroid_stats_add(restore_stats, NANDROID_PHASE_MOUNT, start);
+    if (update_handler != NULL) {
+        ui_print("Updating %s...\n", name);
+        restore_handler = update_handler;
+    }
+    else {
+        ui_print("Restoring %s...\n", name);
+        if (backup_filesystem != NULL && strcmp(backup_filesystem, "ext4") == 0 && strcmp(mount_point, "/system") == 0 &&
+                (restore_handler == tar_extract_wrapper || restore_handler == tar_gz_extract_wrapper) &&
+                1 != (ret = system_image_restore(tmp, restore_handler, device, callback))) {
+            if (0 != ret) {
+                ui_print("Error while restoring %s!\n", mount_point);
+                return ret;
+            }
+            if (restore_stats != NULL && stat(tmp, &file_info) == 0)
+                restore_stats->bytes = file_info.st_size;
+            if (umount_when_finished)
+                ensure_path_unmounted(mount_point);
+            return 0;
+        }
+        start = nandroid_stats_now();
+        if (backup_filesystem == NULL)
+            ret = format_volume(mount_point);
+        else
+            ret = format_device(device, mount_point, backup_filesystem);
+        if (0 != ret) {
             ui_print("Error while formatting %s!\n", mount_point);
             return ret;
         }
-    }
-    else if (0 != (ret = format_device(device, mount_point, backup_filesystem))) {
-        ui_print("Error while formatting %s!\n", mount_point);
-        return ret;
+        nandroid_stats_add(restore_stats, NANDROID_PHASE_FORMAT, start);
     }
 
+    start = nandroid_stats_now();
     if (0 != (ret = ensure_path_mounted(mount_point))) {
         ui_print("Can't mount %s!\n", mount_point);
         return ret;
     }
+    nandroid_stats_add(restore_stats, NANDROID_PHASE_MOUNT, start);
 
     if (restore_handler == NULL)
         restore_handler = get_restore_handler(mount_point);
@@ -526,10 +1866,15 @@ int nandroid_restore_partition_extended(const char* backup_path, const char* mou
         ui_print("Error finding an appropriate restore handler.\n");
         return -2;
     }
+    start = nandroid_stats_now();
     if (0 != (ret = restore_handler(tmp, mount_point, callback))) {
         ui_print("Error while restoring %s!\n", mount_point);
         return ret;
     }
+    nandroid_stats_add(restore_stats, NANDROID_PHASE_DATA, start);
+    struct stat st;
+    if (restore_stats != NULL && stat(tmp, &st) == 0)
+        restore_stats->bytes = st.st_size;
 
     if (umount_when_finished) {
         ensure_path_unmounted(mount_point);
@@ -538,6 +1883,30 @@ int nandroid_restore_partition_extended(const char* backup_path, const char* mou
     return 0;
 }
 
+// The sparse image of raw partition 'name', or the plain image of an older
+// backup. Returns 0 if 'file' exists.
+static int find_raw_backup_file(const char* backup_path, const char* name, char* file) {
+    struct stat st;
+    sprintf(file, "%s/%s" NANDROID_SPARSE_SUFFIX, backup_path, name);
+    if (stat(file, &st) == 0)
+        return 0;
+    sprintf(file, "%s/%s.img", backup_path, name);
+    return stat(file, &st);
+}
+
+static ssize_t md5_raw_read(void* cookie, char* data, size_t len) {
+    return md5_reader_read(cookie, data, len);
+}
+
+static int raw_restore_stream(Volume* vol, const char* file) {
+    int sparse = is_sparse_image(file);
+    struct md5_reader *r = md5_reader_open(file);
+    if (r == NULL)
+        return -1;
+    int ret = restore_raw_partition_stream(vol->fs_type, vol->device, sparse, md5_raw_read, r);
+    return verify_restored(r, ret, file);
+}
+
 int nandroid_restore_partition(const char* backup_path, const char* root) {
     Volume *vol = volume_for_path(root);
     // make sure the volume exists...
@@ -551,27 +1920,93 @@ int nandroid_restore_partition(const char* backup_path, const char* root) {
             strcmp(vol->fs_type, "emmc") == 0) {
         int ret;
         const char* name = basename(root);
+        find_raw_backup_file(backup_path, name, tmp);
+        // images that can't be flashed from a stream are checked up front
+        int stream = raw_partition_streamable(vol->fs_type, vol->device);
+        uint64_t start = nandroid_stats_now();
+        if (!stream && 0 != (ret = verify_backup_file(tmp)))
+            return ret;
+        nandroid_stats_add(restore_stats, NANDROID_PHASE_MD5, start);
         ui_print("Erasing %s before restore...\n", name);
+        start = nandroid_stats_now();
         if (0 != (ret = format_volume(root))) {
             ui_print("Error while erasing %s image!", name);
             return ret;
         }
-        sprintf(tmp, "%s%s.img", backup_path, root);
+        nandroid_stats_add(restore_stats, NANDROID_PHASE_FORMAT, start);
         ui_print("Restoring %s image...\n", name);
-        if (0 != (ret = restore_raw_partition(vol->fs_type, vol->device, tmp))) {
+        start = nandroid_stats_now();
+        if (stream)
+            ret = raw_restore_stream(vol, tmp);
+        else
+            ret = restore_raw_partition(vol->fs_type, vol->device, tmp);
+        if (0 != ret) {
             ui_print("Error while flashing %s image!", name);
             return ret;
         }
+        nandroid_stats_add(restore_stats, NANDROID_PHASE_DATA, start);
+        struct stat st;
+        if (restore_stats != NULL && stat(tmp, &st) == 0) {
+            restore_stats->bytes = st.st_size;
+            restore_stats->files = 1;
+        }
         return 0;
     }
     return nandroid_restore_partition_extended(backup_path, root, 1);
 }
 
-int nandroid_restore(const char* backup_path, int restore_boot, int restore_system, int restore_data, int restore_cache, int restore_sdext, int restore_wimax)
+// Partitions restored by an interrupted restore are skipped, unless the
+// user asks to start over.
+static int restore_journal_start(const char* backup_path) {
+    if (journal_exists(backup_path, NANDROID_RESTORE_JOURNAL)) {
+        static char* headers[] = { "An earlier restore of this backup",
+                                   "did not finish.",
+                                   "",
+                                   NULL
+        };
+        static char* list[] = { "Continue where it stopped",
+                                "Restore everything again",
+                                NULL
+        };
+        if (!nandroid_interactive || get_menu_selection(headers, list, 0, 0) != 1) {
+            ui_print("Resuming interrupted restore...\n");
+            return 0;
+        }
+    }
+    return journal_create(backup_path, NANDROID_RESTORE_JOURNAL, "restore");
+}
+
+static int nandroid_restore_step(const char* backup_path, const char* root, int extended) {
+    int ret;
+    if (0 == journal_find(backup_path, NANDROID_RESTORE_JOURNAL, "done", root, NULL, 0)) {
+        ui_print("%s was restored already, skipping.\n", root);
+        return 0;
+    }
+    struct nandroid_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    strncpy(stats.name, root + 1, sizeof(stats.name) - 1);
+    restore_stats = &stats;
+    if (extended)
+        ret = nandroid_restore_partition_extended(backup_path, root, 0);
+    else
+        ret = nandroid_restore_partition(backup_path, root);
+    restore_stats = NULL;
+    if (ret == 0) {
+        uint64_t start = nandroid_stats_now();
+        sync();
+        nandroid_stats_add(&stats, NANDROID_PHASE_SYNC, start);
+        journal_append(backup_path, NANDROID_RESTORE_JOURNAL, "done", root, NULL);
+        nandroid_stats_print(&stats);
+        nandroid_stats_write(backup_path, "restore", &stats, 1);
+    }
+    return ret;
+}
+
+static int really_nandroid_restore(const char* backup_path, int restore_boot, int restore_system, int restore_data, int restore_cache, int restore_sdext, int restore_wimax)
 {
     ui_set_background(BACKGROUND_ICON_INSTALLING);
     ui_show_indeterminate_progress();
-    yaffs_files_total = 0;
+    progress_reset(0);
 
     ui_print("\nNandroid restore\n");
     ui_print("------------------\n");
@@ -580,17 +2015,16 @@ int nandroid_restore(const char* backup_path, int restore_boot, int restore_syst
     ui_print("------------------\n");
     if (ensure_path_mounted("/sdcard") != 0)
         return print_and_error("Can't mount /sdcard\n");
-    
-    char tmp[PATH_MAX];
 
-    ui_print("Checking MD5 sums...\n");
-    sprintf(tmp, "cd %s && md5sum -c nandroid.md5", backup_path);
-    if (0 != __system(tmp))
-        return print_and_error("MD5 mismatch!\n");
+    // each backup file is verified as it is restored
+    if (0 != nandroid_md5_load(backup_path))
+        return print_and_error("Unable to read MD5 sums!\n");
     
     int ret;
+    if (0 != (ret = restore_journal_start(backup_path)))
+        return print_and_error("Unable to write restore journal!\n");
 
-    if (restore_boot && NULL != volume_for_path("/boot") && 0 != (ret = nandroid_restore_partition(backup_path, "/boot")))
+    if (restore_boot && NULL != volume_for_path("/boot") && 0 != (ret = nandroid_restore_step(backup_path, "/boot", 0)))
         return ret;
     /*
      * MIDNIGHT: No /wimax on stock Samsung ROM...
@@ -624,21 +2058,21 @@ int nandroid_restore(const char* backup_path, int restore_boot, int restore_syst
         }
     }
     */
-    if (restore_system && 0 != (ret = nandroid_restore_partition(backup_path, "/system")))
+    if (restore_system && 0 != (ret = nandroid_restore_step(backup_path, "/system", 0)))
         return ret;
 
-    if (restore_data && 0 != (ret = nandroid_restore_partition(backup_path, "/data")))
+    if (restore_data && 0 != (ret = nandroid_restore_step(backup_path, "/data", 0)))
         return ret;
         
     if (has_datadata()) {
-        if (restore_data && 0 != (ret = nandroid_restore_partition(backup_path, "/dbdata")))
+        if (restore_data && 0 != (ret = nandroid_restore_step(backup_path, "/dbdata", 0)))
             return ret;
     }
 
-    if (restore_data && 0 != (ret = nandroid_restore_partition_extended(backup_path, "/sdcard/.android_secure", 0)))
+    if (restore_data && 0 != (ret = nandroid_restore_step(backup_path, "/sdcard/.android_secure", 1)))
         return ret;
 
-    if (restore_cache && 0 != (ret = nandroid_restore_partition_extended(backup_path, "/cache", 0)))
+    if (restore_cache && 0 != (ret = nandroid_restore_step(backup_path, "/cache", 1)))
         return ret;
     /*
      * MIDNIGHT: No /sd-ext on stock Samsung ROM...
@@ -647,28 +2081,847 @@ int nandroid_restore(const char* backup_path, int restore_boot, int restore_syst
     */
     
     sync();
+    journal_remove(backup_path, NANDROID_RESTORE_JOURNAL);
     ui_set_background(BACKGROUND_ICON_NONE);
     ui_reset_progress();
     ui_print("Restore complete!\n");
     return 0;
 }
 
+int nandroid_restore(const char* backup_path, int restore_boot, int restore_system, int restore_data, int restore_cache, int restore_sdext, int restore_wimax)
+{
+    performance_profile_begin();
+    int ret = really_nandroid_restore(backup_path, restore_boot, restore_system, restore_data, restore_cache, restore_sdext, restore_wimax);
+    performance_profile_end();
+    return ret;
+}
+
+// Finds the tar backup of 'mount_point' that has an index.
+static int find_indexed_archive(const char* backup_path, const char* mount_point, char* archive, char* index) {
+    const char *filesystems[] = { "yaffs2", "ext2", "ext3", "ext4", "vfat", "rfs", NULL };
+    const char *suffixes[] = { "tar", "tar.gz", NULL };
+    char name[PATH_MAX];
+    struct stat st;
+    int i, j;
+    strcpy(name, mount_point);
+    for (i = 0; filesystems[i] != NULL; i++) {
+        for (j = 0; suffixes[j] != NULL; j++) {
+            sprintf(archive, "%s/%s.%s.%s", backup_path, basename(name), filesystems[i], suffixes[j]);
+            sprintf(index, "%s" NANDROID_INDEX_SUFFIX, archive);
+            if (stat(archive, &st) == 0 && stat(index, &st) == 0)
+                return 0;
+        }
+    }
+    return -1;
+}
+
+// Only the range of the archive the index points at is fed to the extractor.
+struct range_reader {
+    tar_read_func read_func;
+    void* in;
+    uint64_t remaining;
+};
+
+static ssize_t range_read(void* cookie, void* data, size_t len) {
+    struct range_reader* r = (struct range_reader*)cookie;
+    if (r->remaining == 0)
+        return 0;
+    if (len > r->remaining)
+        len = r->remaining;
+    ssize_t got = r->read_func(r->in, data, len);
+    if (got > 0)
+        r->remaining -= got;
+    return got;
+}
+
+static ssize_t fd_read(void* cookie, void* data, size_t len) {
+    ssize_t r;
+    do {
+        r = read(*(int*)cookie, data, len);
+    } while (r < 0 && errno == EINTR);
+    return r;
+}
+
+int nandroid_restore_path(const char* backup_path, const char* path)
+{
+    char archive[PATH_MAX];
+    char index[PATH_MAX];
+    char name[PATH_MAX];
+    char dir[PATH_MAX];
+    Volume* vol = volume_for_path(path);
+    if (vol == NULL || strcmp(vol->mount_point, path) == 0)
+        return print_and_error("Restore whole partitions with a full restore.\n");
+    if (ensure_path_mounted("/sdcard") != 0)
+        return print_and_error("Can't mount /sdcard\n");
+    if (0 != find_indexed_archive(backup_path, vol->mount_point, archive, index)) {
+        ui_print("No indexed backup of %s found.\n", vol->mount_point);
+        return -1;
+    }
+
+    // entry names are relative to the parent of the mount point
+    char mount_point[PATH_MAX];
+    strcpy(mount_point, vol->mount_point);
+    sprintf(name, "%s%s", basename(mount_point), path + strlen(vol->mount_point));
+    size_t len = strlen(name);
+    while (len > 1 && name[len - 1] == '/')
+        name[--len] = '\0';
+    strcpy(mount_point, vol->mount_point);
+    strcpy(dir, dirname(mount_point));
+
+    uint64_t start, end;
+    if (0 != tar_index_range(index, name, &start, &end)) {
+        ui_print("%s is not in the backup.\n", path);
+        return -1;
+    }
+    if (0 != ensure_path_mounted(vol->mount_point)) {
+        ui_print("Can't mount %s!\n", vol->mount_point);
+        return -1;
+    }
+
+    struct range_reader r;
+    struct gz_reader* gz = NULL;
+    int fd = -1;
+    r.remaining = end - start;
+    if (gz_is_block_compressed(archive)) {
+        if ((gz = gz_reader_open_at(archive, start, 0)) == NULL)
+            return print_and_error("Unable to read the backup.\n");
+        r.read_func = gz_reader_read;
+        r.in = gz;
+    }
+    else {
+        if ((fd = open(archive, O_RDONLY)) < 0 || lseek64(fd, start, SEEK_SET) != (off64_t)start) {
+            if (fd >= 0)
+                close(fd);
+            return print_and_error("Unable to read the backup.\n");
+        }
+        r.read_func = fd_read;
+        r.in = &fd;
+    }
+
+    ui_print("Restoring %s...\n", path);
+    ui_show_indeterminate_progress();
+    int ret = tar_update_stream(range_read, &r, dir, path, NULL, index, NULL, NULL);
+    if (gz != NULL)
+        gz_reader_close(gz);
+    else
+        close(fd);
+    if (ret != 0)
+        return print_and_error("Error while restoring.\n");
+
+    int bad = tar_index_verify(index, name, dir);
+    if (bad != 0) {
+        ui_print("MD5 mismatch on %d files!\n", bad);
+        return -1;
+    }
+    sync();
+    ui_reset_progress();
+    ui_print("Restore complete!\n");
+    return 0;
+}
+
+char** nandroid_list_apps(const char* backup_path)
+{
+    char archive[PATH_MAX];
+    char index[PATH_MAX];
+    if (0 != find_indexed_archive(backup_path, "/data", archive, index))
+        return NULL;
+    return tar_index_children(index, "data/data");
+}
+
+int nandroid_restore_app(const char* backup_path, const char* package)
+{
+    char path[PATH_MAX];
+    int ret;
+    sprintf(path, "/data/data/%s", package);
+    if (0 != (ret = nandroid_restore_path(backup_path, path)))
+        return ret;
+    // databases live on their own partition on some Samsung devices
+    if (has_datadata()) {
+        char archive[PATH_MAX];
+        char index[PATH_MAX];
+        uint64_t start, end;
+        sprintf(path, "dbdata/databases/%s", package);
+        if (0 == find_indexed_archive(backup_path, "/dbdata", archive, index) &&
+                0 == tar_index_range(index, path, &start, &end)) {
+            sprintf(path, "/dbdata/databases/%s", package);
+            ret = nandroid_restore_path(backup_path, path);
+        }
+    }
+    return ret;
+}
+
+// nandroid diff: both backups are scanned at the same time, one thread per
+// archive, and only their listings are compared.
+
+struct diff_entry {
+    char* name;
+    unsigned int mode;
+    uint64_t size;
+    char* digest;
+};
+
+struct diff_side {
+    char file[PATH_MAX];
+    struct diff_entry* entries;
+    int count;
+    int alloc;
+    int ret;
+};
+
+static void diff_scan_callback(const char* name, unsigned int mode, uint64_t size, const char* digest, void* cookie) {
+    struct diff_side* side = (struct diff_side*)cookie;
+    if (side->count == side->alloc) {
+        int alloc = side->alloc ? side->alloc * 2 : 1024;
+        struct diff_entry* tmp = (struct diff_entry*) realloc(side->entries, alloc * sizeof(struct diff_entry));
+        if (tmp == NULL) {
+            side->ret = -1;
+            return;
+        }
+        side->entries = tmp;
+        side->alloc = alloc;
+    }
+    struct diff_entry* e = &side->entries[side->count];
+    e->name = strdup(name);
+    e->digest = strdup(digest);
+    e->mode = mode;
+    e->size = size;
+    if (e->name == NULL || e->digest == NULL) {
+        free(e->name);
+        free(e->digest);
+        side->ret = -1;
+        return;
+    }
+    // directories are listed as "name/"
+    size_t len = strlen(e->name);
+    while (len > 1 && e->name[len - 1] == '/')
+        e->name[--len] = '\0';
+    side->count++;
+}
+
+static int compare_diff_entries(const void* a, const void* b) {
+    return strcmp(((const struct diff_entry*)a)->name, ((const struct diff_entry*)b)->name);
+}
+
+static void* diff_scan_thread(void* cookie) {
+    struct diff_side* side = (struct diff_side*)cookie;
+    int ret;
+    if (gz_is_block_compressed(side->file)) {
+        struct gz_reader* gz = gz_reader_open(side->file, 0);
+        if (gz == NULL) {
+            side->ret = -1;
+            return NULL;
+        }
+        ret = tar_scan_stream(gz_reader_read, gz, diff_scan_callback, side);
+        if (0 != gz_reader_close(gz))
+            ret = -1;
+    }
+    else {
+        int fd = open(side->file, O_RDONLY);
+        if (fd < 0) {
+            side->ret = -1;
+            return NULL;
+        }
+        ret = tar_scan_stream(fd_read, &fd, diff_scan_callback, side);
+        close(fd);
+    }
+    if (ret != 0)
+        side->ret = -1;
+    if (side->ret == 0)
+        qsort(side->entries, side->count, sizeof(struct diff_entry), compare_diff_entries);
+    return NULL;
+}
+
+static void free_diff_side(struct diff_side* side) {
+    int i;
+    for (i = 0; i < side->count; i++) {
+        free(side->entries[i].name);
+        free(side->entries[i].digest);
+    }
+    free(side->entries);
+}
+
+// Finds the backup file of 'name' (eg. "system") in 'backup_path'.
+// Returns 1 for tar archives, 0 for images and dedupe manifests, -1 if
+// there is none.
+static int find_backup_file(const char* backup_path, const char* name, char* file) {
+    const char *filesystems[] = { "yaffs2", "ext2", "ext3", "ext4", "vfat", "rfs", NULL };
+    const char *suffixes[] = { "tar", "tar.gz", "img", "dup", NULL };
+    struct stat st;
+    int i, j;
+    if (find_raw_backup_file(backup_path, name, file) == 0)
+        return 0;
+    for (i = 0; filesystems[i] != NULL; i++) {
+        for (j = 0; suffixes[j] != NULL; j++) {
+            sprintf(file, "%s/%s.%s.%s", backup_path, name, filesystems[i], suffixes[j]);
+            if (stat(file, &st) == 0)
+                return j < 2 ? 1 : 0;
+        }
+    }
+    return -1;
+}
+
+// "tar", "tar.gz", "img", "sparse" or "dup", as found by find_backup_file.
+static const char* backup_file_format(const char* file) {
+    size_t len = strlen(file);
+    if (len > 7 && strcmp(file + len - 7, ".tar.gz") == 0)
+        return "tar.gz";
+    const char* dot = strrchr(file, '.');
+    return dot != NULL ? dot + 1 : "";
+}
+
+static int diff_partition(const char* a, const char* b, const char* name) {
+    struct diff_side sides[2];
+    int types[2];
+    memset(sides, 0, sizeof(sides));
+    types[0] = find_backup_file(a, name, sides[0].file);
+    types[1] = find_backup_file(b, name, sides[1].file);
+    if (types[0] < 0 && types[1] < 0)
+        return 0;
+    if (types[0] < 0 || types[1] < 0) {
+        ui_print("%s: only in %s\n", name, types[0] < 0 ? b : a);
+        return 0;
+    }
+
+    // archives, images and manifests of the same files never share a sum
+    if (types[0] != types[1] ||
+            (types[0] == 0 && strcmp(backup_file_format(sides[0].file), backup_file_format(sides[1].file)) != 0)) {
+        ui_print("%s: format changed from %s to %s, not compared\n", name,
+                backup_file_format(sides[0].file), backup_file_format(sides[1].file));
+        return 0;
+    }
+
+    if (types[0] == 0) {
+        // images can only be told apart as a whole
+        char hex_a[33], hex_b[33];
+        if (0 != nandroid_md5_load(a) || 0 != nandroid_md5_get_hex(sides[0].file, hex_a) ||
+                0 != nandroid_md5_load(b) || 0 != nandroid_md5_get_hex(sides[1].file, hex_b)) {
+            ui_print("%s: no MD5 sums to compare\n", name);
+            return 0;
+        }
+        ui_print("%s: %s\n", name, strcmp(hex_a, hex_b) == 0 ? "identical" : "modified");
+        return 0;
+    }
+
+    pthread_t threads[2];
+    int i, started;
+    for (started = 0; started < 2; started++) {
+        if (pthread_create(&threads[started], NULL, diff_scan_thread, &sides[started]) != 0)
+            break;
+    }
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    if (started < 2) {
+        ui_print("%s: unable to start the scan of %s\n", name, sides[started].file);
+        free_diff_side(&sides[0]);
+        free_diff_side(&sides[1]);
+        return -1;
+    }
+    if (sides[0].ret != 0 || sides[1].ret != 0) {
+        ui_print("%s: unable to read %s\n", name, sides[0].ret != 0 ? sides[0].file : sides[1].file);
+        free_diff_side(&sides[0]);
+        free_diff_side(&sides[1]);
+        return -1;
+    }
+
+    int added = 0, removed = 0, modified = 0;
+    int ia = 0, ib = 0;
+    while (ia < sides[0].count || ib < sides[1].count) {
+        struct diff_entry* ea = ia < sides[0].count ? &sides[0].entries[ia] : NULL;
+        struct diff_entry* eb = ib < sides[1].count ? &sides[1].entries[ib] : NULL;
+        int cmp = ea == NULL ? 1 : eb == NULL ? -1 : strcmp(ea->name, eb->name);
+        if (cmp < 0) {
+            ui_print("- %s\n", ea->name);
+            removed++;
+            ia++;
+        }
+        else if (cmp > 0) {
+            ui_print("+ %s\n", eb->name);
+            added++;
+            ib++;
+        }
+        else {
+            if (ea->mode != eb->mode || ea->size != eb->size || strcmp(ea->digest, eb->digest) != 0) {
+                ui_print("M %s%s%s%s\n", ea->name,
+                        ea->size != eb->size ? " size" : "",
+                        ea->mode != eb->mode ? " mode" : "",
+                        ea->size == eb->size && strcmp(ea->digest, eb->digest) != 0 ? " content" : "");
+                modified++;
+            }
+            ia++;
+            ib++;
+        }
+    }
+    ui_print("%s: %d added, %d removed, %d modified\n", name, added, removed, modified);
+    free_diff_side(&sides[0]);
+    free_diff_side(&sides[1]);
+    return 0;
+}
+
+int nandroid_diff(const char* a, const char* b)
+{
+    const char* partitions[] = { "boot", "recovery", "system", "data", "dbdata", ".android_secure", "cache", "sd-ext", NULL };
+    int i, ret = 0;
+    if (ensure_path_mounted("/sdcard") != 0)
+        return print_and_error("Can't mount /sdcard\n");
+    ui_print("Comparing %s\n       to %s\n", a, b);
+    for (i = 0; partitions[i] != NULL; i++) {
+        if (0 != diff_partition(a, b, partitions[i]))
+            ret = -1;
+    }
+    return ret;
+}
+
+// Streamed backups: the same partitions as nandroid_backup, each sent as
+// one file of a nandroid stream instead of being written to the sdcard.
+// Raw images are small and are dumped to /tmp first.
+#define STREAM_TEMP_IMAGE   "/tmp/nandroid-stream.img"
+#define STREAM_TEMP_INDEX   "/tmp/nandroid-stream.idx"
+
+static int is_raw_partition(Volume* vol) {
+    return strcmp(vol->fs_type, "mtd") == 0 || strcmp(vol->fs_type, "bml") == 0 ||
+            strcmp(vol->fs_type, "emmc") == 0;
+}
+
+static int stream_file(struct nandroid_stream* s, const char* name, const char* path) {
+    char buf[4096];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        ui_print("Unable to open %s\n", path);
+        return -1;
+    }
+    int ret = nandroid_stream_begin_file(s, name);
+    ssize_t r;
+    while (ret == 0 && (r = fd_read(&fd, buf, sizeof(buf))) != 0) {
+        if (r < 0)
+            ret = -1;
+        else
+            ret = nandroid_stream_write(s, buf, r);
+    }
+    close(fd);
+    if (ret == 0)
+        ret = nandroid_stream_end_file(s);
+    return ret;
+}
+
+static int stream_partition(struct nandroid_stream* s, const char* root, int umount_when_finished) {
+    char archive[PATH_MAX];
+    char tmp[PATH_MAX];
+    int ret;
+    Volume* vol = volume_for_path(root);
+    strcpy(tmp, root);
+    const char* name = basename(tmp);
+
+    if (vol != NULL && vol->fs_type != NULL && is_raw_partition(vol)) {
+        ui_print("Streaming %s image...\n", name);
+        sprintf(archive, "%s" NANDROID_SPARSE_SUFFIX, name);
+        if (0 != (ret = backup_raw_partition_sparse(vol->fs_type, vol->device, STREAM_TEMP_IMAGE)))
+            ui_print("Error while backing up %s image!\n", name);
+        else
+            ret = stream_file(s, archive, STREAM_TEMP_IMAGE);
+        unlink(STREAM_TEMP_IMAGE);
+        return ret;
+    }
+    if (vol == NULL || vol->fs_type == NULL)
+        return 0;
+
+    if (0 != ensure_path_mounted(root)) {
+        ui_print("Can't mount %s!\n", root);
+        return -1;
+    }
+    scan_mounted_volumes();
+    MountedVolume* mv = find_mounted_volume_by_mount_point(vol->mount_point);
+    int compress = nandroid_get_default_backup_format() == NANDROID_BACKUP_FORMAT_TGZ;
+    sprintf(archive, "%s.%s.%s", name, mv == NULL || mv->filesystem == NULL ? "auto" : mv->filesystem,
+            compress ? "tar.gz" : "tar");
+
+    ui_print("Streaming %s...\n", name);
+    if (0 != (ret = nandroid_stream_begin_file(s, archive)))
+        return ret;
+    if (compress) {
+        struct gz_writer* w = gz_writer_open_stream(nandroid_stream_write, s, 0);
+        if (w == NULL)
+            return -1;
+        ret = tar_create_stream(gz_writer_write, w, root, tar_exclude(root), STREAM_TEMP_INDEX, NULL, NULL);
+        if (0 != gz_writer_close(w))
+            ret = -1;
+    }
+    else {
+        ret = tar_create_stream(nandroid_stream_write, s, root, tar_exclude(root), STREAM_TEMP_INDEX, NULL, NULL);
+    }
+    if (ret == 0)
+        ret = nandroid_stream_end_file(s);
+    if (ret == 0) {
+        sprintf(tmp, "%s" NANDROID_INDEX_SUFFIX, archive);
+        ret = stream_file(s, tmp, STREAM_TEMP_INDEX);
+    }
+    unlink(STREAM_TEMP_INDEX);
+    if (ret != 0)
+        ui_print("Error while streaming %s!\n", root);
+    if (umount_when_finished)
+        ensure_path_unmounted(root);
+    return ret;
+}
+
+static int really_nandroid_stream_backup(const char* address)
+{
+    struct stat st;
+    int ret = 0;
+    ui_print("\nNandroid stream backup to %s\n", address);
+    struct nandroid_stream* s = nandroid_stream_open(address, 1);
+    if (s == NULL)
+        return print_and_error("Can't open the backup stream!\n");
+
+    if (0 != (ret = stream_partition(s, "/boot", 1)) ||
+            0 != (ret = stream_partition(s, "/recovery", 1)) ||
+            0 != (ret = stream_partition(s, "/system", 1)) ||
+            0 != (ret = stream_partition(s, "/data", 1)) ||
+            (has_datadata() && 0 != (ret = stream_partition(s, "/dbdata", 1))))
+        goto done;
+    if (0 == ensure_path_mounted("/sdcard") && 0 == stat("/sdcard/.android_secure", &st) &&
+            0 != (ret = stream_partition(s, "/sdcard/.android_secure", 0)))
+        goto done;
+    ret = stream_partition(s, "/cache", 0);
+done:
+    if (0 != nandroid_stream_close(s))
+        ret = -1;
+    if (ret != 0)
+        return print_and_error("Stream backup failed!\n");
+    ui_print("Stream backup complete!\n");
+    return 0;
+}
+
+int nandroid_stream_backup(const char* address)
+{
+    performance_profile_begin();
+    int ret = really_nandroid_stream_backup(address);
+    performance_profile_end();
+    return ret;
+}
+
+// Restores one archive of the stream, named like a backup file
+// ("data.ext4.tar.gz"), the same way nandroid_restore_partition_extended
+// restores that file.
+static int stream_restore_archive(struct nandroid_stream* s, const char* archive) {
+    char name[PATH_MAX];
+    char mount_point[PATH_MAX];
+    char parent[PATH_MAX];
+    int ret, compressed = 0;
+    strcpy(name, archive);
+    char* ext = strstr(name, ".tar");
+    if (ext == NULL || (strcmp(ext, ".tar") != 0 && strcmp(ext, ".tar.gz") != 0)) {
+        ui_print("Skipping %s.\n", archive);
+        return nandroid_stream_skip_file(s);
+    }
+    compressed = strcmp(ext, ".tar.gz") == 0;
+    *ext = '\0';
+    char* fs = strrchr(name, '.');
+    if (fs == NULL || fs == name) {
+        ui_print("Skipping %s.\n", archive);
+        return nandroid_stream_skip_file(s);
+    }
+    *fs++ = '\0';
+    if (strcmp(name, ".android_secure") == 0)
+        sprintf(mount_point, "/sdcard/%s", name);
+    else
+        sprintf(mount_point, "/%s", name);
+
+    Volume* vol = volume_for_path(mount_point);
+    const char* backup_filesystem = fs;
+    if (vol == NULL || strcmp(vol->fs_type, "auto") == 0 || strcmp(fs, "auto") == 0)
+        backup_filesystem = NULL;
+    ensure_directory(mount_point);
+
+    ui_print("Restoring %s...\n", name);
+    if (backup_filesystem == NULL)
+        ret = format_volume(mount_point);
+    else
+        ret = format_device(vol->device, mount_point, backup_filesystem);
+    if (0 != ret) {
+        ui_print("Error while formatting %s!\n", mount_point);
+        return ret;
+    }
+    if (0 != (ret = ensure_path_mounted(mount_point))) {
+        ui_print("Can't mount %s!\n", mount_point);
+        return ret;
+    }
+
+    strcpy(parent, mount_point);
+    if (compressed) {
+        struct gz_reader* gz = gz_reader_open_stream(nandroid_stream_read, s, 0, 0);
+        if (gz == NULL)
+            return -1;
+        ret = tar_extract_stream(gz_reader_read, gz, dirname(parent), NULL, NULL);
+        if (0 != gz_reader_close(gz))
+            ret = -1;
+    }
+    else {
+        ret = tar_extract_stream(nandroid_stream_read, s, dirname(parent), NULL, NULL);
+    }
+    // also checks the md5 of what the extractor did not need to read
+    if (0 != nandroid_stream_skip_file(s))
+        ret = -1;
+    if (0 != ret)
+        ui_print("Error while restoring %s!\n", mount_point);
+    if (vol != NULL && strcmp(vol->mount_point, mount_point) == 0)
+        ensure_path_unmounted(mount_point);
+    return ret;
+}
+
+static int stream_restore_image(struct nandroid_stream* s, const char* image) {
+    char root[PATH_MAX];
+    char buf[4096];
+    sprintf(root, "/%s", image);
+    *strchr(root, '.') = '\0';
+    Volume* vol = volume_for_path(root);
+    if (vol == NULL || vol->fs_type == NULL || !is_raw_partition(vol)) {
+        ui_print("Skipping %s.\n", image);
+        return nandroid_stream_skip_file(s);
+    }
+
+    int fd = open(STREAM_TEMP_IMAGE, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return print_and_error("Unable to create " STREAM_TEMP_IMAGE "\n");
+    ssize_t r;
+    int ret = 0;
+    while ((r = nandroid_stream_read(s, buf, sizeof(buf))) > 0) {
+        if (write(fd, buf, r) != r) {
+            ret = -1;
+            break;
+        }
+    }
+    if (close(fd) != 0 || r != 0)
+        ret = -1;
+
+    if (ret == 0) {
+        ui_print("Erasing %s before restore...\n", root + 1);
+        if (0 != (ret = format_volume(root)))
+            ui_print("Error while erasing %s image!", root + 1);
+    }
+    if (ret == 0) {
+        ui_print("Restoring %s image...\n", root + 1);
+        if (0 != (ret = restore_raw_partition(vol->fs_type, vol->device, STREAM_TEMP_IMAGE)))
+            ui_print("Error while flashing %s image!", root + 1);
+    }
+    unlink(STREAM_TEMP_IMAGE);
+    return ret;
+}
+
+static int really_nandroid_stream_restore(const char* address)
+{
+    char name[NAME_MAX + 1];
+    int ret;
+    ui_print("\nNandroid stream restore from %s\n", address);
+    struct nandroid_stream* s = nandroid_stream_open(address, 0);
+    if (s == NULL)
+        return print_and_error("Can't open the backup stream!\n");
+
+    while ((ret = nandroid_stream_next_file(s, name, sizeof(name))) > 0) {
+        size_t len = strlen(name);
+        // images are "<partition>.sparse", or "<partition>.img" from older streams
+        const char* ext = strchr(name, '.');
+        if (len > strlen(NANDROID_INDEX_SUFFIX) &&
+                strcmp(name + len - strlen(NANDROID_INDEX_SUFFIX), NANDROID_INDEX_SUFFIX) == 0)
+            ret = nandroid_stream_skip_file(s);
+        else if (ext != NULL && (strcmp(ext, NANDROID_SPARSE_SUFFIX) == 0 || strcmp(ext, ".img") == 0))
+            ret = stream_restore_image(s, name);
+        else
+            ret = stream_restore_archive(s, name);
+        if (ret != 0)
+            break;
+    }
+    if (0 != nandroid_stream_close(s))
+        ret = -1;
+    sync();
+    if (ret != 0)
+        return print_and_error("Stream restore failed!\n");
+    ui_print("Stream restore complete!\n");
+    return 0;
+}
+
+int nandroid_stream_restore(const char* address)
+{
+    performance_profile_begin();
+    int ret = really_nandroid_stream_restore(address);
+    performance_profile_end();
+    return ret;
+}
+
+// Converting rfs partitions to ext4. Every partition is archived as a
+// compressed, hashed tar next to a regular backup, formatted and unpacked
+// again, with the partitions going through this at the same time. The
+// archives stay behind as a backup that restores like any other.
+#define EXT_SUPERBLOCK_OFFSET   1024
+#define EXT_MAGIC_OFFSET        56
+#define EXT_MAGIC               0xEF53
+
+struct convert_task {
+    const char* mount_point;
+    Volume* vol;
+    char image[PATH_MAX];
+    pthread_t thread;
+    int ret;
+};
+
+// mount tables and make_ext4fs are global state, only one thread uses them
+static pthread_mutex_t convert_volume_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Reads the superblock magic, so partitions that are ext2/3/4 already are
+// known without mounting them.
+static int is_ext_device(const char* device) {
+    unsigned char magic[2];
+    int fd = open(device, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    int ret = pread(fd, magic, sizeof(magic), EXT_SUPERBLOCK_OFFSET + EXT_MAGIC_OFFSET) == sizeof(magic) &&
+            (magic[0] | (magic[1] << 8)) == EXT_MAGIC;
+    close(fd);
+    return ret;
+}
+
+static int convert_partition(struct convert_task* t) {
+    char tmp[PATH_MAX];
+    const char* mount_point = t->mount_point;
+    int ret;
+
+    pthread_mutex_lock(&convert_volume_lock);
+    ensure_path_unmounted(mount_point);
+    sprintf(tmp, "mount -t rfs %s %s", t->vol->device, mount_point);
+    ret = __system(tmp);
+    pthread_mutex_unlock(&convert_volume_lock);
+    if (0 != ret) {
+        ui_print("Can't mount %s as rfs!\n", mount_point);
+        return ret;
+    }
+
+    ui_print("Saving %s...\n", mount_point);
+    ret = tar_gz_compress_wrapper(mount_point, t->image, 0);
+    pthread_mutex_lock(&convert_volume_lock);
+    ensure_path_unmounted(mount_point);
+    pthread_mutex_unlock(&convert_volume_lock);
+    if (0 != ret) {
+        ui_print("Error while saving %s, it was left as it is.\n", mount_point);
+        return ret;
+    }
+
+    pthread_mutex_lock(&convert_volume_lock);
+    ret = format_device(t->vol->device, mount_point, "ext4");
+    if (0 == ret)
+        ret = ensure_path_mounted(mount_point);
+    pthread_mutex_unlock(&convert_volume_lock);
+    if (0 != ret) {
+        ui_print("Error while formatting %s as ext4!\n", mount_point);
+        return ret;
+    }
+
+    ui_print("Restoring %s...\n", mount_point);
+    sprintf(tmp, "%s.tar.gz", t->image);
+    ret = tar_gz_extract_wrapper(tmp, mount_point, 0);
+    pthread_mutex_lock(&convert_volume_lock);
+    ensure_path_unmounted(mount_point);
+    pthread_mutex_unlock(&convert_volume_lock);
+    if (0 != ret)
+        ui_print("Error while restoring %s!\n", mount_point);
+    else
+        ui_print("%s is ext4 now.\n", mount_point);
+    return ret;
+}
+
+static void* convert_worker(void* cookie) {
+    struct convert_task* t = (struct convert_task*)cookie;
+    t->ret = convert_partition(t);
+    return NULL;
+}
+
+static int really_nandroid_convert_ext4(const char* backup_path) {
+    const char* mount_points[] = { "/system", "/data", "/dbdata", "/cache", NULL };
+    struct convert_task tasks[4];
+    int i, count = 0, ret = 0;
+
+    ui_print("Checking for ext4 partitions...\n");
+    for (i = 0; mount_points[i] != NULL; i++) {
+        Volume* vol = volume_for_path(mount_points[i]);
+        if (vol == NULL || (strcmp(mount_points[i], "/dbdata") == 0 && !has_datadata()))
+            continue;
+        if (is_ext_device(vol->device))
+            continue;
+        struct convert_task* t = &tasks[count++];
+        memset(t, 0, sizeof(*t));
+        t->mount_point = mount_points[i];
+        t->vol = vol;
+        sprintf(t->image, "%s/%s.rfs", backup_path, mount_points[i] + 1);
+    }
+    if (count == 0) {
+        ui_print("Done!\n");
+        return 0;
+    }
+
+    ui_print("Filesystems need to be converted to ext4.\n");
+    ui_print("If anything goes wrong, restore the backup\n");
+    ui_print("in %s.\n", backup_path);
+    if (ensure_path_mounted("/sdcard") != 0)
+        return print_and_error("Can't mount /sdcard\n");
+    ensure_directory(backup_path);
+    nandroid_md5_reset();
+    progress_reset(0);
+
+    for (i = 0; i < count; i++) {
+        if (0 != pthread_create(&tasks[i].thread, NULL, convert_worker, &tasks[i])) {
+            // run it here instead
+            tasks[i].thread = 0;
+            tasks[i].ret = convert_partition(&tasks[i]);
+        }
+    }
+    for (i = 0; i < count; i++) {
+        if (tasks[i].thread != 0)
+            pthread_join(tasks[i].thread, NULL);
+        if (tasks[i].ret != 0)
+            ret = tasks[i].ret;
+    }
+
+    if (0 != nandroid_md5_write(backup_path))
+        ui_print("Error while generating md5 sum!\n");
+    sync();
+    if (0 != ret)
+        return print_and_error("Conversion failed, check the messages above.\n");
+    ui_print("Conversion complete!\n");
+    return 0;
+}
+
+int nandroid_convert_ext4(const char* backup_path)
+{
+    performance_profile_begin();
+    int ret = really_nandroid_convert_ext4(backup_path);
+    performance_profile_end();
+    return ret;
+}
+
 int nandroid_usage()
 {
-    printf("Usage: nandroid backup\n");
-    printf("Usage: nandroid restore <directory>\n");
+    printf("Usage: nandroid backup [<directory>]\n");
+    printf("Usage: nandroid restore <directory> [<path>]\n");
+    printf("Usage: nandroid diff <directory> <directory>\n");
+    printf("Usage: nandroid bench\n");
+    printf("Usage: nandroid stream backup|restore <address>\n");
+    printf("Usage: nandroid stream receive <address> [<directory>]\n");
+    printf("Usage: nandroid convert [<directory>]\n");
     return 1;
 }
 
 int nandroid_main(int argc, char** argv)
 {
-    if (argc > 3 || argc < 2)
+    if (argc > 5 || argc < 2)
         return nandroid_usage();
+
+    // no keys to answer menus from the command line
+    nandroid_interactive = 0;
     
     if (strcmp("backup", argv[1]) == 0)
     {
-        if (argc != 2)
+        if (argc > 3)
             return nandroid_usage();
+        // an existing folder continues an interrupted backup
+        if (argc == 3)
+            return nandroid_backup(argv[2]);
         
         char backup_path[PATH_MAX];
         nandroid_generate_timestamp_path(backup_path);
@@ -677,10 +2930,56 @@ int nandroid_main(int argc, char** argv)
 
     if (strcmp("restore", argv[1]) == 0)
     {
+        if (argc == 4)
+            return nandroid_restore_path(argv[2], argv[3]);
         if (argc != 3)
             return nandroid_usage();
         return nandroid_restore(argv[2], 1, 1, 1, 1, 1, 0);
     }
+
+    if (strcmp("bench", argv[1]) == 0)
+        return nandroid_bench();
+
+    if (strcmp("diff", argv[1]) == 0)
+    {
+        if (argc != 4)
+            return nandroid_usage();
+        return nandroid_diff(argv[2], argv[3]);
+    }
+
+    if (strcmp("convert", argv[1]) == 0)
+    {
+        if (argc > 3)
+            return nandroid_usage();
+        char backup_path[PATH_MAX];
+        if (argc == 3)
+            strcpy(backup_path, argv[2]);
+        else if (ensure_path_mounted("/sdcard") == 0)
+            nandroid_generate_timestamp_path(backup_path);
+        else
+            return print_and_error("Can't mount /sdcard\n");
+        return nandroid_convert_ext4(backup_path);
+    }
+
+    if (strcmp("stream", argv[1]) == 0 && argc >= 4)
+    {
+        if (strcmp("backup", argv[2]) == 0 && argc == 4)
+            return nandroid_stream_backup(argv[3]);
+        if (strcmp("restore", argv[2]) == 0 && argc == 4)
+            return nandroid_stream_restore(argv[3]);
+        if (strcmp("receive", argv[2]) == 0)
+        {
+            char backup_path[PATH_MAX];
+            if (argc == 5)
+                strcpy(backup_path, argv[4]);
+            else if (ensure_path_mounted("/sdcard") == 0)
+                nandroid_generate_timestamp_path(backup_path);
+            else
+                return print_and_error("Can't mount /sdcard\n");
+            ensure_directory(backup_path);
+            return nandroid_stream_receive(argv[3], backup_path);
+        }
+    }
     
     return nandroid_usage();
 }
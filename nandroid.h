@@ -4,6 +4,53 @@
 int nandroid_main(int argc, char** argv);
 int nandroid_backup(const char* backup_path);
 int nandroid_backup_data_cache_only(const char* backup_path);
+// Continues the most recent backup that did not finish.
+int nandroid_resume_backup();
 int nandroid_restore(const char* backup_path, int restore_boot, int restore_system, int restore_data, int restore_cache, int restore_sdext, int restore_wimax);
 
+// Tar backups come with an index, "<archive>.idx", that lets single files
+// and directories be restored without reading the whole archive.
+#define NANDROID_INDEX_SUFFIX ".idx"
+
+// Raw partitions are backed up as sparse images, "<name>.sparse". Older
+// backups have a plain "<name>.img", which is still restored.
+#define NANDROID_SPARSE_SUFFIX ".sparse"
+
+// Restores 'path' (eg. /data/data/com.foo) and everything below it.
+int nandroid_restore_path(const char* backup_path, const char* path);
+// Package names with data in the backup, NULL terminated, or NULL.
+char** nandroid_list_apps(const char* backup_path);
+int nandroid_restore_app(const char* backup_path, const char* package);
+
+// Lists files added, removed and modified between two backups, per
+// partition, without restoring either.
+int nandroid_diff(const char* a, const char* b);
+
+// Backs up to, or restores from, a nandroid stream on 'address' instead of
+// the sdcard (see nandroid_stream.h for the addresses).
+int nandroid_stream_backup(const char* address);
+int nandroid_stream_restore(const char* address);
+
+// Converts rfs partitions to ext4, keeping a backup of them in
+// 'backup_path'. Partitions that are ext already are left alone.
+int nandroid_convert_ext4(const char* backup_path);
+
+#define NANDROID_BACKUP_FORMAT_FILE "/sdcard/clockworkmod/.default_backup_format"
+#define NANDROID_BACKUP_FORMAT_TAR 0
+#define NANDROID_BACKUP_FORMAT_TGZ 1
+#define NANDROID_BACKUP_FORMAT_DUP 2
+
+int nandroid_get_default_backup_format();
+int nandroid_set_default_backup_format(int format);
+
+// When this file exists, tar backups are restored onto the partition as it
+// is, rewriting only what changed, instead of formatting it first.
+#define NANDROID_RESTORE_MODE_FILE "/sdcard/clockworkmod/.differential_restore"
+
+int nandroid_get_differential_restore();
+int nandroid_set_differential_restore(int differential);
+
+// Remove blobs no longer referenced by any backup next to blob_dir.
+int nandroid_dedupe_gc(const char* blob_dir);
+
 #endif
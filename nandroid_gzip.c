@@ -0,0 +1,655 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <zlib.h>
+
+#include "common.h"
+#include "cutils/properties.h"
+#include "nandroid_queue.h"
+#include "nandroid_gzip.h"
+
+#define GZ_BLOCK_SIZE       (512 * 1024)
+#define GZ_HEADER_SIZE      24      // fixed header + XLEN + NB subfield
+#define GZ_TRAILER_SIZE     8       // crc32 + isize
+#define GZ_XLEN             12
+#define GZ_MAX_THREADS      8
+
+struct gz_block {
+    unsigned char *in;
+    size_t in_len;
+    unsigned char *out;
+    size_t out_len;
+    int done;
+    int error;
+};
+
+// State shared by the writer and the reader: a pool of workers that
+// (de)compress blocks out of order, and a second queue that hands the same
+// blocks to the consumer in stream order.
+struct gz_pool {
+    int threads;
+    pthread_t workers[GZ_MAX_THREADS];
+    struct nandroid_queue work;
+    struct nandroid_queue ordered;
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+    volatile int error;
+};
+
+struct gz_writer {
+    struct gz_pool pool;
+    int fd;
+    gz_write_func sink;
+    void *sink_cookie;
+    int level;
+    pthread_t writer;
+    struct gz_block *current;
+};
+
+struct gz_reader {
+    struct gz_pool pool;
+    int fd;
+    gz_read_func source;
+    void *source_cookie;
+    pthread_t reader;
+    struct gz_block *current;
+    size_t pos;
+    int eof_marker;
+    uint64_t total;
+    volatile uint64_t done;
+};
+
+static void put_le16(unsigned char *p, unsigned int v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
+
+static void put_le32(unsigned char *p, uint32_t v) {
+    put_le16(p, v & 0xffff);
+    put_le16(p + 2, v >> 16);
+}
+
+static unsigned int get_le16(const unsigned char *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32(const unsigned char *p) {
+    return get_le16(p) | ((uint32_t)get_le16(p + 2) << 16);
+}
+
+static void free_block(struct gz_block *b) {
+    free(b->in);
+    free(b->out);
+    free(b);
+}
+
+static ssize_t fd_read(void* cookie, void *data, size_t len) {
+    ssize_t r;
+    do {
+        r = read(*(int*)cookie, data, len);
+    } while (r < 0 && errno == EINTR);
+    return r;
+}
+
+static int read_fully(gz_read_func read_func, void* cookie, void *data, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t r = read_func(cookie, (char*)data + got, len - got);
+        if (r <= 0)
+            break;
+        got += r;
+    }
+    return got;
+}
+
+static int write_fully(int fd, const void *data, size_t len) {
+    const char *p = (const char*)data;
+    while (len > 0) {
+        ssize_t r = write(fd, p, len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static int default_threads(int threads) {
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0)
+        threads = 1;
+    if (threads > GZ_MAX_THREADS)
+        threads = GZ_MAX_THREADS;
+    return threads;
+}
+
+static void pool_fail(struct gz_pool *pool) {
+    pool->error = 1;
+    nandroid_queue_close(&pool->work);
+    nandroid_queue_close(&pool->ordered);
+}
+
+static void pool_finish_block(struct gz_pool *pool, struct gz_block *b, int error) {
+    pthread_mutex_lock(&pool->lock);
+    b->error = error;
+    b->done = 1;
+    pthread_cond_broadcast(&pool->done_cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static int pool_wait_block(struct gz_pool *pool, struct gz_block *b) {
+    pthread_mutex_lock(&pool->lock);
+    while (!b->done)
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    return b->error;
+}
+
+static void pool_destroy(struct gz_pool *pool);
+
+static int pool_init(struct gz_pool *pool, int threads, void* (*worker)(void*), void *cookie) {
+    int i;
+    pool->threads = default_threads(threads);
+    pool->error = 0;
+    if (nandroid_queue_init(&pool->work, pool->threads * 2) != 0)
+        return -1;
+    if (nandroid_queue_init(&pool->ordered, pool->threads * 2) != 0) {
+        nandroid_queue_destroy(&pool->work);
+        return -1;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    for (i = 0; i < pool->threads; i++) {
+        if (pthread_create(&pool->workers[i], NULL, worker, cookie) != 0) {
+            LOGE("Unable to start the compression threads\n");
+            // the ones already running see the closed queue and stop
+            pool->threads = i;
+            pool_destroy(pool);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Push a block to the workers, and to the consumer in stream order.
+static int pool_submit(struct gz_pool *pool, struct gz_block *b) {
+    if (nandroid_queue_push(&pool->ordered, b) != 0) {
+        free_block(b);
+        return -1;
+    }
+    if (nandroid_queue_push(&pool->work, b) != 0) {
+        // already owned by the ordered queue, the consumer frees it
+        pool_finish_block(pool, b, 1);
+        return -1;
+    }
+    return 0;
+}
+
+static void pool_destroy(struct gz_pool *pool) {
+    int i;
+    nandroid_queue_close(&pool->work);
+    for (i = 0; i < pool->threads; i++)
+        pthread_join(pool->workers[i], NULL);
+    // blocks still in the queues were never consumed
+    struct gz_block *b;
+    while ((b = (struct gz_block*) nandroid_queue_pop(&pool->work)) != NULL)
+        pool_finish_block(pool, b, 1);
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_mutex_destroy(&pool->lock);
+    nandroid_queue_destroy(&pool->work);
+    nandroid_queue_destroy(&pool->ordered);
+}
+
+/* Writer */
+
+static int compress_block(struct gz_block *b, int level) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+    size_t bound = deflateBound(&zs, b->in_len);
+    b->out = (unsigned char*) malloc(GZ_HEADER_SIZE + bound + GZ_TRAILER_SIZE);
+    if (b->out == NULL) {
+        deflateEnd(&zs);
+        return -1;
+    }
+    zs.next_in = b->in;
+    zs.avail_in = b->in_len;
+    zs.next_out = b->out + GZ_HEADER_SIZE;
+    zs.avail_out = bound;
+    int ret = deflate(&zs, Z_FINISH);
+    size_t deflated = zs.total_out;
+    deflateEnd(&zs);
+    if (ret != Z_STREAM_END)
+        return -1;
+
+    unsigned char *h = b->out;
+    size_t member = GZ_HEADER_SIZE + deflated + GZ_TRAILER_SIZE;
+    memset(h, 0, GZ_HEADER_SIZE);
+    h[0] = 0x1f;
+    h[1] = 0x8b;
+    h[2] = Z_DEFLATED;
+    h[3] = 4;           // FEXTRA
+    h[9] = 3;           // OS: unix
+    put_le16(h + 10, GZ_XLEN);
+    h[12] = 'N';
+    h[13] = 'B';
+    put_le16(h + 14, 8);
+    put_le32(h + 16, member);
+    put_le32(h + 20, b->in_len);
+
+    unsigned char *t = b->out + GZ_HEADER_SIZE + deflated;
+    put_le32(t, crc32(crc32(0L, Z_NULL, 0), b->in, b->in_len));
+    put_le32(t + 4, b->in_len);
+    b->out_len = member;
+
+    free(b->in);
+    b->in = NULL;
+    return 0;
+}
+
+static void* compress_thread(void *cookie) {
+    struct gz_writer *w = (struct gz_writer*)cookie;
+    struct gz_block *b;
+    while ((b = (struct gz_block*) nandroid_queue_pop(&w->pool.work)) != NULL)
+        pool_finish_block(&w->pool, b, compress_block(b, w->level));
+    return NULL;
+}
+
+static void* gz_write_thread(void *cookie) {
+    struct gz_writer *w = (struct gz_writer*)cookie;
+    struct gz_block *b;
+    while ((b = (struct gz_block*) nandroid_queue_pop(&w->pool.ordered)) != NULL) {
+        int error = pool_wait_block(&w->pool, b);
+        if (!w->pool.error) {
+            if (error) {
+                LOGE("Error compressing block\n");
+                pool_fail(&w->pool);
+            }
+            else if (w->sink != NULL) {
+                if (w->sink(w->sink_cookie, b->out, b->out_len) != 0) {
+                    LOGE("Error writing compressed archive\n");
+                    pool_fail(&w->pool);
+                }
+            }
+            else if (write_fully(w->fd, b->out, b->out_len) != 0) {
+                LOGE("Error writing compressed archive: %s\n", strerror(errno));
+                pool_fail(&w->pool);
+            }
+        }
+        free_block(b);
+    }
+    return NULL;
+}
+
+static struct gz_block* new_block() {
+    struct gz_block *b = (struct gz_block*) calloc(1, sizeof(struct gz_block));
+    if (b == NULL)
+        return NULL;
+    b->in = (unsigned char*) malloc(GZ_BLOCK_SIZE);
+    if (b->in == NULL) {
+        free(b);
+        return NULL;
+    }
+    return b;
+}
+
+static struct gz_writer* gz_writer_start(int fd, gz_write_func sink, void* sink_cookie, int threads) {
+    struct gz_writer *w = (struct gz_writer*) calloc(1, sizeof(struct gz_writer));
+    if (w == NULL)
+        return NULL;
+    char value[PROPERTY_VALUE_MAX];
+    property_get("ro.cwm.nandroid_gzip_level", value, "1");
+    w->level = atoi(value);
+    if (w->level < 1 || w->level > 9)
+        w->level = Z_BEST_SPEED;
+
+    w->fd = fd;
+    w->sink = sink;
+    w->sink_cookie = sink_cookie;
+    if (pool_init(&w->pool, threads, compress_thread, w) != 0) {
+        free(w);
+        return NULL;
+    }
+    if (pthread_create(&w->writer, NULL, gz_write_thread, w) != 0) {
+        LOGE("Unable to start the compression threads\n");
+        pool_destroy(&w->pool);
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+struct gz_writer* gz_writer_open(const char* path, int threads) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        LOGE("Unable to create %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    struct gz_writer *w = gz_writer_start(fd, NULL, NULL, threads);
+    if (w == NULL)
+        close(fd);
+    return w;
+}
+
+struct gz_writer* gz_writer_open_stream(gz_write_func write_func, void* out, int threads) {
+    return gz_writer_start(-1, write_func, out, threads);
+}
+
+int gz_writer_write(void* cookie, const void* data, size_t len) {
+    struct gz_writer *w = (struct gz_writer*)cookie;
+    const unsigned char *p = (const unsigned char*)data;
+    while (len > 0) {
+        if (w->pool.error)
+            return -1;
+        if (w->current == NULL && (w->current = new_block()) == NULL)
+            return -1;
+        size_t n = GZ_BLOCK_SIZE - w->current->in_len;
+        if (n > len)
+            n = len;
+        memcpy(w->current->in + w->current->in_len, p, n);
+        w->current->in_len += n;
+        p += n;
+        len -= n;
+        if (w->current->in_len == GZ_BLOCK_SIZE) {
+            struct gz_block *b = w->current;
+            w->current = NULL;
+            if (pool_submit(&w->pool, b) != 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+int gz_writer_close(struct gz_writer* w) {
+    // flush the partial block, then the empty end marker
+    if (w->current != NULL && w->current->in_len > 0) {
+        pool_submit(&w->pool, w->current);
+        w->current = NULL;
+    }
+    if (w->current == NULL)
+        w->current = new_block();
+    if (w->current != NULL)
+        pool_submit(&w->pool, w->current);
+    else
+        pool_fail(&w->pool);
+    w->current = NULL;
+
+    nandroid_queue_close(&w->pool.ordered);
+    pthread_join(w->writer, NULL);
+    pool_destroy(&w->pool);
+    int ret = w->pool.error ? -1 : 0;
+    if (w->fd >= 0 && close(w->fd) != 0)
+        ret = -1;
+    free(w);
+    return ret;
+}
+
+/* Reader */
+
+static int decompress_block(struct gz_block *b) {
+    if (b->in_len < GZ_TRAILER_SIZE)
+        return -1;
+    const unsigned char *t = b->in + b->in_len - GZ_TRAILER_SIZE;
+    if (get_le32(t + 4) != b->out_len)
+        return -1;
+    if (b->out_len == 0)
+        return 0;
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, -MAX_WBITS) != Z_OK)
+        return -1;
+    zs.next_in = b->in;
+    zs.avail_in = b->in_len - GZ_TRAILER_SIZE;
+    zs.next_out = b->out;
+    zs.avail_out = b->out_len;
+    int ret = inflate(&zs, Z_FINISH);
+    size_t inflated = zs.total_out;
+    inflateEnd(&zs);
+    if (ret != Z_STREAM_END || inflated != b->out_len)
+        return -1;
+    if (crc32(crc32(0L, Z_NULL, 0), b->out, b->out_len) != get_le32(t))
+        return -1;
+    free(b->in);
+    b->in = NULL;
+    return 0;
+}
+
+static void* decompress_thread(void *cookie) {
+    struct gz_reader *r = (struct gz_reader*)cookie;
+    struct gz_block *b;
+    while ((b = (struct gz_block*) nandroid_queue_pop(&r->pool.work)) != NULL)
+        pool_finish_block(&r->pool, b, decompress_block(b));
+    return NULL;
+}
+
+// Reads the next member header. Returns 1 and fills in the sizes, 0 at the
+// end of the file, -1 if the data is not a block compressed member.
+static int read_member_header(gz_read_func read_func, void* cookie, uint32_t *member, uint32_t *usize) {
+    unsigned char h[GZ_HEADER_SIZE];
+    int got = read_fully(read_func, cookie, h, 12);
+    if (got == 0)
+        return 0;
+    if (got != 12 || h[0] != 0x1f || h[1] != 0x8b || h[2] != Z_DEFLATED || !(h[3] & 4))
+        return -1;
+    unsigned int xlen = get_le16(h + 10);
+    if (xlen != GZ_XLEN || read_fully(read_func, cookie, h + 12, xlen) != (int)xlen)
+        return -1;
+    if (h[12] != 'N' || h[13] != 'B' || get_le16(h + 14) != 8)
+        return -1;
+    *member = get_le32(h + 16);
+    *usize = get_le32(h + 20);
+    if (*member < GZ_HEADER_SIZE + GZ_TRAILER_SIZE || *usize > GZ_BLOCK_SIZE)
+        return -1;
+    return 1;
+}
+
+static void* gz_read_thread(void *cookie) {
+    struct gz_reader *r = (struct gz_reader*)cookie;
+    for (;;) {
+        uint32_t member, usize;
+        int ret = read_member_header(r->source, r->source_cookie, &member, &usize);
+        if (ret == 0)
+            break;
+        struct gz_block *b = NULL;
+        if (ret > 0 && (b = (struct gz_block*) calloc(1, sizeof(struct gz_block))) != NULL) {
+            b->in_len = member - GZ_HEADER_SIZE;
+            b->out_len = usize;
+            b->in = (unsigned char*) malloc(b->in_len);
+            b->out = (unsigned char*) malloc(usize ? usize : 1);
+            if (b->in == NULL || b->out == NULL ||
+                    read_fully(r->source, r->source_cookie, b->in, b->in_len) != (int)b->in_len) {
+                free_block(b);
+                b = NULL;
+            }
+        }
+        if (b == NULL) {
+            LOGE("Corrupt or truncated compressed archive\n");
+            pool_fail(&r->pool);
+            break;
+        }
+        r->done += member;
+        if (pool_submit(&r->pool, b) != 0)
+            break;
+    }
+    nandroid_queue_close(&r->pool.ordered);
+    return NULL;
+}
+
+static struct gz_reader* gz_reader_start(struct gz_reader* r, int threads) {
+    if (pool_init(&r->pool, threads, decompress_thread, r) != 0) {
+        free(r);
+        return NULL;
+    }
+    if (pthread_create(&r->reader, NULL, gz_read_thread, r) != 0) {
+        LOGE("Unable to start the decompression threads\n");
+        pool_destroy(&r->pool);
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+static struct gz_reader* gz_reader_open_fd(int fd, int threads) {
+    struct gz_reader *r = (struct gz_reader*) calloc(1, sizeof(struct gz_reader));
+    if (r == NULL) {
+        close(fd);
+        return NULL;
+    }
+    r->fd = fd;
+    struct stat st;
+    if (fstat(r->fd, &st) == 0)
+        r->total = st.st_size;
+    r->done = lseek64(fd, 0, SEEK_CUR);
+    r->source = fd_read;
+    r->source_cookie = &r->fd;
+    if ((r = gz_reader_start(r, threads)) == NULL)
+        close(fd);
+    return r;
+}
+
+struct gz_reader* gz_reader_open(const char* path, int threads) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOGE("Unable to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    return gz_reader_open_fd(fd, threads);
+}
+
+struct gz_reader* gz_reader_open_at(const char* path, uint64_t offset, int threads) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOGE("Unable to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    // the member headers alone say where each block starts and how much
+    // it inflates to, so everything before 'offset' is skipped unread
+    uint64_t pos = 0;
+    off64_t member_start = 0;
+    for (;;) {
+        uint32_t member, usize;
+        if (read_member_header(fd_read, &fd, &member, &usize) <= 0) {
+            LOGE("%s is not block compressed or too short\n", path);
+            close(fd);
+            return NULL;
+        }
+        if (usize == 0 || pos + usize > offset)
+            break;
+        pos += usize;
+        member_start += member;
+        if (lseek64(fd, member_start, SEEK_SET) != member_start) {
+            close(fd);
+            return NULL;
+        }
+    }
+    if (lseek64(fd, member_start, SEEK_SET) != member_start) {
+        close(fd);
+        return NULL;
+    }
+
+    struct gz_reader *r = gz_reader_open_fd(fd, threads);
+    char skip[4096];
+    while (r != NULL && pos < offset) {
+        size_t want = offset - pos > sizeof(skip) ? sizeof(skip) : (size_t)(offset - pos);
+        ssize_t got = gz_reader_read(r, skip, want);
+        if (got <= 0) {
+            gz_reader_close(r);
+            return NULL;
+        }
+        pos += got;
+    }
+    return r;
+}
+
+struct gz_reader* gz_reader_open_stream(gz_read_func read_func, void* in, uint64_t size, int threads) {
+    struct gz_reader *r = (struct gz_reader*) calloc(1, sizeof(struct gz_reader));
+    if (r == NULL)
+        return NULL;
+    r->fd = -1;
+    r->total = size;
+    r->source = read_func;
+    r->source_cookie = in;
+    return gz_reader_start(r, threads);
+}
+
+ssize_t gz_reader_read(void* cookie, void* data, size_t len) {
+    struct gz_reader *r = (struct gz_reader*)cookie;
+    while (r->current == NULL || r->pos == r->current->out_len) {
+        if (r->current != NULL) {
+            free_block(r->current);
+            r->current = NULL;
+        }
+        if (r->eof_marker)
+            return 0;
+        struct gz_block *b = (struct gz_block*) nandroid_queue_pop(&r->pool.ordered);
+        if (b == NULL) {
+            if (!r->pool.error)
+                LOGE("Compressed archive is truncated\n");
+            r->pool.error = 1;
+            return -1;
+        }
+        if (pool_wait_block(&r->pool, b) != 0) {
+            LOGE("Corrupt block in compressed archive\n");
+            free_block(b);
+            pool_fail(&r->pool);
+            return -1;
+        }
+        if (b->out_len == 0)
+            r->eof_marker = 1;
+        r->current = b;
+        r->pos = 0;
+    }
+    size_t n = r->current->out_len - r->pos;
+    if (n > len)
+        n = len;
+    memcpy(data, r->current->out + r->pos, n);
+    r->pos += n;
+    return n;
+}
+
+void gz_reader_progress(struct gz_reader* r, uint64_t* done, uint64_t* total) {
+    *done = r->done;
+    *total = r->total;
+}
+
+int gz_reader_close(struct gz_reader* r) {
+    int ret = r->pool.error || !r->eof_marker ? -1 : 0;
+    pool_fail(&r->pool);
+    pthread_join(r->reader, NULL);
+    if (r->current != NULL)
+        free_block(r->current);
+    struct gz_block *b;
+    while ((b = (struct gz_block*) nandroid_queue_pop(&r->pool.ordered)) != NULL) {
+        pool_wait_block(&r->pool, b);
+        free_block(b);
+    }
+    pool_destroy(&r->pool);
+    if (r->fd >= 0)
+        close(r->fd);
+    free(r);
+    return ret;
+}
+
+int gz_is_block_compressed(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    uint32_t member, usize;
+    int ret = read_member_header(fd_read, &fd, &member, &usize);
+    close(fd);
+    return ret > 0;
+}
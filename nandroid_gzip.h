@@ -0,0 +1,53 @@
+#ifndef NANDROID_GZIP_H
+#define NANDROID_GZIP_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Block compressed gzip streams.
+//
+// The input is cut into fixed size blocks which are deflated independently
+// on all cores. Every block is written as a complete gzip member whose
+// FEXTRA field carries an "NB" subfield with the compressed member size and
+// the uncompressed block size, so the file is a regular .gz that any gunzip
+// can read, while a reader can find every block boundary from the headers
+// alone and inflate the blocks in parallel as well. The stream ends with an
+// empty member, which lets the reader detect truncated archives.
+
+struct gz_writer;
+struct gz_reader;
+
+// Output sink for the compressed stream, same as tar_write_func.
+typedef int (*gz_write_func)(void* cookie, const void* data, size_t len);
+// Input source for the compressed stream, same as gz_reader_read.
+typedef ssize_t (*gz_read_func)(void* cookie, void* data, size_t len);
+
+// threads <= 0 uses one compressor per online cpu.
+struct gz_writer* gz_writer_open(const char* path, int threads);
+// Hands the compressed stream to 'write_func' instead of a file.
+struct gz_writer* gz_writer_open_stream(gz_write_func write_func, void* out, int threads);
+// Same signature as tar_write_func, cookie is the gz_writer.
+int gz_writer_write(void* cookie, const void* data, size_t len);
+// Flushes, writes the end marker and closes the file (not the stream).
+// Returns 0 on success.
+int gz_writer_close(struct gz_writer* w);
+
+struct gz_reader* gz_reader_open(const char* path, int threads);
+// Starts reading at 'offset' of the uncompressed stream. Only the block
+// holding it is inflated, the ones before are skipped by their headers.
+// gz_reader_close reports an error unless the stream is read to its end.
+struct gz_reader* gz_reader_open_at(const char* path, uint64_t offset, int threads);
+// Reads the compressed stream from 'read_func'; 'size' is only used for
+// gz_reader_progress.
+struct gz_reader* gz_reader_open_stream(gz_read_func read_func, void* in, uint64_t size, int threads);
+// Returns the number of bytes read, 0 at the end of the stream, -1 on error.
+ssize_t gz_reader_read(void* cookie, void* data, size_t len);
+// Compressed bytes consumed so far and the total compressed size.
+void gz_reader_progress(struct gz_reader* r, uint64_t* done, uint64_t* total);
+// Returns 0 if the whole stream, including the end marker, was read intact.
+int gz_reader_close(struct gz_reader* r);
+
+// Returns 1 if 'path' starts with a block compressed gzip member.
+int gz_is_block_compressed(const char* path);
+
+#endif
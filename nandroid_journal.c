@@ -0,0 +1,107 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "nandroid_journal.h"
+
+static void journal_path(const char* dir, const char* journal, char* path) {
+    snprintf(path, PATH_MAX, "%s/%s", dir, journal);
+}
+
+static int journal_write(const char* path, int flags, const char* line) {
+    int fd = open(path, O_WRONLY | O_CREAT | flags, 0644);
+    if (fd < 0) {
+        LOGE("Unable to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    size_t len = strlen(line);
+    int ret = write(fd, line, len) == (ssize_t)len ? 0 : -1;
+    if (fsync(fd) != 0)
+        ret = -1;
+    if (close(fd) != 0)
+        ret = -1;
+    if (ret != 0)
+        LOGE("Error writing %s\n", path);
+    return ret;
+}
+
+int journal_create(const char* dir, const char* journal, const char* type) {
+    char path[PATH_MAX];
+    char line[PATH_MAX];
+    journal_path(dir, journal, path);
+    snprintf(line, sizeof(line), "type %s\n", type);
+    return journal_write(path, O_TRUNC, line);
+}
+
+int journal_exists(const char* dir, const char* journal) {
+    char path[PATH_MAX];
+    struct stat st;
+    journal_path(dir, journal, path);
+    return stat(path, &st) == 0;
+}
+
+int journal_type(const char* dir, const char* journal, char* type, size_t len) {
+    return journal_find(dir, journal, "type", NULL, type, len);
+}
+
+int journal_append(const char* dir, const char* journal, const char* key, const char* name, const char* data) {
+    char path[PATH_MAX];
+    char line[PATH_MAX * 2];
+    journal_path(dir, journal, path);
+    snprintf(line, sizeof(line), "%s %s%s%s\n", key, name, data != NULL ? " " : "", data != NULL ? data : "");
+    return journal_write(path, O_APPEND, line);
+}
+
+// A NULL name matches the first line with the key, and 'data' gets
+// everything after it.
+int journal_find(const char* dir, const char* journal, const char* key, const char* name, char* data, size_t len) {
+    char path[PATH_MAX];
+    char line[PATH_MAX * 2];
+    int ret = -1;
+    journal_path(dir, journal, path);
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        size_t n = strlen(line);
+        // a line cut short by a power loss does not count
+        if (n == 0 || line[n - 1] != '\n')
+            break;
+        line[n - 1] = '\0';
+        size_t klen = strlen(key);
+        if (strncmp(line, key, klen) != 0 || line[klen] != ' ')
+            continue;
+        char* rest = line + klen + 1;
+        if (name != NULL) {
+            size_t nlen = strlen(name);
+            if (strncmp(rest, name, nlen) != 0 || (rest[nlen] != ' ' && rest[nlen] != '\0'))
+                continue;
+            rest += nlen;
+            if (*rest == ' ')
+                rest++;
+        }
+        if (data != NULL) {
+            strncpy(data, rest, len - 1);
+            data[len - 1] = '\0';
+        }
+        ret = 0;
+        break;
+    }
+    fclose(f);
+    return ret;
+}
+
+int journal_remove(const char* dir, const char* journal) {
+    char path[PATH_MAX];
+    journal_path(dir, journal, path);
+    if (unlink(path) != 0 && errno != ENOENT)
+        return -1;
+    sync();
+    return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef NANDROID_JOURNAL_H
+#define NANDROID_JOURNAL_H
+
+#include <sys/types.h>
+
+// Journals let an interrupted backup or restore continue where it stopped.
+// They are text files in the backup folder, one "<key> <name> [data]" line
+// per step, appended and synced once the step is safely on disk. A journal
+// only exists while its operation is unfinished.
+
+#define NANDROID_BACKUP_JOURNAL     "nandroid.journal"
+#define NANDROID_RESTORE_JOURNAL    "nandroid.restore"
+
+// Starts a new journal whose first line is "type <type>".
+int journal_create(const char* dir, const char* journal, const char* type);
+int journal_exists(const char* dir, const char* journal);
+// Copies the type given to journal_create into 'type'.
+int journal_type(const char* dir, const char* journal, char* type, size_t len);
+int journal_append(const char* dir, const char* journal, const char* key, const char* name, const char* data);
+// Returns 0 if there is a line for key and name, and copies the rest of it
+// into 'data' if that is not NULL.
+int journal_find(const char* dir, const char* journal, const char* key, const char* name, char* data, size_t len);
+int journal_remove(const char* dir, const char* journal);
+
+#endif
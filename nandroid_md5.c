@@ -0,0 +1,387 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <openssl/md5.h>
+
+#include "common.h"
+#include "nandroid_md5.h"
+#include "nandroid_queue.h"
+
+#define MD5_BUFFER_SIZE (128 * 1024)
+
+struct md5_file {
+    int fd;
+    MD5_CTX ctx;
+    char path[PATH_MAX];
+};
+
+struct md5_entry {
+    char name[NAME_MAX + 1];
+    unsigned char digest[MD5_DIGEST_LENGTH];
+};
+
+// Partition backups run concurrently, see nandroid_backup.
+static pthread_mutex_t md5_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct md5_entry *md5_entries = NULL;
+static int md5_count = 0;
+static int md5_capacity = 0;
+
+static void md5_record(const char* path, const unsigned char* digest) {
+    char tmp[PATH_MAX];
+    strcpy(tmp, path);
+    pthread_mutex_lock(&md5_lock);
+    if (md5_count == md5_capacity) {
+        int capacity = md5_capacity == 0 ? 16 : md5_capacity * 2;
+        struct md5_entry *entries = (struct md5_entry*) realloc(md5_entries, capacity * sizeof(struct md5_entry));
+        if (entries == NULL) {
+            pthread_mutex_unlock(&md5_lock);
+            LOGE("Out of memory recording md5 of %s\n", path);
+            return;
+        }
+        md5_entries = entries;
+        md5_capacity = capacity;
+    }
+    struct md5_entry *e = &md5_entries[md5_count++];
+    strncpy(e->name, basename(tmp), NAME_MAX);
+    e->name[NAME_MAX] = '\0';
+    memcpy(e->digest, digest, MD5_DIGEST_LENGTH);
+    pthread_mutex_unlock(&md5_lock);
+}
+
+struct md5_file* md5_file_open(const char* path) {
+    struct md5_file *f = (struct md5_file*) malloc(sizeof(struct md5_file));
+    if (f == NULL)
+        return NULL;
+    f->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (f->fd < 0) {
+        LOGE("Unable to create %s: %s\n", path, strerror(errno));
+        free(f);
+        return NULL;
+    }
+    strcpy(f->path, path);
+    MD5_Init(&f->ctx);
+    return f;
+}
+
+int md5_file_write(void* cookie, const void* data, size_t len) {
+    struct md5_file *f = (struct md5_file*)cookie;
+    const char *p = (const char*)data;
+    MD5_Update(&f->ctx, data, len);
+    while (len > 0) {
+        ssize_t w = write(f->fd, p, len);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            LOGE("Error writing %s: %s\n", f->path, strerror(errno));
+            return -1;
+        }
+        p += w;
+        len -= w;
+    }
+    return 0;
+}
+
+int md5_file_close(struct md5_file* f) {
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    int ret = close(f->fd);
+    MD5_Final(digest, &f->ctx);
+    if (ret == 0)
+        md5_record(f->path, digest);
+    free(f);
+    return ret;
+}
+
+int nandroid_md5_add_file(const char* path) {
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    MD5_CTX ctx;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOGE("Unable to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    char *buf = (char*) malloc(MD5_BUFFER_SIZE);
+    if (buf == NULL) {
+        close(fd);
+        return -1;
+    }
+    MD5_Init(&ctx);
+    ssize_t r;
+    while ((r = read(fd, buf, MD5_BUFFER_SIZE)) != 0) {
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            LOGE("Error reading %s: %s\n", path, strerror(errno));
+            break;
+        }
+        MD5_Update(&ctx, buf, r);
+    }
+    free(buf);
+    close(fd);
+    MD5_Final(digest, &ctx);
+    if (r < 0)
+        return -1;
+    md5_record(path, digest);
+    return 0;
+}
+
+void nandroid_md5_reset() {
+    pthread_mutex_lock(&md5_lock);
+    free(md5_entries);
+    md5_entries = NULL;
+    md5_count = 0;
+    md5_capacity = 0;
+    pthread_mutex_unlock(&md5_lock);
+}
+
+static int compare_entries(const void* a, const void* b) {
+    return strcmp(((const struct md5_entry*)a)->name, ((const struct md5_entry*)b)->name);
+}
+
+int nandroid_md5_write(const char* dir) {
+    char path[PATH_MAX];
+    int i, j;
+    sprintf(path, "%s/%s", dir, NANDROID_MD5_FILE);
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        LOGE("Unable to create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    pthread_mutex_lock(&md5_lock);
+    qsort(md5_entries, md5_count, sizeof(struct md5_entry), compare_entries);
+    for (i = 0; i < md5_count; i++) {
+        for (j = 0; j < MD5_DIGEST_LENGTH; j++)
+            fprintf(f, "%02x", md5_entries[i].digest[j]);
+        fprintf(f, "  %s\n", md5_entries[i].name);
+    }
+    pthread_mutex_unlock(&md5_lock);
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+static int parse_hex(const char* hex, unsigned char* digest);
+
+static int md5_lookup(const char* path, unsigned char* digest) {
+    char tmp[PATH_MAX];
+    int i, found = 0;
+    strcpy(tmp, path);
+    const char* name = basename(tmp);
+    pthread_mutex_lock(&md5_lock);
+    for (i = 0; i < md5_count; i++) {
+        if (strcmp(md5_entries[i].name, name) == 0) {
+            memcpy(digest, md5_entries[i].digest, MD5_DIGEST_LENGTH);
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&md5_lock);
+    return found;
+}
+
+static int parse_hex(const char* hex, unsigned char* digest) {
+    int i;
+    for (i = 0; i < MD5_DIGEST_LENGTH * 2; i++) {
+        int c = hex[i], v;
+        if (c >= '0' && c <= '9')
+            v = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            v = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            v = c - 'A' + 10;
+        else
+            return -1;
+        if (i % 2 == 0)
+            digest[i / 2] = v << 4;
+        else
+            digest[i / 2] |= v;
+    }
+    return 0;
+}
+
+int nandroid_md5_load(const char* dir) {
+    char line[PATH_MAX + 64];
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    sprintf(line, "%s/%s", dir, NANDROID_MD5_FILE);
+    nandroid_md5_reset();
+    FILE *f = fopen(line, "r");
+    if (f == NULL) {
+        LOGE("Unable to open %s: %s\n", line, strerror(errno));
+        return -1;
+    }
+    int ret = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        // "<digest>  <name>", or "<digest> *<name>" in binary mode
+        size_t len = strlen(line);
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        if (len < MD5_DIGEST_LENGTH * 2 + 3 || parse_hex(line, digest) != 0 ||
+                line[MD5_DIGEST_LENGTH * 2] != ' ') {
+            LOGE("Malformed line in %s: %s\n", NANDROID_MD5_FILE, line);
+            ret = -1;
+            break;
+        }
+        md5_record(line + MD5_DIGEST_LENGTH * 2 + 2, digest);
+    }
+    fclose(f);
+    return ret;
+}
+
+int nandroid_md5_check_file(const char* path) {
+    struct md5_reader *r = md5_reader_open(path);
+    if (r == NULL)
+        return -1;
+    return md5_reader_close(r, 1);
+}
+
+struct md5_chunk {
+    size_t len;
+    char data[MD5_BUFFER_SIZE];
+};
+
+struct md5_reader {
+    int fd;
+    char path[PATH_MAX];
+    MD5_CTX ctx;
+    unsigned char expected[MD5_DIGEST_LENGTH];
+    int listed;
+    struct nandroid_queue queue;
+    pthread_t reader;
+    volatile int error;
+    volatile int complete;
+    struct md5_chunk *current;
+    size_t pos;
+    uint64_t total;
+    volatile uint64_t done;
+};
+
+static void* md5_read_thread(void* cookie) {
+    struct md5_reader *r = (struct md5_reader*)cookie;
+    for (;;) {
+        struct md5_chunk *c = (struct md5_chunk*) malloc(sizeof(struct md5_chunk));
+        if (c == NULL) {
+            r->error = 1;
+            break;
+        }
+        ssize_t len;
+        do {
+            len = read(r->fd, c->data, MD5_BUFFER_SIZE);
+        } while (len < 0 && errno == EINTR);
+        if (len <= 0) {
+            if (len < 0) {
+                LOGE("Error reading %s: %s\n", r->path, strerror(errno));
+                r->error = 1;
+            }
+            else {
+                r->complete = 1;
+            }
+            free(c);
+            break;
+        }
+        c->len = len;
+        MD5_Update(&r->ctx, c->data, len);
+        r->done += len;
+        if (nandroid_queue_push(&r->queue, c) != 0) {
+            free(c);
+            break;
+        }
+    }
+    nandroid_queue_close(&r->queue);
+    return NULL;
+}
+
+struct md5_reader* md5_reader_open(const char* path) {
+    struct md5_reader *r = (struct md5_reader*) calloc(1, sizeof(struct md5_reader));
+    if (r == NULL)
+        return NULL;
+    r->fd = open(path, O_RDONLY);
+    if (r->fd < 0) {
+        LOGE("Unable to open %s: %s\n", path, strerror(errno));
+        free(r);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(r->fd, &st) == 0)
+        r->total = st.st_size;
+    strcpy(r->path, path);
+    r->listed = md5_lookup(path, r->expected);
+    MD5_Init(&r->ctx);
+    nandroid_queue_init(&r->queue, 8);
+    pthread_create(&r->reader, NULL, md5_read_thread, r);
+    return r;
+}
+
+ssize_t md5_reader_read(void* cookie, void* data, size_t len) {
+    struct md5_reader *r = (struct md5_reader*)cookie;
+    while (r->current == NULL || r->pos == r->current->len) {
+        free(r->current);
+        r->pos = 0;
+        r->current = (struct md5_chunk*) nandroid_queue_pop(&r->queue);
+        if (r->current == NULL)
+            return r->error ? -1 : 0;
+    }
+    size_t n = r->current->len - r->pos;
+    if (n > len)
+        n = len;
+    memcpy(data, r->current->data + r->pos, n);
+    r->pos += n;
+    return n;
+}
+
+void md5_reader_progress(struct md5_reader* r, uint64_t* done, uint64_t* total) {
+    *done = r->done;
+    *total = r->total;
+}
+
+int md5_reader_close(struct md5_reader* r, int verify) {
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    struct md5_chunk *c;
+    if (!verify)
+        nandroid_queue_close(&r->queue);
+    free(r->current);
+    while ((c = (struct md5_chunk*) nandroid_queue_pop(&r->queue)) != NULL)
+        free(c);
+    pthread_join(r->reader, NULL);
+    nandroid_queue_destroy(&r->queue);
+    close(r->fd);
+    MD5_Final(digest, &r->ctx);
+
+    int ret = 0;
+    if (verify) {
+        if (r->error || !r->complete)
+            ret = -1;
+        else if (!r->listed)
+            LOGI("No md5 sum for %s, not verified\n", r->path);
+        else if (memcmp(digest, r->expected, MD5_DIGEST_LENGTH) != 0) {
+            LOGE("MD5 mismatch: %s\n", r->path);
+            ret = -1;
+        }
+    }
+    free(r);
+    return ret;
+}
+
+int nandroid_md5_get_hex(const char* path, char* hex) {
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    int i;
+    if (!md5_lookup(path, digest))
+        return -1;
+    for (i = 0; i < MD5_DIGEST_LENGTH; i++)
+        sprintf(hex + i * 2, "%02x", digest[i]);
+    return 0;
+}
+
+int nandroid_md5_add_hex(const char* path, const char* hex) {
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    if (strlen(hex) < MD5_DIGEST_LENGTH * 2 || parse_hex(hex, digest) != 0)
+        return -1;
+    md5_record(path, digest);
+    return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef NANDROID_MD5_H
+#define NANDROID_MD5_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define NANDROID_MD5_FILE "nandroid.md5"
+
+// Backup images are hashed while they are written, and the digests are
+// collected in memory until nandroid_md5_write puts them into the
+// md5sum compatible nandroid.md5 of the backup.
+
+struct md5_file;
+
+struct md5_file* md5_file_open(const char* path);
+// Same signature as tar_write_func, cookie is the md5_file.
+int md5_file_write(void* cookie, const void* data, size_t len);
+// Closes the file and records its digest. Returns 0 on success.
+int md5_file_close(struct md5_file* f);
+
+// Reads back and records a file written by another tool (eg. dedupe).
+int nandroid_md5_add_file(const char* path);
+
+// Digests as 32 hex digits, used to carry them across an interrupted backup.
+int nandroid_md5_get_hex(const char* path, char* hex);
+int nandroid_md5_add_hex(const char* path, const char* hex);
+
+void nandroid_md5_reset();
+// Writes all recorded digests, sorted by file name, to dir/nandroid.md5.
+int nandroid_md5_write(const char* dir);
+
+// Restore side: the digests of dir/nandroid.md5 replace the recorded ones.
+// Files that are not listed (eg. tar files of backups made with
+// nandroid-md5.sh) are not verified, like md5sum -c did.
+int nandroid_md5_load(const char* dir);
+
+// Reads 'path' once and compares it. Returns 0 if it matches.
+int nandroid_md5_check_file(const char* path);
+
+// Reads a backup file ahead on its own thread and hashes it on the way, so
+// it can be verified while it is being restored.
+struct md5_reader;
+
+struct md5_reader* md5_reader_open(const char* path);
+// Same signature as gz_read_func. Returns 0 at the end of the file.
+ssize_t md5_reader_read(void* cookie, void* data, size_t len);
+void md5_reader_progress(struct md5_reader* r, uint64_t* done, uint64_t* total);
+// With 'verify' set, reads whatever the consumer left and returns 0 only if
+// the digest matches. Without it, just stops reading.
+int md5_reader_close(struct md5_reader* r, int verify);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef NANDROID_QUEUE_H
+#define NANDROID_QUEUE_H
+
+#include <pthread.h>
+
+// Bounded FIFO used to hand work between the nandroid worker threads.
+// Producers block while the queue is full, consumers while it is empty.
+// Closing the queue wakes everybody up: further pushes fail, and pops
+// drain whatever is left before returning NULL.
+struct nandroid_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    void **items;
+    int capacity;
+    int head;
+    int count;
+    int closed;
+};
+
+int nandroid_queue_init(struct nandroid_queue *q, int capacity);
+void nandroid_queue_destroy(struct nandroid_queue *q);
+
+// Returns 0 on success, -1 if the queue has been closed.
+int nandroid_queue_push(struct nandroid_queue *q, void *item);
+
+// Returns NULL once the queue is closed and empty.
+void *nandroid_queue_pop(struct nandroid_queue *q);
+
+void nandroid_queue_close(struct nandroid_queue *q);
+
+#endif
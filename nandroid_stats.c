@@ -0,0 +1,204 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/vfs.h>
+
+#include "common.h"
+#include "mounts.h"
+#include "nandroid_stats.h"
+#include "roots.h"
+
+static const char* phase_names[NANDROID_PHASE_COUNT] = {
+    "mount", "scan", "format", "data", "md5", "sync"
+};
+
+uint64_t nandroid_stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void nandroid_stats_add(struct nandroid_stats* s, int phase, uint64_t start) {
+    if (s != NULL)
+        s->phase_us[phase] += nandroid_stats_now() - start;
+}
+
+static uint64_t stats_total_us(const struct nandroid_stats* s) {
+    uint64_t total = 0;
+    int i;
+    for (i = 0; i < NANDROID_PHASE_COUNT; i++)
+        total += s->phase_us[i];
+    return total;
+}
+
+// MB/s with one decimal, as an integer of tenths.
+static unsigned int mb_per_s_tenths(uint64_t bytes, uint64_t us) {
+    if (us == 0)
+        return 0;
+    return (unsigned int)(bytes * 10000000 / us / (1024 * 1024));
+}
+
+void nandroid_stats_print(const struct nandroid_stats* s) {
+    char phases[256];
+    char* p = phases;
+    int i;
+    uint64_t total = stats_total_us(s);
+    uint64_t data = s->phase_us[NANDROID_PHASE_DATA];
+    phases[0] = '\0';
+    for (i = 0; i < NANDROID_PHASE_COUNT; i++) {
+        if (s->phase_us[i] >= 100000)
+            p += sprintf(p, " %s %llu.%llus", phase_names[i], s->phase_us[i] / 1000000, s->phase_us[i] / 100000 % 10);
+    }
+    unsigned int mbs = mb_per_s_tenths(s->bytes, data);
+    ui_print("%s: %lluMB in %llu.%llus, %u.%u MB/s", s->name, s->bytes / (1024 * 1024),
+            total / 1000000, total / 100000 % 10, mbs / 10, mbs % 10);
+    if (s->files != 0 && data != 0)
+        ui_print(", %llu files/s", s->files * 1000000 / data);
+    ui_print("\n %s\n", phases);
+}
+
+int nandroid_stats_write(const char* dir, const char* op, const struct nandroid_stats* s, int count) {
+    char path[PATH_MAX];
+    int i, j;
+    sprintf(path, "%s/%s", dir, NANDROID_STATS_FILE);
+    FILE* f = fopen(path, "a");
+    if (f == NULL)
+        return -1;
+    for (i = 0; i < count; i++) {
+        if (s[i].name[0] == '\0')
+            continue;
+        fprintf(f, "%s %s bytes=%llu files=%llu", op, s[i].name, s[i].bytes, s[i].files);
+        for (j = 0; j < NANDROID_PHASE_COUNT; j++)
+            fprintf(f, " %s_ms=%llu", phase_names[j], s[i].phase_us[j] / 1000);
+        fprintf(f, " total_ms=%llu\n", stats_total_us(&s[i]) / 1000);
+    }
+    return fclose(f);
+}
+
+// nandroid bench: reads the first BENCH_SIZE bytes of every block device,
+// and writes and reads back a file of that size on every mountable volume
+// with room for it. Raw partitions are never written to.
+
+#define BENCH_SIZE      (32 * 1024 * 1024)
+#define BENCH_BUFFER    (1024 * 1024)
+#define BENCH_FILE      ".nandroid_bench"
+
+// So reads come from the flash and not the page cache.
+static void drop_caches() {
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd >= 0) {
+        write(fd, "3\n", 2);
+        close(fd);
+    }
+}
+
+// Returns the bytes per second of reading 'fd', or 0 on error.
+static uint64_t bench_read(int fd, char* buf) {
+    uint64_t done = 0;
+    drop_caches();
+    uint64_t start = nandroid_stats_now();
+    while (done < BENCH_SIZE) {
+        ssize_t r = read(fd, buf, BENCH_BUFFER);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            break;
+        done += r;
+    }
+    uint64_t us = nandroid_stats_now() - start;
+    return us == 0 ? 0 : done * 1000000 / us;
+}
+
+static uint64_t bench_write(int fd, char* buf) {
+    uint64_t done = 0;
+    uint64_t start = nandroid_stats_now();
+    while (done < BENCH_SIZE) {
+        ssize_t r = write(fd, buf, BENCH_BUFFER);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return 0;
+        done += r;
+    }
+    if (fsync(fd) != 0)
+        return 0;
+    uint64_t us = nandroid_stats_now() - start;
+    return us == 0 ? 0 : done * 1000000 / us;
+}
+
+static void print_rate(const char* what, uint64_t rate) {
+    unsigned int tenths = rate * 10 / (1024 * 1024);
+    if (rate == 0)
+        ui_print("  %s: -\n", what);
+    else
+        ui_print("  %s: %u.%u MB/s\n", what, tenths / 10, tenths % 10);
+}
+
+static int is_raw_volume(const Volume* v) {
+    return strcmp(v->fs_type, "mtd") == 0 || strcmp(v->fs_type, "bml") == 0 ||
+            strcmp(v->fs_type, "emmc") == 0;
+}
+
+int nandroid_bench() {
+    Volume* volumes = get_device_volumes();
+    int i, count = get_num_volumes();
+    char* buf = (char*) malloc(BENCH_BUFFER);
+    if (buf == NULL)
+        return -1;
+    for (i = 0; i < BENCH_BUFFER; i++)
+        buf[i] = (char)(i * 7);
+
+    ui_print("\nNandroid benchmark (%dMB per test)\n", BENCH_SIZE / (1024 * 1024));
+    for (i = 0; i < count; i++) {
+        Volume* v = &volumes[i];
+        if (v->fs_type == NULL || strcmp(v->fs_type, "ramdisk") == 0 || v->device == NULL)
+            continue;
+        ui_print("%s\n", v->mount_point);
+
+        // mtd partitions are named, not opened as block devices
+        if (v->device[0] == '/') {
+            int fd = open(v->device, O_RDONLY);
+            print_rate("raw read", fd < 0 ? 0 : bench_read(fd, buf));
+            if (fd >= 0)
+                close(fd);
+        }
+        if (is_raw_volume(v))
+            continue;
+
+        scan_mounted_volumes();
+        int was_mounted = find_mounted_volume_by_mount_point(v->mount_point) != NULL;
+        struct statfs sfs;
+        if (ensure_path_mounted(v->mount_point) != 0 || statfs(v->mount_point, &sfs) != 0 ||
+                (uint64_t)sfs.f_bavail * sfs.f_bsize < 2 * (uint64_t)BENCH_SIZE) {
+            ui_print("  not mounted or full, skipping file test\n");
+        }
+        else {
+            char path[PATH_MAX];
+            sprintf(path, "%s/%s", v->mount_point, BENCH_FILE);
+            int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+            if (fd >= 0) {
+                print_rate("file write", bench_write(fd, buf));
+                lseek(fd, 0, SEEK_SET);
+                print_rate("file read", bench_read(fd, buf));
+                close(fd);
+                unlink(path);
+            }
+            else {
+                ui_print("  unable to create %s\n", path);
+            }
+        }
+        if (!was_mounted)
+            ensure_path_unmounted(v->mount_point);
+    }
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef NANDROID_STATS_H
+#define NANDROID_STATS_H
+
+#include <stdint.h>
+
+#define NANDROID_STATS_FILE "nandroid.stats"
+
+// Where the time of a partition backup or restore goes.
+#define NANDROID_PHASE_MOUNT    0
+#define NANDROID_PHASE_SCAN     1   // directory walks and size estimates
+#define NANDROID_PHASE_FORMAT   2
+#define NANDROID_PHASE_DATA     3   // writing or extracting the archive/image
+#define NANDROID_PHASE_MD5      4   // separate hashing passes
+#define NANDROID_PHASE_SYNC     5
+#define NANDROID_PHASE_COUNT    6
+
+struct nandroid_stats {
+    char name[64];
+    uint64_t phase_us[NANDROID_PHASE_COUNT];
+    uint64_t bytes;
+    uint64_t files;
+};
+
+// Monotonic time in microseconds.
+uint64_t nandroid_stats_now();
+
+// Adds the time since 'start' to 'phase'. 's' may be NULL.
+void nandroid_stats_add(struct nandroid_stats* s, int phase, uint64_t start);
+
+// One line per partition: size, time, MB/s, files/s and the phases.
+void nandroid_stats_print(const struct nandroid_stats* s);
+
+// Appends "<op> <name> bytes=... files=... <phase>_ms=..." lines to
+// dir/nandroid.stats. Returns 0 on success.
+int nandroid_stats_write(const char* dir, const char* op, const struct nandroid_stats* s, int count);
+
+// Measures read and write throughput of every volume and of the sdcard.
+int nandroid_bench();
+
+#endif
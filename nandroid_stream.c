@@ -0,0 +1,393 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <openssl/md5.h>
+
+#include "common.h"
+#include "nandroid_md5.h"
+#include "nandroid_stream.h"
+
+#define STREAM_FILE     1
+#define STREAM_DATA     2
+#define STREAM_DONE     3
+#define STREAM_END      4
+
+struct stream_frame {
+    uint32_t type;
+    uint32_t len;
+};
+
+struct nandroid_stream {
+    int fd;
+    int writing;
+    int error;
+    int in_file;
+    MD5_CTX ctx;
+    // writing: DATA not sent yet; reading: DATA left of the current frame
+    char* buf;
+    size_t used;
+    uint32_t left;
+};
+
+static int read_full(int fd, void* data, size_t len) {
+    char* p = (char*)data;
+    while (len > 0) {
+        ssize_t r = read(fd, p, len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void* data, size_t len) {
+    const char* p = (const char*)data;
+    while (len > 0) {
+        ssize_t w = write(fd, p, len);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return -1;
+        p += w;
+        len -= w;
+    }
+    return 0;
+}
+
+static int parse_port(const char* s) {
+    char* end;
+    long port = strtol(s, &end, 10);
+    if (*s == '\0' || *end != '\0' || port <= 0 || port > 65535)
+        return -1;
+    return (int)port;
+}
+
+static int unix_address(const char* path, struct sockaddr_un* sun) {
+    if (strlen(path) >= sizeof(sun->sun_path))
+        return -1;
+    memset(sun, 0, sizeof(*sun));
+    sun->sun_family = AF_UNIX;
+    strcpy(sun->sun_path, path);
+    return 0;
+}
+
+static int stream_connect(const char* address) {
+    int fd = -1;
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un sun;
+        if (unix_address(address + 5, &sun) != 0)
+            return -1;
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr*)&sun, sizeof(sun)) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    else if (strncmp(address, "tcp:", 4) == 0) {
+        char host[64];
+        const char* colon = strrchr(address + 4, ':');
+        struct sockaddr_in sin;
+        if (colon == NULL || colon - (address + 4) >= (int)sizeof(host))
+            return -1;
+        memcpy(host, address + 4, colon - (address + 4));
+        host[colon - (address + 4)] = '\0';
+        int port = parse_port(colon + 1);
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons(port);
+        if (port < 0 || inet_aton(host, &sin.sin_addr) == 0)
+            return -1;
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr*)&sin, sizeof(sin)) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    return fd;
+}
+
+// Waits for the one connection a stream is sent or received over.
+static int stream_listen(const char* address) {
+    int fd, conn = -1, one = 1;
+    if (address[0] == '/') {
+        struct sockaddr_un sun;
+        if (unix_address(address, &sun) != 0)
+            return -1;
+        unlink(address);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        if (bind(fd, (struct sockaddr*)&sun, sizeof(sun)) == 0 && listen(fd, 1) == 0)
+            conn = accept(fd, NULL, NULL);
+        unlink(address);
+    }
+    else {
+        struct sockaddr_in sin;
+        int port = parse_port(address);
+        if (port < 0)
+            return -1;
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons(port);
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, (struct sockaddr*)&sin, sizeof(sin)) == 0 && listen(fd, 1) == 0)
+            conn = accept(fd, NULL, NULL);
+    }
+    close(fd);
+    return conn;
+}
+
+struct nandroid_stream* nandroid_stream_open(const char* address, int writing) {
+    int fd;
+    if (strcmp(address, "-") == 0) {
+        // ui_print goes to stdout as well, keep it out of the stream
+        fflush(stdout);
+        fd = dup(writing ? STDOUT_FILENO : STDIN_FILENO);
+        if (writing && fd >= 0)
+            dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+    else if (strncmp(address, "listen:", 7) == 0) {
+        ui_print("Waiting for a connection on %s...\n", address + 7);
+        fd = stream_listen(address + 7);
+    }
+    else {
+        fd = stream_connect(address);
+    }
+    if (fd < 0) {
+        LOGE("Unable to open stream %s: %s\n", address, strerror(errno));
+        return NULL;
+    }
+    // a receiver that goes away must fail the write, not kill recovery
+    signal(SIGPIPE, SIG_IGN);
+
+    struct nandroid_stream* s = (struct nandroid_stream*) calloc(1, sizeof(struct nandroid_stream));
+    if (s == NULL || (writing && (s->buf = (char*) malloc(NANDROID_STREAM_FRAME)) == NULL)) {
+        free(s);
+        close(fd);
+        return NULL;
+    }
+    s->fd = fd;
+    s->writing = writing;
+
+    char magic[8];
+    uint32_t version = NANDROID_STREAM_VERSION;
+    if (writing) {
+        memcpy(magic, NANDROID_STREAM_MAGIC, sizeof(magic));
+        s->error = write_full(fd, magic, sizeof(magic)) != 0 || write_full(fd, &version, sizeof(version)) != 0;
+    }
+    else if (read_full(fd, magic, sizeof(magic)) != 0 || read_full(fd, &version, sizeof(version)) != 0 ||
+            memcmp(magic, NANDROID_STREAM_MAGIC, sizeof(magic)) != 0 || version != NANDROID_STREAM_VERSION) {
+        LOGE("%s is not a nandroid stream\n", address);
+        s->error = 1;
+    }
+    if (s->error) {
+        nandroid_stream_close(s);
+        return NULL;
+    }
+    return s;
+}
+
+static int send_frame(struct nandroid_stream* s, uint32_t type, const void* data, uint32_t len) {
+    struct stream_frame f;
+    f.type = type;
+    f.len = len;
+    if (s->error || write_full(s->fd, &f, sizeof(f)) != 0 || write_full(s->fd, data, len) != 0) {
+        if (!s->error)
+            LOGE("Error writing the backup stream: %s\n", strerror(errno));
+        s->error = 1;
+        return -1;
+    }
+    return 0;
+}
+
+int nandroid_stream_close(struct nandroid_stream* s) {
+    if (s->writing && !s->in_file)
+        send_frame(s, STREAM_END, NULL, 0);
+    int ret = s->error || (s->writing && s->in_file) ? -1 : 0;
+    if (close(s->fd) != 0)
+        ret = -1;
+    free(s->buf);
+    free(s);
+    return ret;
+}
+
+int nandroid_stream_begin_file(struct nandroid_stream* s, const char* name) {
+    if (send_frame(s, STREAM_FILE, name, strlen(name)) != 0)
+        return -1;
+    MD5_Init(&s->ctx);
+    s->used = 0;
+    s->in_file = 1;
+    return 0;
+}
+
+int nandroid_stream_write(void* cookie, const void* data, size_t len) {
+    struct nandroid_stream* s = (struct nandroid_stream*)cookie;
+    const char* p = (const char*)data;
+    MD5_Update(&s->ctx, data, len);
+    while (len > 0) {
+        size_t n = NANDROID_STREAM_FRAME - s->used;
+        if (n > len)
+            n = len;
+        memcpy(s->buf + s->used, p, n);
+        s->used += n;
+        p += n;
+        len -= n;
+        if (s->used == NANDROID_STREAM_FRAME) {
+            if (send_frame(s, STREAM_DATA, s->buf, s->used) != 0)
+                return -1;
+            s->used = 0;
+        }
+    }
+    return s->error ? -1 : 0;
+}
+
+int nandroid_stream_end_file(struct nandroid_stream* s) {
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    if (s->used > 0 && send_frame(s, STREAM_DATA, s->buf, s->used) != 0)
+        return -1;
+    s->used = 0;
+    MD5_Final(digest, &s->ctx);
+    if (send_frame(s, STREAM_DONE, digest, sizeof(digest)) != 0)
+        return -1;
+    s->in_file = 0;
+    return 0;
+}
+
+static int receive_frame(struct nandroid_stream* s, struct stream_frame* f) {
+    if (s->error || read_full(s->fd, f, sizeof(*f)) != 0) {
+        if (!s->error)
+            LOGE("Backup stream ended early\n");
+        s->error = 1;
+        return -1;
+    }
+    return 0;
+}
+
+int nandroid_stream_next_file(struct nandroid_stream* s, char* name, size_t size) {
+    struct stream_frame f;
+    if (s->in_file && nandroid_stream_skip_file(s) != 0)
+        return -1;
+    if (receive_frame(s, &f) != 0)
+        return -1;
+    if (f.type == STREAM_END && f.len == 0)
+        return 0;
+    if (f.type != STREAM_FILE || f.len == 0 || f.len >= size || read_full(s->fd, name, f.len) != 0) {
+        LOGE("Backup stream is corrupt\n");
+        s->error = 1;
+        return -1;
+    }
+    name[f.len] = '\0';
+    MD5_Init(&s->ctx);
+    s->left = 0;
+    s->in_file = 1;
+    return 1;
+}
+
+ssize_t nandroid_stream_read(void* cookie, void* data, size_t len) {
+    struct nandroid_stream* s = (struct nandroid_stream*)cookie;
+    struct stream_frame f;
+    if (s->error)
+        return -1;
+    if (!s->in_file)
+        return 0;
+    while (s->left == 0) {
+        if (receive_frame(s, &f) != 0)
+            return -1;
+        if (f.type == STREAM_DATA) {
+            s->left = f.len;
+            continue;
+        }
+        unsigned char digest[MD5_DIGEST_LENGTH];
+        unsigned char expected[MD5_DIGEST_LENGTH];
+        if (f.type != STREAM_DONE || f.len != sizeof(expected) || read_full(s->fd, expected, sizeof(expected)) != 0) {
+            LOGE("Backup stream is corrupt\n");
+            s->error = 1;
+            return -1;
+        }
+        s->in_file = 0;
+        MD5_Final(digest, &s->ctx);
+        if (memcmp(digest, expected, sizeof(digest)) != 0) {
+            LOGE("MD5 mismatch in the backup stream\n");
+            s->error = 1;
+            return -1;
+        }
+        return 0;
+    }
+    if (len > s->left)
+        len = s->left;
+    if (read_full(s->fd, data, len) != 0) {
+        LOGE("Backup stream ended early\n");
+        s->error = 1;
+        return -1;
+    }
+    MD5_Update(&s->ctx, data, len);
+    s->left -= len;
+    return len;
+}
+
+int nandroid_stream_skip_file(struct nandroid_stream* s) {
+    char buf[4096];
+    ssize_t r;
+    while ((r = nandroid_stream_read(s, buf, sizeof(buf))) > 0)
+        ;
+    return r;
+}
+
+int nandroid_stream_receive(const char* address, const char* backup_path) {
+    char name[NAME_MAX + 1];
+    char path[PATH_MAX];
+    char buf[4096];
+    int ret;
+    struct nandroid_stream* s = nandroid_stream_open(address, 0);
+    if (s == NULL)
+        return -1;
+    nandroid_md5_reset();
+    while ((ret = nandroid_stream_next_file(s, name, sizeof(name))) > 0) {
+        if (strchr(name, '/') != NULL || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            LOGE("Bad file name in the backup stream: %s\n", name);
+            ret = -1;
+            break;
+        }
+        ui_print("Receiving %s...\n", name);
+        sprintf(path, "%s/%s", backup_path, name);
+        struct md5_file* f = md5_file_open(path);
+        if (f == NULL) {
+            ret = -1;
+            break;
+        }
+        ssize_t r;
+        while ((r = nandroid_stream_read(s, buf, sizeof(buf))) > 0) {
+            if (md5_file_write(f, buf, r) != 0) {
+                r = -1;
+                break;
+            }
+        }
+        if (md5_file_close(f) != 0 || r != 0) {
+            ret = -1;
+            break;
+        }
+    }
+    if (nandroid_stream_close(s) != 0)
+        ret = -1;
+    if (ret == 0)
+        ret = nandroid_md5_write(backup_path);
+    return ret;
+}
@@ -0,0 +1,54 @@
+#ifndef NANDROID_STREAM_H
+#define NANDROID_STREAM_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Nandroid streams carry a whole backup over a pipe or socket instead of
+// the sdcard. After an 8 byte magic and a 32 bit version, the stream is a
+// sequence of frames, a 32 bit type and a 32 bit payload length followed
+// by the payload, all little endian:
+//
+//   FILE  name of the next backup file (eg. "system.ext4.tar")
+//   DATA  the next part of its contents, up to NANDROID_STREAM_FRAME bytes
+//   DONE  the 16 byte md5 of the file contents, ends the file
+//   END   ends the backup
+//
+// Streams are opened on an address:
+//
+//   -              stdout or stdin; ui output moves to stderr
+//   unix:<path>    connect to a UNIX socket
+//   tcp:<ip>:<port> connect over TCP
+//   listen:<port>  accept one TCP connection on 127.0.0.1, for adb forward
+//   listen:<path>  accept one connection on a UNIX socket at <path>
+
+#define NANDROID_STREAM_MAGIC   "NANDSTRM"
+#define NANDROID_STREAM_VERSION 1
+#define NANDROID_STREAM_FRAME   (256 * 1024)
+
+struct nandroid_stream;
+
+struct nandroid_stream* nandroid_stream_open(const char* address, int writing);
+// Sends END on a stream being written unless something failed. Returns 0
+// if the whole stream went through.
+int nandroid_stream_close(struct nandroid_stream* s);
+
+int nandroid_stream_begin_file(struct nandroid_stream* s, const char* name);
+// Same signature as tar_write_func, cookie is the stream.
+int nandroid_stream_write(void* cookie, const void* data, size_t len);
+int nandroid_stream_end_file(struct nandroid_stream* s);
+
+// Reads the FILE frame of the next file into 'name'. Returns 1 if there is
+// one, 0 at the end of the backup, -1 on error.
+int nandroid_stream_next_file(struct nandroid_stream* s, char* name, size_t size);
+// Same signature as tar_read_func. Returns 0 at the end of the current
+// file, and -1 if its md5 does not match.
+ssize_t nandroid_stream_read(void* cookie, void* data, size_t len);
+// Reads what is left of the current file. Returns 0 if its md5 matches.
+int nandroid_stream_skip_file(struct nandroid_stream* s);
+
+// Writes every file of the stream into 'backup_path' and records their
+// digests in its nandroid.md5, leaving a regular backup behind.
+int nandroid_stream_receive(const char* address, const char* backup_path);
+
+#endif
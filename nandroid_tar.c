@@ -0,0 +1,1744 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include <openssl/md5.h>
+
+#include "common.h"
+#include "nandroid_queue.h"
+#include "nandroid_tar.h"
+
+// In-process replacement for "tar cvf". Three threads cooperate:
+//   walker - traverses the tree in sorted order and lstat()s every entry
+//   reader - turns entries into header blocks and reads file contents
+//   writer - the calling thread, writes blocks to the archive in order
+// The queues between them are bounded, so memory use stays flat no matter
+// how large the tree is, while flash reads and sdcard writes overlap.
+// With an index, the reader also hashes every file and the writer records
+// where each entry starts, so single files can be found again without
+// reading the whole archive.
+
+#define TAR_BLOCK_SIZE      512
+#define TAR_CHUNK_SIZE      (128 * 1024)
+#define TAR_ENTRY_QUEUE     256
+#define TAR_CHUNK_QUEUE     32
+
+#define TAR_LONGLINK        "././@LongLink"
+#define TAR_INDEX_MAGIC     "# nandroid tar index 1"
+
+struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char padding[12];
+};
+
+struct tar_entry {
+    char *name;         // name inside the archive
+    char *path;         // path on the filesystem
+    char *link;         // symlink target, or hardlink source name
+    char type;
+    struct stat st;
+};
+
+struct tar_chunk {
+    size_t len;
+    char *name;         // set on the last chunk of an entry
+    char *index;        // index line of the entry, minus the offset
+    int first;          // first chunk of an entry
+    char data[0];
+};
+
+struct tar_hardlink {
+    dev_t dev;
+    ino_t ino;
+    char *name;
+    struct tar_hardlink *next;
+};
+
+struct tar_writer {
+    const char *exclude;
+    FILE *index;
+    tar_callback callback;
+    void *cookie;
+    struct nandroid_queue entries;
+    struct nandroid_queue chunks;
+    struct tar_hardlink *hardlinks;
+    volatile int error;
+    uint64_t bytes;
+};
+
+static void tar_fail(struct tar_writer *w) {
+    w->error = 1;
+    nandroid_queue_close(&w->entries);
+    nandroid_queue_close(&w->chunks);
+}
+
+static void free_entry(struct tar_entry *e) {
+    free(e->name);
+    free(e->path);
+    free(e->link);
+    free(e);
+}
+
+static void tar_octal(char *field, size_t len, uint64_t value) {
+    snprintf(field, len, "%0*llo", (int)len - 1, (unsigned long long)value);
+}
+
+static void tar_checksum(struct tar_header *h) {
+    unsigned int sum = 0;
+    unsigned char *p = (unsigned char*)h;
+    int i;
+    memset(h->chksum, ' ', sizeof(h->chksum));
+    for (i = 0; i < TAR_BLOCK_SIZE; i++)
+        sum += p[i];
+    snprintf(h->chksum, sizeof(h->chksum), "%06o", sum);
+    h->chksum[7] = ' ';
+}
+
+static void tar_fill_header(struct tar_header *h, const char *name, char type, const struct stat *st, uint64_t size, const char *link) {
+    memset(h, 0, sizeof(*h));
+    strncpy(h->name, name, sizeof(h->name));
+    tar_octal(h->mode, sizeof(h->mode), st->st_mode & 07777);
+    tar_octal(h->uid, sizeof(h->uid), st->st_uid);
+    tar_octal(h->gid, sizeof(h->gid), st->st_gid);
+    tar_octal(h->size, sizeof(h->size), size);
+    tar_octal(h->mtime, sizeof(h->mtime), st->st_mtime);
+    h->typeflag = type;
+    if (link != NULL)
+        strncpy(h->linkname, link, sizeof(h->linkname));
+    // GNU magic, so names longer than 100 chars can use ././@LongLink
+    memcpy(h->magic, "ustar ", 6);
+    memcpy(h->version, " ", 2);
+    if (type == '3' || type == '4') {
+        tar_octal(h->devmajor, sizeof(h->devmajor), major(st->st_rdev));
+        tar_octal(h->devminor, sizeof(h->devminor), minor(st->st_rdev));
+    }
+    tar_checksum(h);
+}
+
+static size_t tar_padded(size_t len) {
+    return (len + TAR_BLOCK_SIZE - 1) & ~(size_t)(TAR_BLOCK_SIZE - 1);
+}
+
+static struct tar_chunk* alloc_chunk(size_t len) {
+    struct tar_chunk *c = (struct tar_chunk*) malloc(sizeof(struct tar_chunk) + len);
+    if (c == NULL)
+        return NULL;
+    c->len = len;
+    c->name = NULL;
+    c->index = NULL;
+    c->first = 0;
+    return c;
+}
+
+// Append a GNU long name/link record for 'value' to the chunk at 'p'.
+static char* tar_put_longlink(char *p, char type, const char *value, const struct stat *st) {
+    size_t len = strlen(value) + 1;
+    tar_fill_header((struct tar_header*)p, TAR_LONGLINK, type, st, len, NULL);
+    memcpy(p + TAR_BLOCK_SIZE, value, len);
+    return p + TAR_BLOCK_SIZE + tar_padded(len);
+}
+
+static struct tar_chunk* make_header_chunk(struct tar_entry *e, uint64_t size) {
+    size_t len = TAR_BLOCK_SIZE;
+    int long_name = strlen(e->name) >= sizeof(((struct tar_header*)0)->name);
+    int long_link = e->link != NULL && strlen(e->link) >= sizeof(((struct tar_header*)0)->linkname);
+    if (long_name)
+        len += TAR_BLOCK_SIZE + tar_padded(strlen(e->name) + 1);
+    if (long_link)
+        len += TAR_BLOCK_SIZE + tar_padded(strlen(e->link) + 1);
+
+    struct tar_chunk *c = alloc_chunk(len);
+    if (c == NULL)
+        return NULL;
+    memset(c->data, 0, len);
+    char *p = c->data;
+    if (long_link)
+        p = tar_put_longlink(p, 'K', e->link, &e->st);
+    if (long_name)
+        p = tar_put_longlink(p, 'L', e->name, &e->st);
+    tar_fill_header((struct tar_header*)p, e->name, e->type, &e->st, size, e->link);
+    return c;
+}
+
+static int push_chunk(struct tar_writer *w, struct tar_chunk *c) {
+    if (nandroid_queue_push(&w->chunks, c) != 0) {
+        free(c->name);
+        free(c->index);
+        free(c);
+        return -1;
+    }
+    return 0;
+}
+
+// "<size> <mode> <uid> <gid> <md5|-> <name>", see tar_index_range.
+static int set_index_line(struct tar_writer *w, struct tar_chunk *c, struct tar_entry *e, uint64_t size, MD5_CTX *md5) {
+    // the index is line based, such names can only be restored in full
+    if (w->index == NULL || strchr(c->name, '\n') != NULL)
+        return 0;
+    char hex[MD5_DIGEST_LENGTH * 2 + 1] = "-";
+    if (md5 != NULL) {
+        unsigned char digest[MD5_DIGEST_LENGTH];
+        int i;
+        MD5_Final(digest, md5);
+        for (i = 0; i < MD5_DIGEST_LENGTH; i++)
+            sprintf(hex + i * 2, "%02x", digest[i]);
+    }
+    c->index = (char*) malloc(strlen(c->name) + 128);
+    if (c->index == NULL)
+        return -1;
+    sprintf(c->index, "%llu %o %u %u %s %s", (unsigned long long)size, (unsigned int)e->st.st_mode,
+            (unsigned int)e->st.st_uid, (unsigned int)e->st.st_gid, hex, c->name);
+    return 0;
+}
+
+static int read_entry(struct tar_writer *w, struct tar_entry *e) {
+    if (e->type != '0' || e->st.st_size == 0) {
+        struct tar_chunk *c = make_header_chunk(e, 0);
+        if (c == NULL)
+            return -1;
+        c->first = 1;
+        c->name = e->name;
+        e->name = NULL;
+        MD5_CTX md5;
+        MD5_Init(&md5);
+        if (set_index_line(w, c, e, 0, e->type == '0' ? &md5 : NULL) != 0) {
+            free(c->name);
+            free(c);
+            return -1;
+        }
+        return push_chunk(w, c);
+    }
+
+    int fd = open(e->path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return 0;
+        LOGE("Unable to open %s: %s\n", e->path, strerror(errno));
+        return -1;
+    }
+
+    uint64_t size = e->st.st_size;
+    struct tar_chunk *c = make_header_chunk(e, size);
+    if (c != NULL)
+        c->first = 1;
+    if (c == NULL || push_chunk(w, c) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    MD5_CTX md5;
+    MD5_Init(&md5);
+
+    uint64_t remaining = size;
+    int truncated = 0;
+    while (remaining > 0) {
+        size_t want = remaining > TAR_CHUNK_SIZE ? TAR_CHUNK_SIZE : (size_t)remaining;
+        c = alloc_chunk(tar_padded(want));
+        if (c == NULL) {
+            close(fd);
+            return -1;
+        }
+        size_t got = 0;
+        while (!truncated && got < want) {
+            ssize_t r = read(fd, c->data + got, want - got);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r < 0) {
+                LOGE("Error reading %s: %s\n", e->path, strerror(errno));
+                free(c);
+                close(fd);
+                return -1;
+            }
+            if (r == 0) {
+                // the file shrank since it was stat'ed, keep the recorded
+                // size and zero fill like tar does.
+                LOGW("%s: file shrank by %llu bytes; padding with zeros\n", e->path, (unsigned long long)(remaining - got));
+                truncated = 1;
+                break;
+            }
+            got += r;
+        }
+        memset(c->data + got, 0, c->len - got);
+        if (w->index != NULL)
+            MD5_Update(&md5, c->data, want);
+        remaining -= want;
+        if (remaining == 0) {
+            c->name = e->name;
+            e->name = NULL;
+            if (set_index_line(w, c, e, size, &md5) != 0) {
+                free(c->name);
+                free(c);
+                close(fd);
+                return -1;
+            }
+        }
+        if (push_chunk(w, c) != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+static void* reader_thread(void *cookie) {
+    struct tar_writer *w = (struct tar_writer*)cookie;
+    struct tar_entry *e;
+    while ((e = (struct tar_entry*) nandroid_queue_pop(&w->entries)) != NULL) {
+        if (!w->error && read_entry(w, e) != 0)
+            tar_fail(w);
+        free_entry(e);
+    }
+    nandroid_queue_close(&w->chunks);
+    return NULL;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(const char**)a, *(const char**)b);
+}
+
+static int walk(struct tar_writer *w, const char *path, const char *name, int top);
+
+static int queue_entry(struct tar_writer *w, const char *path, const char *name, const struct stat *st) {
+    struct tar_entry *e = (struct tar_entry*) calloc(1, sizeof(struct tar_entry));
+    if (e == NULL)
+        return -1;
+    e->st = *st;
+    e->path = strdup(path);
+
+    if (S_ISDIR(st->st_mode)) {
+        e->type = '5';
+        e->name = (char*) malloc(strlen(name) + 2);
+        if (e->name != NULL)
+            sprintf(e->name, "%s/", name);
+    }
+    else {
+        e->name = strdup(name);
+        if (S_ISREG(st->st_mode)) {
+            e->type = '0';
+            if (st->st_nlink > 1) {
+                struct tar_hardlink *l;
+                for (l = w->hardlinks; l != NULL; l = l->next) {
+                    if (l->dev == st->st_dev && l->ino == st->st_ino)
+                        break;
+                }
+                if (l != NULL) {
+                    e->type = '1';
+                    e->link = strdup(l->name);
+                }
+                else if ((l = (struct tar_hardlink*) malloc(sizeof(struct tar_hardlink))) != NULL) {
+                    l->dev = st->st_dev;
+                    l->ino = st->st_ino;
+                    l->name = strdup(name);
+                    l->next = w->hardlinks;
+                    w->hardlinks = l;
+                }
+            }
+        }
+        else if (S_ISLNK(st->st_mode)) {
+            char link[PATH_MAX];
+            int len = readlink(path, link, sizeof(link) - 1);
+            if (len < 0) {
+                LOGE("Unable to read link %s: %s\n", path, strerror(errno));
+                free_entry(e);
+                return -1;
+            }
+            link[len] = '\0';
+            e->type = '2';
+            e->link = strdup(link);
+        }
+        else if (S_ISCHR(st->st_mode))
+            e->type = '3';
+        else if (S_ISBLK(st->st_mode))
+            e->type = '4';
+        else if (S_ISFIFO(st->st_mode))
+            e->type = '6';
+        else {
+            // sockets can't be archived, tar skips them as well
+            free_entry(e);
+            return 0;
+        }
+    }
+
+    if (e->name == NULL || e->path == NULL) {
+        free_entry(e);
+        return -1;
+    }
+    if (nandroid_queue_push(&w->entries, e) != 0) {
+        free_entry(e);
+        return -1;
+    }
+    return 0;
+}
+
+static int walk(struct tar_writer *w, const char *path, const char *name, int top) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        LOGE("Unable to open directory %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    // read the whole directory first, so the archive order is stable
+    char **names = NULL;
+    int count = 0, alloc = 0, i, ret = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        if (top && w->exclude != NULL && strcmp(de->d_name, w->exclude) == 0)
+            continue;
+        if (count == alloc) {
+            alloc = alloc ? alloc * 2 : 32;
+            char **tmp = (char**) realloc(names, alloc * sizeof(char*));
+            if (tmp == NULL) {
+                ret = -1;
+                break;
+            }
+            names = tmp;
+        }
+        if ((names[count] = strdup(de->d_name)) == NULL) {
+            ret = -1;
+            break;
+        }
+        count++;
+    }
+    closedir(dir);
+    if (ret == 0)
+        qsort(names, count, sizeof(char*), compare_names);
+
+    char child_path[PATH_MAX];
+    char child_name[PATH_MAX];
+    for (i = 0; i < count && ret == 0 && !w->error; i++) {
+        struct stat st;
+        snprintf(child_path, sizeof(child_path), "%s/%s", path, names[i]);
+        snprintf(child_name, sizeof(child_name), "%s/%s", name, names[i]);
+        if (lstat(child_path, &st) != 0) {
+            if (errno == ENOENT)
+                continue;
+            LOGE("Unable to stat %s: %s\n", child_path, strerror(errno));
+            ret = -1;
+            break;
+        }
+        if ((ret = queue_entry(w, child_path, child_name, &st)) != 0)
+            break;
+        if (S_ISDIR(st.st_mode))
+            ret = walk(w, child_path, child_name, 0);
+    }
+
+    for (i = 0; i < count; i++)
+        free(names[i]);
+    free(names);
+    return ret;
+}
+
+struct walk_args {
+    struct tar_writer *w;
+    const char *path;
+    const char *name;
+};
+
+static void* walker_thread(void *cookie) {
+    struct walk_args *args = (struct walk_args*)cookie;
+    struct tar_writer *w = args->w;
+    struct stat st;
+    if (lstat(args->path, &st) != 0) {
+        LOGE("Unable to stat %s: %s\n", args->path, strerror(errno));
+        tar_fail(w);
+    }
+    else if (queue_entry(w, args->path, args->name, &st) != 0 ||
+            (S_ISDIR(st.st_mode) && walk(w, args->path, args->name, 1) != 0)) {
+        tar_fail(w);
+    }
+    nandroid_queue_close(&w->entries);
+    return NULL;
+}
+
+static int write_fully(void *cookie, const void *data, size_t len) {
+    int fd = *(int*)cookie;
+    const char *p = (const char*)data;
+    while (len > 0) {
+        ssize_t r = write(fd, p, len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+int tar_create(const char* archive, const char* path, const char* exclude, tar_callback callback, void* cookie) {
+    int fd = open(archive, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        LOGE("Unable to create %s: %s\n", archive, strerror(errno));
+        return -1;
+    }
+    int ret = tar_create_stream(write_fully, &fd, path, exclude, NULL, callback, cookie);
+    if (ret != 0)
+        LOGE("Error writing %s\n", archive);
+    if (close(fd) != 0)
+        ret = -1;
+    return ret;
+}
+
+int tar_create_stream(tar_write_func write_func, void* out, const char* path, const char* exclude, const char* index, tar_callback callback, void* cookie) {
+    char path_copy[PATH_MAX];
+    strncpy(path_copy, path, sizeof(path_copy) - 1);
+    path_copy[sizeof(path_copy) - 1] = '\0';
+    // strip trailing slashes so basename-style naming works for "/data/"
+    size_t plen = strlen(path_copy);
+    while (plen > 1 && path_copy[plen - 1] == '/')
+        path_copy[--plen] = '\0';
+    const char *name = strrchr(path_copy, '/');
+    name = name == NULL ? path_copy : name + 1;
+
+    struct tar_writer w;
+    memset(&w, 0, sizeof(w));
+    w.exclude = exclude;
+    w.callback = callback;
+    w.cookie = cookie;
+    if (index != NULL) {
+        if ((w.index = fopen(index, "w")) == NULL) {
+            LOGE("Unable to create %s: %s\n", index, strerror(errno));
+            return -1;
+        }
+        fprintf(w.index, "%s\n", TAR_INDEX_MAGIC);
+    }
+    if (nandroid_queue_init(&w.entries, TAR_ENTRY_QUEUE) != 0) {
+        if (w.index != NULL)
+            fclose(w.index);
+        return -1;
+    }
+    if (nandroid_queue_init(&w.chunks, TAR_CHUNK_QUEUE) != 0) {
+        nandroid_queue_destroy(&w.entries);
+        if (w.index != NULL)
+            fclose(w.index);
+        return -1;
+    }
+
+    struct walk_args args;
+    args.w = &w;
+    args.path = path_copy;
+    args.name = name;
+    pthread_t walker, reader;
+    int have_walker = pthread_create(&walker, NULL, walker_thread, &args) == 0;
+    int have_reader = have_walker && pthread_create(&reader, NULL, reader_thread, &w) == 0;
+    if (!have_reader) {
+        // closing the queues lets a walker that did start run out
+        LOGE("Unable to start the archive threads\n");
+        tar_fail(&w);
+    }
+
+    struct tar_chunk *c;
+    uint64_t offset = 0;
+    while ((c = (struct tar_chunk*) nandroid_queue_pop(&w.chunks)) != NULL) {
+        if (c->first)
+            offset = w.bytes;
+        if (!w.error) {
+            if (write_func(out, c->data, c->len) != 0) {
+                tar_fail(&w);
+            }
+            else {
+                w.bytes += c->len;
+                if (c->index != NULL)
+                    fprintf(w.index, "%llu %s\n", (unsigned long long)offset, c->index);
+                if (c->name != NULL && callback != NULL)
+                    callback(c->name, w.bytes, cookie);
+            }
+        }
+        free(c->name);
+        free(c->index);
+        free(c);
+    }
+
+    if (have_walker)
+        pthread_join(walker, NULL);
+    if (have_reader)
+        pthread_join(reader, NULL);
+    // entries nobody read, if the reader never started
+    struct tar_entry *e;
+    while ((e = (struct tar_entry*) nandroid_queue_pop(&w.entries)) != NULL)
+        free_entry(e);
+
+    // end of archive: two zero blocks
+    if (!w.error) {
+        char eof[TAR_BLOCK_SIZE * 2];
+        memset(eof, 0, sizeof(eof));
+        if (write_func(out, eof, sizeof(eof)) != 0)
+            w.error = 1;
+    }
+
+    while (w.hardlinks != NULL) {
+        struct tar_hardlink *next = w.hardlinks->next;
+        free(w.hardlinks->name);
+        free(w.hardlinks);
+        w.hardlinks = next;
+    }
+    nandroid_queue_destroy(&w.entries);
+    nandroid_queue_destroy(&w.chunks);
+    if (w.index != NULL && (fclose(w.index) != 0 || w.error))
+        unlink(index);
+    return w.error ? -1 : 0;
+}
+
+// In-process replacement for "tar xf". The calling thread reads and parses
+// the archive, creates directories, links and device nodes itself and hands
+// regular files to a pool of writers. Small files travel as one chunk, large
+// ones get a queue of their own that the reader fills as it goes. Files get
+// their owner, mode and times through the open descriptor; directories are
+// finished last, deepest first, once nothing is written into them anymore.
+
+#define TAR_EXTRACT_THREADS 4
+#define TAR_JOB_QUEUE       64
+#define TAR_FILE_QUEUE      8
+#define TAR_FALLOCATE_MIN   (1024 * 1024)
+
+struct tar_meta {
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+};
+
+struct tar_file_job {
+    char *path;
+    struct tar_meta meta;
+    uint64_t size;
+    struct tar_chunk *data;         // whole content of a small file
+    struct nandroid_queue chunks;   // content of a large file, as it arrives
+    int streamed;
+    int update;                     // only rewrite the parts that differ
+    int refs;                       // the reader holds one while streaming
+};
+
+struct tar_deferred {
+    char *path;
+    char *link;                     // hardlink target
+    struct tar_meta meta;
+};
+
+// Paths seen in the archive, for the differential restore to find extras,
+// and the md5 of every file in the archive index, by entry name.
+struct tar_name {
+    char *path;
+    char *digest;
+    struct tar_name *next;
+};
+
+struct tar_name_set {
+    struct tar_name **buckets;
+    unsigned int size;
+    unsigned int count;
+};
+
+struct tar_extractor {
+    tar_read_func read_func;
+    void *in;
+    tar_scan_func scan;             // only list the archive, see tar_scan_stream
+    void *scan_cookie;
+    int differential;
+    struct tar_name_set names;
+    struct tar_name_set digests;
+    uint64_t bytes;
+    struct nandroid_queue jobs;
+    pthread_mutex_t lock;
+    volatile int error;
+    struct tar_deferred *dirs;
+    int dir_count;
+    int dir_alloc;
+    struct tar_deferred *links;
+    int link_count;
+    int link_alloc;
+};
+
+static int tar_read(struct tar_extractor *x, void *data, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t r = x->read_func(x->in, (char*)data + got, len - got);
+        if (r <= 0)
+            break;
+        got += r;
+    }
+    x->bytes += got;
+    return got;
+}
+
+static int tar_skip(struct tar_extractor *x, uint64_t len) {
+    char buf[TAR_BLOCK_SIZE * 8];
+    while (len > 0) {
+        size_t n = len > sizeof(buf) ? sizeof(buf) : (size_t)len;
+        if (tar_read(x, buf, n) != (int)n)
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+// Octal, or GNU base-256 for values that do not fit.
+static uint64_t tar_number(const char *field, size_t len) {
+    uint64_t value = 0;
+    size_t i = 0;
+    if ((unsigned char)field[0] & 0x80) {
+        value = (unsigned char)field[0] & 0x7f;
+        for (i = 1; i < len; i++)
+            value = (value << 8) | (unsigned char)field[i];
+        return value;
+    }
+    while (i < len && field[i] == ' ')
+        i++;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+        value = value * 8 + (field[i] - '0');
+    return value;
+}
+
+static int tar_header_valid(const struct tar_header *h) {
+    const unsigned char *p = (const unsigned char*)h;
+    unsigned int sum = 0;
+    int i;
+    for (i = 0; i < TAR_BLOCK_SIZE; i++) {
+        if (p + i >= (const unsigned char*)h->chksum && p + i < (const unsigned char*)h->chksum + sizeof(h->chksum))
+            sum += ' ';
+        else
+            sum += p[i];
+    }
+    return sum == tar_number(h->chksum, sizeof(h->chksum));
+}
+
+static int tar_block_is_zero(const char *block) {
+    int i;
+    for (i = 0; i < TAR_BLOCK_SIZE; i++) {
+        if (block[i] != 0)
+            return 0;
+    }
+    return 1;
+}
+
+static char* tar_field(const char *field, size_t len) {
+    char *value = (char*) malloc(len + 1);
+    if (value != NULL) {
+        memcpy(value, field, len);
+        value[len] = '\0';
+    }
+    return value;
+}
+
+// Joins dir and an archive name. Leading slashes are dropped and names
+// that climb out of dir are refused.
+static char* tar_join(const char *dir, const char *name) {
+    const char *p;
+    while (*name == '/')
+        name++;
+    for (p = name; (p = strstr(p, "..")) != NULL; p += 2) {
+        if ((p == name || p[-1] == '/') && (p[2] == '\0' || p[2] == '/'))
+            return NULL;
+    }
+    char *path = (char*) malloc(strlen(dir) + strlen(name) + 2);
+    if (path == NULL)
+        return NULL;
+    // dir is "/" for mount points like /data, and the names have to match
+    // the ones tar_prune builds
+    size_t dir_len = strlen(dir);
+    sprintf(path, "%s%s%s", dir, dir_len > 0 && dir[dir_len - 1] == '/' ? "" : "/", name);
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/')
+        path[--len] = '\0';
+    return path;
+}
+
+static void tar_make_parents(const char *path) {
+    char tmp[PATH_MAX];
+    char *p;
+    strncpy(tmp, path, sizeof(tmp) - 1);
+    tmp[sizeof(tmp) - 1] = '\0';
+    for (p = tmp + 1; (p = strchr(p, '/')) != NULL; p++) {
+        *p = '\0';
+        mkdir(tmp, 0755);
+        *p = '/';
+    }
+}
+
+static void tar_fallocate(int fd, uint64_t size) {
+#ifdef __NR_fallocate
+    // best effort: rfs and older kernels do not support it
+    if (sizeof(long) == 4)
+        syscall(__NR_fallocate, fd, 0, 0, 0, (long)(size & 0xffffffff), (long)(size >> 32));
+    else
+        syscall(__NR_fallocate, fd, 0, 0L, (long)size);
+#endif
+}
+
+static void tar_set_times(int fd, const char *path, time_t mtime) {
+#ifdef __NR_utimensat
+    // futimens() by another name, bionic does not have it
+    struct timespec ts[2];
+    ts[0].tv_sec = ts[1].tv_sec = mtime;
+    ts[0].tv_nsec = ts[1].tv_nsec = 0;
+    if (fd >= 0 && syscall(__NR_utimensat, fd, NULL, ts, 0) == 0)
+        return;
+#endif
+    struct timeval tv[2];
+    tv[0].tv_sec = tv[1].tv_sec = mtime;
+    tv[0].tv_usec = tv[1].tv_usec = 0;
+    utimes(path, tv);
+}
+
+static int tar_write_fd(int fd, const char *path, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, data, len);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0) {
+            LOGE("Error writing %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        data += w;
+        len -= w;
+    }
+    return 0;
+}
+
+static unsigned int tar_hash(const char *path) {
+    unsigned int hash = 5381;
+    while (*path)
+        hash = hash * 33 + (unsigned char)*path++;
+    return hash;
+}
+
+static struct tar_name* tar_name_add(struct tar_name_set *set, const char *path) {
+    unsigned int i;
+    if (set->count >= set->size) {
+        unsigned int size = set->size ? set->size * 2 : 4096;
+        struct tar_name **buckets = (struct tar_name**) calloc(size, sizeof(struct tar_name*));
+        if (buckets == NULL)
+            return NULL;
+        for (i = 0; i < set->size; i++) {
+            struct tar_name *n = set->buckets[i];
+            while (n != NULL) {
+                struct tar_name *next = n->next;
+                unsigned int b = tar_hash(n->path) & (size - 1);
+                n->next = buckets[b];
+                buckets[b] = n;
+                n = next;
+            }
+        }
+        free(set->buckets);
+        set->buckets = buckets;
+        set->size = size;
+    }
+    struct tar_name *n = (struct tar_name*) malloc(sizeof(struct tar_name));
+    if (n == NULL || (n->path = strdup(path)) == NULL) {
+        free(n);
+        return NULL;
+    }
+    n->digest = NULL;
+    unsigned int b = tar_hash(path) & (set->size - 1);
+    n->next = set->buckets[b];
+    set->buckets[b] = n;
+    set->count++;
+    return n;
+}
+
+static struct tar_name* tar_name_find(struct tar_name_set *set, const char *path) {
+    struct tar_name *n;
+    if (set->size == 0)
+        return NULL;
+    for (n = set->buckets[tar_hash(path) & (set->size - 1)]; n != NULL; n = n->next) {
+        if (strcmp(n->path, path) == 0)
+            return n;
+    }
+    return NULL;
+}
+
+static int tar_name_contains(struct tar_name_set *set, const char *path) {
+    return tar_name_find(set, path) != NULL;
+}
+
+static void tar_name_free(struct tar_name_set *set) {
+    unsigned int i;
+    for (i = 0; i < set->size; i++) {
+        while (set->buckets[i] != NULL) {
+            struct tar_name *next = set->buckets[i]->next;
+            free(set->buckets[i]->path);
+            free(set->buckets[i]->digest);
+            free(set->buckets[i]);
+            set->buckets[i] = next;
+        }
+    }
+    free(set->buckets);
+}
+
+// rm -rf
+static int tar_remove(const char *path) {
+    struct stat st;
+    if (lstat(path, &st) != 0)
+        return errno == ENOENT ? 0 : -1;
+    if (!S_ISDIR(st.st_mode))
+        return unlink(path);
+    DIR *dir = opendir(path);
+    if (dir != NULL) {
+        char child[PATH_MAX];
+        struct dirent *de;
+        while ((de = readdir(dir)) != NULL) {
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+                continue;
+            snprintf(child, sizeof(child), "%s/%s", path, de->d_name);
+            tar_remove(child);
+        }
+        closedir(dir);
+    }
+    return rmdir(path);
+}
+
+// Writes 'data' at 'offset' unless the file already holds exactly that.
+static int tar_update_fd(int fd, const char *path, const char *data, size_t len, off64_t offset, char *scratch) {
+    ssize_t got = pread64(fd, scratch, len, offset);
+    if (got == (ssize_t)len && memcmp(scratch, data, len) == 0)
+        return 0;
+    if (lseek64(fd, offset, SEEK_SET) != offset)
+        return -1;
+    return tar_write_fd(fd, path, data, len);
+}
+
+static int write_file_job(struct tar_extractor *x, struct tar_file_job *job) {
+    int flags = job->update ? O_RDWR | O_CREAT : O_WRONLY | O_CREAT | O_TRUNC;
+    int fd = open(job->path, flags, 0600);
+    if (fd < 0 && errno == ENOENT) {
+        tar_make_parents(job->path);
+        fd = open(job->path, flags, 0600);
+    }
+    if (fd < 0) {
+        LOGE("Unable to create %s: %s\n", job->path, strerror(errno));
+        return -1;
+    }
+    char *scratch = NULL;
+    if (job->update && (scratch = (char*) malloc(TAR_CHUNK_SIZE)) == NULL) {
+        close(fd);
+        return -1;
+    }
+    if (!job->update && job->size >= TAR_FALLOCATE_MIN)
+        tar_fallocate(fd, job->size);
+
+    int ret = 0;
+    if (job->data != NULL) {
+        if (job->update)
+            ret = tar_update_fd(fd, job->path, job->data->data, job->data->len, 0, scratch);
+        else
+            ret = tar_write_fd(fd, job->path, job->data->data, job->data->len);
+    }
+    else if (job->streamed) {
+        struct tar_chunk *c;
+        uint64_t written = 0;
+        while ((c = (struct tar_chunk*) nandroid_queue_pop(&job->chunks)) != NULL) {
+            if (ret == 0 && !x->error) {
+                if (job->update)
+                    ret = tar_update_fd(fd, job->path, c->data, c->len, written, scratch);
+                else
+                    ret = tar_write_fd(fd, job->path, c->data, c->len);
+            }
+            if (ret != 0)
+                nandroid_queue_close(&job->chunks);
+            written += c->len;
+            free(c);
+        }
+        if (written != job->size)
+            ret = -1;
+    }
+    free(scratch);
+    if (ret == 0 && job->update && ftruncate64(fd, job->size) != 0)
+        ret = -1;
+
+    // chown first, it clears the setuid bits
+    if (ret == 0) {
+        fchown(fd, job->meta.uid, job->meta.gid);
+        fchmod(fd, job->meta.mode & 07777);
+        tar_set_times(fd, job->path, job->meta.mtime);
+    }
+    if (close(fd) != 0 && ret == 0) {
+        LOGE("Error writing %s: %s\n", job->path, strerror(errno));
+        ret = -1;
+    }
+    return ret;
+}
+
+static void free_file_job(struct tar_file_job *job) {
+    if (job->streamed)
+        nandroid_queue_destroy(&job->chunks);
+    free(job->data);
+    free(job->path);
+    free(job);
+}
+
+static void release_file_job(struct tar_extractor *x, struct tar_file_job *job) {
+    pthread_mutex_lock(&x->lock);
+    int refs = --job->refs;
+    pthread_mutex_unlock(&x->lock);
+    if (refs == 0)
+        free_file_job(job);
+}
+
+static void tar_extract_fail(struct tar_extractor *x) {
+    x->error = 1;
+    nandroid_queue_close(&x->jobs);
+}
+
+static void* extract_thread(void *cookie) {
+    struct tar_extractor *x = (struct tar_extractor*)cookie;
+    struct tar_file_job *job;
+    while ((job = (struct tar_file_job*) nandroid_queue_pop(&x->jobs)) != NULL) {
+        if (!x->error && write_file_job(x, job) != 0)
+            tar_extract_fail(x);
+        if (job->streamed) {
+            // let the reader know nobody is taking data anymore
+            struct tar_chunk *c;
+            nandroid_queue_close(&job->chunks);
+            while ((c = (struct tar_chunk*) nandroid_queue_pop(&job->chunks)) != NULL)
+                free(c);
+        }
+        release_file_job(x, job);
+    }
+    return NULL;
+}
+
+static int tar_defer(struct tar_deferred **list, int *count, int *alloc, char *path, char *link, const struct tar_meta *meta) {
+    if (*count == *alloc) {
+        int n = *alloc ? *alloc * 2 : 64;
+        struct tar_deferred *tmp = (struct tar_deferred*) realloc(*list, n * sizeof(struct tar_deferred));
+        if (tmp == NULL)
+            return -1;
+        *list = tmp;
+        *alloc = n;
+    }
+    (*list)[*count].path = path;
+    (*list)[*count].link = link;
+    (*list)[*count].meta = *meta;
+    (*count)++;
+    return 0;
+}
+
+static int tar_md5_file(const char *path, char *hex);
+
+static int extract_file(struct tar_extractor *x, char *path, const struct tar_meta *meta, uint64_t size, const char *name) {
+    int update = 0;
+    if (x->differential) {
+        // Files with other links are replaced instead of being written
+        // through, the links are redone at the end. A file with the size and
+        // mtime of the archive entry is left alone if its md5 matches the
+        // index, without touching the archive data. Anything else is
+        // compared with the archive chunk by chunk and only what differs is
+        // written.
+        struct stat st;
+        if (lstat(path, &st) == 0) {
+            if (S_ISREG(st.st_mode) && st.st_nlink == 1) {
+                struct tar_name *indexed = tar_name_find(&x->digests, name);
+                char hex[MD5_DIGEST_LENGTH * 2 + 1];
+                if (indexed != NULL && (uint64_t)st.st_size == size && st.st_mtime == meta->mtime &&
+                        tar_md5_file(path, hex) == 0 && strcmp(hex, indexed->digest) == 0) {
+                    // unchanged, at most the owner or mode differ
+                    if (st.st_uid != meta->uid || st.st_gid != meta->gid)
+                        chown(path, meta->uid, meta->gid);
+                    if ((st.st_mode & 07777) != (meta->mode & 07777))
+                        chmod(path, meta->mode & 07777);
+                    free(path);
+                    return tar_skip(x, tar_padded(size));
+                }
+                update = 1;
+            }
+            else
+                tar_remove(path);
+        }
+    }
+
+    struct tar_file_job *job = (struct tar_file_job*) calloc(1, sizeof(struct tar_file_job));
+    if (job == NULL) {
+        free(path);
+        return -1;
+    }
+    job->path = path;
+    job->meta = *meta;
+    job->size = size;
+    job->update = update;
+    job->refs = 1;
+
+    if (size <= TAR_CHUNK_SIZE) {
+        if (size > 0) {
+            job->data = alloc_chunk(tar_padded(size));
+            if (job->data == NULL || tar_read(x, job->data->data, job->data->len) != (int)job->data->len) {
+                free_file_job(job);
+                return -1;
+            }
+            job->data->len = size;
+        }
+        if (nandroid_queue_push(&x->jobs, job) != 0) {
+            free_file_job(job);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (nandroid_queue_init(&job->chunks, TAR_FILE_QUEUE) != 0) {
+        free_file_job(job);
+        return -1;
+    }
+    job->streamed = 1;
+    job->refs = 2;
+    if (nandroid_queue_push(&x->jobs, job) != 0) {
+        free_file_job(job);
+        return -1;
+    }
+
+    int ret = 0;
+    uint64_t remaining = size;
+    while (remaining > 0) {
+        size_t want = remaining > TAR_CHUNK_SIZE ? TAR_CHUNK_SIZE : (size_t)remaining;
+        struct tar_chunk *c = alloc_chunk(tar_padded(want));
+        if (c == NULL || tar_read(x, c->data, c->len) != (int)c->len) {
+            free(c);
+            ret = -1;
+            break;
+        }
+        c->len = want;
+        remaining -= want;
+        if (nandroid_queue_push(&job->chunks, c) != 0) {
+            // the writer gave up, the error is already set
+            free(c);
+            ret = -1;
+            break;
+        }
+    }
+    nandroid_queue_close(&job->chunks);
+    release_file_job(x, job);
+    return ret;
+}
+
+// Differential restore: decides whether what is on the device already
+// matches a directory, symlink or device entry, and clears the way if it
+// does not. Regular files are handled by extract_file, hardlinks when
+// they are linked.
+static int tar_keep_existing(const struct tar_header *h, const char *path, const struct tar_meta *meta, const char *link) {
+    struct stat st;
+    if (lstat(path, &st) != 0)
+        return 0;
+    int same = 0;
+    switch (h->typeflag) {
+        case '5':
+            same = S_ISDIR(st.st_mode);
+            break;
+        case '2': {
+            char target[PATH_MAX];
+            int len;
+            if (S_ISLNK(st.st_mode) && (len = readlink(path, target, sizeof(target) - 1)) >= 0) {
+                target[len] = '\0';
+                same = strcmp(target, link) == 0;
+            }
+            if (same && (st.st_uid != meta->uid || st.st_gid != meta->gid))
+                lchown(path, meta->uid, meta->gid);
+            break;
+        }
+        case '3':
+        case '4':
+        case '6': {
+            mode_t type = h->typeflag == '3' ? S_IFCHR : h->typeflag == '4' ? S_IFBLK : S_IFIFO;
+            dev_t dev = makedev(tar_number(h->devmajor, sizeof(h->devmajor)), tar_number(h->devminor, sizeof(h->devminor)));
+            same = (st.st_mode & S_IFMT) == type && (type == S_IFIFO || st.st_rdev == dev) &&
+                    st.st_uid == meta->uid && st.st_gid == meta->gid && (st.st_mode & 07777) == (meta->mode & 07777);
+            break;
+        }
+        case '1':
+            return 0;
+        default:
+            // regular files keep whatever is there for extract_file to compare
+            if (S_ISREG(st.st_mode))
+                return 0;
+            break;
+    }
+    if (!same)
+        tar_remove(path);
+    // directories still need their metadata applied at the end
+    return same && h->typeflag != '5';
+}
+
+static int extract_entry(struct tar_extractor *x, const char *dir, const struct tar_header *h, const char *name, const char *link, uint64_t size) {
+    struct tar_meta meta;
+    meta.mode = tar_number(h->mode, sizeof(h->mode));
+    meta.uid = tar_number(h->uid, sizeof(h->uid));
+    meta.gid = tar_number(h->gid, sizeof(h->gid));
+    meta.mtime = tar_number(h->mtime, sizeof(h->mtime));
+
+    char *path = tar_join(dir, name);
+    if (path == NULL) {
+        LOGE("Refusing to extract %s\n", name);
+        return -1;
+    }
+
+    if (x->differential) {
+        if (tar_name_add(&x->names, path) == NULL) {
+            free(path);
+            return -1;
+        }
+        if (tar_keep_existing(h, path, &meta, link)) {
+            free(path);
+            return size > 0 ? tar_skip(x, tar_padded(size)) : 0;
+        }
+    }
+
+    switch (h->typeflag) {
+        case '5':
+            if (mkdir(path, 0700) != 0 && errno != EEXIST) {
+                tar_make_parents(path);
+                if (mkdir(path, 0700) != 0 && errno != EEXIST) {
+                    LOGE("Unable to create directory %s: %s\n", path, strerror(errno));
+                    free(path);
+                    return -1;
+                }
+            }
+            if (tar_defer(&x->dirs, &x->dir_count, &x->dir_alloc, path, NULL, &meta) != 0) {
+                free(path);
+                return -1;
+            }
+            return size > 0 ? tar_skip(x, tar_padded(size)) : 0;
+
+        case '1': {
+            // the target may still be on its way through a writer
+            char *target = tar_join(dir, link);
+            if (target == NULL || tar_defer(&x->links, &x->link_count, &x->link_alloc, path, target, &meta) != 0) {
+                LOGE("Refusing to link %s to %s\n", name, link);
+                free(target);
+                free(path);
+                return -1;
+            }
+            return 0;
+        }
+
+        case '2':
+            unlink(path);
+            if (symlink(link, path) != 0) {
+                tar_make_parents(path);
+                if (symlink(link, path) != 0) {
+                    LOGE("Unable to create symlink %s: %s\n", path, strerror(errno));
+                    free(path);
+                    return -1;
+                }
+            }
+            lchown(path, meta.uid, meta.gid);
+            free(path);
+            return 0;
+
+        case '3':
+        case '4':
+        case '6': {
+            mode_t type = h->typeflag == '3' ? S_IFCHR : h->typeflag == '4' ? S_IFBLK : S_IFIFO;
+            dev_t dev = makedev(tar_number(h->devmajor, sizeof(h->devmajor)), tar_number(h->devminor, sizeof(h->devminor)));
+            unlink(path);
+            if (mknod(path, type | (meta.mode & 07777), dev) != 0) {
+                LOGE("Unable to create %s: %s\n", path, strerror(errno));
+                free(path);
+                return -1;
+            }
+            chown(path, meta.uid, meta.gid);
+            chmod(path, meta.mode & 07777);
+            tar_set_times(-1, path, meta.mtime);
+            free(path);
+            return 0;
+        }
+
+        default:
+            // '0', '7' and anything unknown is extracted as a regular file
+            return extract_file(x, path, &meta, size, name);
+    }
+}
+
+// Records are "<length> <key>=<value>\n".
+// Hands the entry to the scan callback instead of the filesystem. Regular
+// files are hashed on the way through.
+static int scan_entry(struct tar_extractor *x, const struct tar_header *h, const char *name, const char *link, uint64_t size) {
+    unsigned int mode = tar_number(h->mode, sizeof(h->mode)) & 07777;
+    char hex[MD5_DIGEST_LENGTH * 2 + 1] = "-";
+    const char *digest = hex;
+    switch (h->typeflag) {
+        case '5': mode |= S_IFDIR; break;
+        case '2': mode |= S_IFLNK; digest = link; break;
+        case '1': mode |= S_IFREG; digest = link; break;
+        case '3': mode |= S_IFCHR; break;
+        case '4': mode |= S_IFBLK; break;
+        case '6': mode |= S_IFIFO; break;
+        default: {
+            char buf[TAR_BLOCK_SIZE * 16];
+            unsigned char md[MD5_DIGEST_LENGTH];
+            uint64_t remaining = size;
+            MD5_CTX md5;
+            int i;
+            MD5_Init(&md5);
+            while (remaining > 0) {
+                size_t n = remaining > sizeof(buf) ? sizeof(buf) : (size_t)remaining;
+                if (tar_read(x, buf, tar_padded(n)) != (int)tar_padded(n))
+                    return -1;
+                MD5_Update(&md5, buf, n);
+                remaining -= n;
+            }
+            MD5_Final(md, &md5);
+            for (i = 0; i < MD5_DIGEST_LENGTH; i++)
+                sprintf(hex + i * 2, "%02x", md[i]);
+            x->scan(name, mode | S_IFREG, size, hex, x->scan_cookie);
+            return 0;
+        }
+    }
+    x->scan(name, mode, 0, digest, x->scan_cookie);
+    return size > 0 ? tar_skip(x, tar_padded(size)) : 0;
+}
+
+static void tar_parse_pax(char *pax, uint64_t size, char **long_name, char **long_link) {
+    char *p = pax;
+    while (p < pax + size) {
+        char *end;
+        unsigned long len = strtoul(p, &end, 10);
+        if (len == 0 || *end != ' ' || p + len > pax + size || p[len - 1] != '\n')
+            break;
+        char *key = end + 1;
+        char *value = strchr(key, '=');
+        if (value == NULL || value > p + len)
+            break;
+        p[len - 1] = '\0';
+        *value++ = '\0';
+        char **field = strcmp(key, "path") == 0 ? long_name : strcmp(key, "linkpath") == 0 ? long_link : NULL;
+        if (field != NULL) {
+            free(*field);
+            *field = strdup(value);
+        }
+        p += len;
+    }
+}
+
+static int extract_archive(struct tar_extractor *x, const char *dir, tar_callback callback, void *cookie) {
+    char block[TAR_BLOCK_SIZE];
+    struct tar_header *h = (struct tar_header*)block;
+    char *long_name = NULL;
+    char *long_link = NULL;
+    int ret = 0;
+
+    while (ret == 0 && !x->error) {
+        int got = tar_read(x, block, TAR_BLOCK_SIZE);
+        if (got == 0)
+            break;
+        if (got != TAR_BLOCK_SIZE) {
+            LOGE("Archive is truncated\n");
+            ret = -1;
+            break;
+        }
+        if (tar_block_is_zero(block)) {
+            // read the padding after it too, so a gzip end marker or the
+            // end of a stream is seen by the source
+            while (tar_read(x, block, TAR_BLOCK_SIZE) > 0)
+                ;
+            break;
+        }
+        if (!tar_header_valid(h)) {
+            LOGE("Archive is corrupt\n");
+            ret = -1;
+            break;
+        }
+
+        uint64_t size = tar_number(h->size, sizeof(h->size));
+        if (h->typeflag == 'L' || h->typeflag == 'K') {
+            char **value = h->typeflag == 'L' ? &long_name : &long_link;
+            free(*value);
+            *value = NULL;
+            if (size >= PATH_MAX || (*value = (char*) malloc(tar_padded(size) + 1)) == NULL ||
+                    tar_read(x, *value, tar_padded(size)) != (int)tar_padded(size)) {
+                ret = -1;
+                break;
+            }
+            (*value)[size] = '\0';
+            continue;
+        }
+        if (h->typeflag == 'x') {
+            // pax header, only long names matter for a restore
+            char *pax = NULL;
+            if (size >= 64 * 1024 || (pax = (char*) malloc(tar_padded(size) + 1)) == NULL ||
+                    tar_read(x, pax, tar_padded(size)) != (int)tar_padded(size)) {
+                free(pax);
+                ret = -1;
+                break;
+            }
+            pax[size] = '\0';
+            tar_parse_pax(pax, size, &long_name, &long_link);
+            free(pax);
+            continue;
+        }
+        if (h->typeflag == 'g') {
+            ret = tar_skip(x, tar_padded(size));
+            continue;
+        }
+
+        char *name = long_name;
+        if (name == NULL) {
+            name = tar_field(h->name, sizeof(h->name));
+            // POSIX ustar archives keep the leading part of long names
+            if (name != NULL && memcmp(h->magic, "ustar", 6) == 0 && h->prefix[0] != '\0') {
+                char *prefix = tar_field(h->prefix, sizeof(h->prefix));
+                char *full = prefix == NULL ? NULL : (char*) malloc(strlen(prefix) + strlen(name) + 2);
+                if (full != NULL)
+                    sprintf(full, "%s/%s", prefix, name);
+                free(prefix);
+                free(name);
+                name = full;
+            }
+        }
+        char *link = long_link != NULL ? long_link : tar_field(h->linkname, sizeof(h->linkname));
+        long_name = NULL;
+        long_link = NULL;
+        if (name == NULL || link == NULL)
+            ret = -1;
+        else if (x->scan != NULL)
+            ret = scan_entry(x, h, name, link, size);
+        else if ((ret = extract_entry(x, dir, h, name, link, size)) == 0 && callback != NULL)
+            callback(name, x->bytes, cookie);
+        free(name);
+        free(link);
+    }
+
+    free(long_name);
+    free(long_link);
+    return ret;
+}
+
+static int tar_same_inode(const char *a, const char *b) {
+    struct stat sa, sb;
+    return lstat(a, &sa) == 0 && lstat(b, &sb) == 0 && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+// Removes everything below 'path' the archive did not have.
+static void tar_prune(struct tar_extractor *x, const char *path, const char *exclude, int top) {
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+        return;
+    char child[PATH_MAX];
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        if (top && ((exclude != NULL && strcmp(de->d_name, exclude) == 0) || strcmp(de->d_name, "lost+found") == 0))
+            continue;
+        snprintf(child, sizeof(child), "%s%s%s", path, path[strlen(path) - 1] == '/' ? "" : "/", de->d_name);
+        if (!tar_name_contains(&x->names, child)) {
+            LOGI("Removing %s\n", child);
+            tar_remove(child);
+        }
+        else {
+            struct stat st;
+            if (lstat(child, &st) == 0 && S_ISDIR(st.st_mode))
+                tar_prune(x, child, NULL, 0);
+        }
+    }
+    closedir(dir);
+}
+
+static int tar_extract_common(struct tar_extractor *x, const char *dir, const char *prune, const char *exclude, tar_callback callback, void *cookie) {
+    pthread_t writers[TAR_EXTRACT_THREADS];
+    int i, started = 0;
+    if (nandroid_queue_init(&x->jobs, TAR_JOB_QUEUE) != 0)
+        return -1;
+    pthread_mutex_init(&x->lock, NULL);
+    for (i = 0; i < TAR_EXTRACT_THREADS; i++) {
+        if (pthread_create(&writers[started], NULL, extract_thread, x) == 0)
+            started++;
+    }
+
+    int ret = started > 0 ? extract_archive(x, dir, callback, cookie) : -1;
+    if (ret != 0)
+        tar_extract_fail(x);
+    nandroid_queue_close(&x->jobs);
+    for (i = 0; i < started; i++)
+        pthread_join(writers[i], NULL);
+    if (x->error)
+        ret = -1;
+
+    // every file is in place now, link them
+    for (i = 0; i < x->link_count; i++) {
+        struct tar_deferred *l = &x->links[i];
+        if (ret == 0 && !(x->differential && tar_same_inode(l->path, l->link))) {
+            unlink(l->path);
+            if (link(l->link, l->path) != 0) {
+                LOGE("Unable to link %s to %s: %s\n", l->path, l->link, strerror(errno));
+                ret = -1;
+            }
+        }
+        free(l->path);
+        free(l->link);
+    }
+
+    if (ret == 0 && prune != NULL)
+        tar_prune(x, prune, exclude, 1);
+
+    // parents come before their children in the archive, so going
+    // backwards finishes each directory after everything inside it
+    for (i = x->dir_count - 1; i >= 0; i--) {
+        struct tar_deferred *d = &x->dirs[i];
+        if (ret == 0) {
+            chown(d->path, d->meta.uid, d->meta.gid);
+            chmod(d->path, d->meta.mode & 07777);
+            tar_set_times(-1, d->path, d->meta.mtime);
+        }
+        free(d->path);
+    }
+
+    free(x->links);
+    free(x->dirs);
+    pthread_mutex_destroy(&x->lock);
+    nandroid_queue_destroy(&x->jobs);
+    return ret;
+}
+
+int tar_extract_stream(tar_read_func read_func, void* in, const char* dir, tar_callback callback, void* cookie) {
+    struct tar_extractor x;
+    memset(&x, 0, sizeof(x));
+    x.read_func = read_func;
+    x.in = in;
+    return tar_extract_common(&x, dir, NULL, NULL, callback, cookie);
+}
+
+int tar_scan_stream(tar_read_func read_func, void* in, tar_scan_func scan, void* cookie) {
+    struct tar_extractor x;
+    memset(&x, 0, sizeof(x));
+    x.read_func = read_func;
+    x.in = in;
+    x.scan = scan;
+    x.scan_cookie = cookie;
+    return extract_archive(&x, NULL, NULL, NULL);
+}
+
+static int tar_index_digests(const char *index, struct tar_name_set *set);
+
+int tar_update_stream(tar_read_func read_func, void* in, const char* dir, const char* path, const char* exclude, const char* index, tar_callback callback, void* cookie) {
+    struct tar_extractor x;
+    memset(&x, 0, sizeof(x));
+    x.read_func = read_func;
+    x.in = in;
+    x.differential = 1;
+    int ret = 0;
+    // without the digests every file is compared with the archive
+    if (index != NULL && tar_index_digests(index, &x.digests) != 0)
+        ret = -1;
+    if (ret == 0)
+        ret = tar_extract_common(&x, dir, path, exclude, callback, cookie);
+    tar_name_free(&x.names);
+    tar_name_free(&x.digests);
+    return ret;
+}
+
+// Archive index, one line per entry in archive order:
+//   <offset> <size> <mode> <uid> <gid> <md5|-> <name>
+// offset is where the entry's first header block starts in the (uncompressed)
+// archive, mode is the octal st_mode and the md5 covers regular file data.
+// Entries below a directory follow it directly, so every subtree is one
+// contiguous range of the archive.
+
+struct tar_index_entry {
+    uint64_t offset;
+    uint64_t size;
+    unsigned int mode;
+    char md5[MD5_DIGEST_LENGTH * 2 + 1];
+    char *name;
+};
+
+static FILE* tar_index_open(const char *index) {
+    char line[64];
+    FILE *f = fopen(index, "r");
+    if (f == NULL)
+        return NULL;
+    if (fgets(line, sizeof(line), f) == NULL || strncmp(line, TAR_INDEX_MAGIC, strlen(TAR_INDEX_MAGIC)) != 0) {
+        LOGE("%s is not an archive index\n", index);
+        fclose(f);
+        return NULL;
+    }
+    return f;
+}
+
+// Returns 1 for the next entry, 0 at the end of the index. Names of
+// directories lose their trailing slash.
+static int tar_index_next(FILE *f, char *line, size_t len, struct tar_index_entry *e) {
+    while (fgets(line, len, f) != NULL) {
+        unsigned long long offset, size;
+        unsigned int uid, gid;
+        int pos = 0;
+        size_t n = strlen(line);
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '/'))
+            line[--n] = '\0';
+        if (sscanf(line, "%llu %llu %o %u %u %32s %n", &offset, &size, &e->mode, &uid, &gid, e->md5, &pos) < 6 || pos == 0)
+            continue;
+        e->offset = offset;
+        e->size = size;
+        e->name = line + pos;
+        return 1;
+    }
+    return 0;
+}
+
+// 'name' itself or anything below it.
+static int tar_index_match(const char *entry, const char *name) {
+    size_t len = strlen(name);
+    return strncmp(entry, name, len) == 0 && (entry[len] == '\0' || entry[len] == '/');
+}
+
+int tar_index_range(const char* index, const char* name, uint64_t* start, uint64_t* end) {
+    char line[PATH_MAX + 128];
+    struct tar_index_entry e;
+    FILE *f = tar_index_open(index);
+    if (f == NULL)
+        return -1;
+    int found = 0;
+    *end = UINT64_MAX;
+    while (tar_index_next(f, line, sizeof(line), &e)) {
+        if (tar_index_match(e.name, name)) {
+            if (!found)
+                *start = e.offset;
+            found = 1;
+        }
+        else if (found) {
+            *end = e.offset;
+            break;
+        }
+    }
+    fclose(f);
+    return found ? 0 : -1;
+}
+
+char** tar_index_children(const char* index, const char* name) {
+    char line[PATH_MAX + 128];
+    struct tar_index_entry e;
+    FILE *f = tar_index_open(index);
+    if (f == NULL)
+        return NULL;
+    size_t len = strlen(name);
+    int count = 0, alloc = 16;
+    char **children = (char**) malloc(alloc * sizeof(char*));
+    while (children != NULL && tar_index_next(f, line, sizeof(line), &e)) {
+        if (!tar_index_match(e.name, name) || e.name[len] == '\0' || strchr(e.name + len + 1, '/') != NULL)
+            continue;
+        if (count + 1 == alloc) {
+            alloc *= 2;
+            char **tmp = (char**) realloc(children, alloc * sizeof(char*));
+            if (tmp == NULL)
+                break;
+            children = tmp;
+        }
+        if ((children[count] = strdup(e.name + len + 1)) != NULL)
+            count++;
+    }
+    if (children != NULL)
+        children[count] = NULL;
+    fclose(f);
+    return children;
+}
+
+int tar_index_size(const char* index, uint64_t* bytes, uint64_t* entries) {
+    char line[PATH_MAX + 128];
+    struct tar_index_entry e;
+    FILE *f = tar_index_open(index);
+    if (f == NULL)
+        return -1;
+    *bytes = 0;
+    *entries = 0;
+    while (tar_index_next(f, line, sizeof(line), &e)) {
+        *bytes += e.size;
+        (*entries)++;
+    }
+    fclose(f);
+    return 0;
+}
+
+// The md5 of every regular file in 'index', by entry name. An index that
+// does not exist leaves the set empty.
+static int tar_index_digests(const char *index, struct tar_name_set *set) {
+    char line[PATH_MAX + 128];
+    struct tar_index_entry e;
+    FILE *f = tar_index_open(index);
+    if (f == NULL)
+        return 0;
+    int ret = 0;
+    while (ret == 0 && tar_index_next(f, line, sizeof(line), &e)) {
+        if (strcmp(e.md5, "-") == 0)
+            continue;
+        struct tar_name *n = tar_name_add(set, e.name);
+        if (n == NULL || (n->digest = strdup(e.md5)) == NULL)
+            ret = -1;
+    }
+    fclose(f);
+    return ret;
+}
+
+static int tar_md5_file(const char *path, char *hex) {
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    char buf[TAR_CHUNK_SIZE / 4];
+    MD5_CTX md5;
+    int i, fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    MD5_Init(&md5);
+    ssize_t r;
+    while ((r = read(fd, buf, sizeof(buf))) > 0)
+        MD5_Update(&md5, buf, r);
+    close(fd);
+    if (r < 0)
+        return -1;
+    MD5_Final(digest, &md5);
+    for (i = 0; i < MD5_DIGEST_LENGTH; i++)
+        sprintf(hex + i * 2, "%02x", digest[i]);
+    return 0;
+}
+
+int tar_index_verify(const char* index, const char* name, const char* dir) {
+    char line[PATH_MAX + 128];
+    char hex[MD5_DIGEST_LENGTH * 2 + 1];
+    struct tar_index_entry e;
+    FILE *f = tar_index_open(index);
+    if (f == NULL)
+        return -1;
+    int bad = 0, found = 0;
+    while (tar_index_next(f, line, sizeof(line), &e)) {
+        if (!tar_index_match(e.name, name)) {
+            if (found)
+                break;
+            continue;
+        }
+        found = 1;
+        if (strcmp(e.md5, "-") == 0)
+            continue;
+        char *path = tar_join(dir, e.name);
+        if (path == NULL || tar_md5_file(path, hex) != 0 || strcmp(hex, e.md5) != 0) {
+            LOGE("MD5 mismatch on %s\n", path != NULL ? path : e.name);
+            bad++;
+        }
+        free(path);
+    }
+    fclose(f);
+    return bad;
+}
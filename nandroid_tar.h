@@ -0,0 +1,74 @@
+#ifndef NANDROID_TAR_H
+#define NANDROID_TAR_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Called once per archived entry, after its last byte has been written.
+// bytes is the running total of archive bytes written so far.
+typedef void (*tar_callback)(const char* name, uint64_t bytes, void* cookie);
+
+// Output sink for the archive. Returns 0 if all of 'len' was written.
+typedef int (*tar_write_func)(void* cookie, const void* data, size_t len);
+
+// Write a GNU tar archive of the directory 'path' to 'archive'. Entry names
+// are relative to the parent of 'path', the same as running
+// "cd $(dirname path) ; tar cf archive $(basename path)". 'exclude', if not
+// NULL, names a top level child of 'path' that is left out (eg. "media").
+// Returns 0 on success.
+int tar_create(const char* archive, const char* path, const char* exclude, tar_callback callback, void* cookie);
+
+// Same as tar_create, but hands the archive to 'write_func' instead of a file.
+// 'index', if not NULL, is written with the offset, size, owner, mode and
+// md5 of every entry (see tar_index_range).
+int tar_create_stream(tar_write_func write_func, void* out, const char* path, const char* exclude, const char* index, tar_callback callback, void* cookie);
+
+// Input source for the archive. Returns the number of bytes read, 0 at the
+// end of the archive, -1 on error.
+typedef ssize_t (*tar_read_func)(void* cookie, void* data, size_t len);
+
+// Extract the archive read from 'read_func' into 'dir', the same as running
+// "cd dir ; tar xf -". Regular files are written by a pool of threads, large
+// ones are preallocated. Owner, mode and times of directories are applied
+// once everything below them is in place. 'callback' gets the archive bytes
+// read so far. Returns 0 on success.
+int tar_extract_stream(tar_read_func read_func, void* in, const char* dir, tar_callback callback, void* cookie);
+
+// Differential version of tar_extract_stream for a 'path' that still holds
+// an older copy of the archive. Files whose size and mtime match are left
+// alone if their md5 matches 'index' (see tar_create_stream), other files
+// are compared with the archive and only get the chunks rewritten that
+// differ, files with more than one link are replaced, and anything below
+// 'path' that is not in the archive is removed, except for 'exclude' and
+// lost+found at the top level. 'index' may be NULL or missing, for
+// archives made without one. Returns 0 on success.
+int tar_update_stream(tar_read_func read_func, void* in, const char* dir, const char* path, const char* exclude, const char* index, tar_callback callback, void* cookie);
+
+// Called for every entry of a scanned archive. 'mode' includes the file
+// type bits, 'digest' is the md5 of a regular file, the target of a link,
+// or "-".
+typedef void (*tar_scan_func)(const char* name, unsigned int mode, uint64_t size, const char* digest, void* cookie);
+
+// Reads the archive once without extracting anything. Returns 0 if it was
+// read intact.
+int tar_scan_stream(tar_read_func read_func, void* in, tar_scan_func scan, void* cookie);
+
+// Looks up 'name', an entry name like "data/data/com.foo", in an index
+// written by tar_create_stream. [start, end) is the part of the
+// uncompressed archive that holds it and everything below it; end is
+// UINT64_MAX if that runs to the end of the archive. Returns 0 if found.
+int tar_index_range(const char* index, const char* name, uint64_t* start, uint64_t* end);
+
+// NULL terminated list of the entries directly below 'name', or NULL.
+// The caller frees the strings and the list.
+char** tar_index_children(const char* index, const char* name);
+
+// Adds up the sizes and the number of all entries in the index, ie. what
+// the archive unpacks to. Returns 0 if the index could be read.
+int tar_index_size(const char* index, uint64_t* bytes, uint64_t* entries);
+
+// Compares the files below 'name', as extracted into 'dir', with the
+// digests in the index. Returns the number of mismatches, -1 on error.
+int tar_index_verify(const char* index, const char* name, const char* dir);
+
+#endif
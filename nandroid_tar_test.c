@@ -0,0 +1,208 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "nandroid_tar.h"
+
+// Differential restores of archives made by tar_create_stream, into a
+// scratch directory that stands in for the root of the device.
+
+#define SOURCE_MTIME    1000000000
+
+void ui_print(const char* fmt, ...) {
+    char buf[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, 256, fmt, ap);
+    va_end(ap);
+
+    fputs(buf, stderr);
+}
+
+static int fd_write(void* cookie, const void* data, size_t len) {
+    return write(*(int*)cookie, data, len) == (ssize_t)len ? 0 : -1;
+}
+
+static ssize_t fd_read(void* cookie, void* data, size_t len) {
+    return read(*(int*)cookie, data, len);
+}
+
+struct range {
+    int fd;
+    uint64_t remaining;
+};
+
+static ssize_t range_read(void* cookie, void* data, size_t len) {
+    struct range* r = (struct range*)cookie;
+    if (len > r->remaining)
+        len = r->remaining;
+    ssize_t got = len > 0 ? read(r->fd, data, len) : 0;
+    if (got > 0)
+        r->remaining -= got;
+    return got;
+}
+
+static int write_file(const char* dir, const char* name, const char* data) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE* f = fopen(path, "w");
+    if (f == NULL)
+        return -1;
+    fputs(data, f);
+    return fclose(f);
+}
+
+static int file_is(const char* dir, const char* name, const char* data) {
+    char path[PATH_MAX];
+    char buf[256];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "%s is missing\n", path);
+        return 0;
+    }
+    size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[len] = '\0';
+    if (strcmp(buf, data) != 0) {
+        fprintf(stderr, "%s holds \"%s\"\n", path, buf);
+        return 0;
+    }
+    return 1;
+}
+
+static int is_gone(const char* dir, const char* name) {
+    char path[PATH_MAX];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if (lstat(path, &st) == 0) {
+        fprintf(stderr, "%s was not removed\n", path);
+        return 0;
+    }
+    return 1;
+}
+
+// Restores data.tar over an older copy of /data. nandroid passes the parent
+// of the mount point, "/", as the directory to extract into. The old 'a'
+// has the size and mtime of the new one, only its md5 tells them apart.
+static int test_mount_point_under_root(const char* scratch, const char* archive, const char* index) {
+    char root[PATH_MAX], data[PATH_MAX], sub[PATH_MAX];
+    snprintf(root, sizeof(root), "%s/root/", scratch);
+    snprintf(data, sizeof(data), "%s/root/data", scratch);
+    snprintf(sub, sizeof(sub), "%s/root/data/sub", scratch);
+    mkdir(root, 0755);
+    mkdir(data, 0755);
+    mkdir(sub, 0755);
+    if (write_file(data, "a", "old a") != 0 || write_file(data, "stale", "stale") != 0)
+        return -1;
+    char path[PATH_MAX];
+    struct timeval tv[2];
+    tv[0].tv_sec = tv[1].tv_sec = SOURCE_MTIME;
+    tv[0].tv_usec = tv[1].tv_usec = 0;
+    snprintf(path, sizeof(path), "%s/a", data);
+    utimes(path, tv);
+
+    int fd = open(archive, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    int ret = tar_update_stream(fd_read, &fd, root, data, NULL, index, NULL, NULL);
+    close(fd);
+    if (ret != 0) {
+        fprintf(stderr, "tar_update_stream returned %d\n", ret);
+        return -1;
+    }
+    if (!file_is(data, "a", "new a") || !file_is(sub, "b", "b") || !is_gone(data, "stale"))
+        return -1;
+    return 0;
+}
+
+// Restores only data/sub, the way nandroid_restore_path does an app: the
+// index gives the range of the archive, and the rest of /data stays.
+static int test_subtree(const char* scratch, const char* archive, const char* index) {
+    char root[PATH_MAX], data[PATH_MAX], sub[PATH_MAX], deep[PATH_MAX];
+    snprintf(root, sizeof(root), "%s/root/", scratch);
+    snprintf(data, sizeof(data), "%s/root/data", scratch);
+    snprintf(sub, sizeof(sub), "%s/root/data/sub", scratch);
+    snprintf(deep, sizeof(deep), "%s/root/data/sub/deep", scratch);
+    mkdir(deep, 0755);
+    if (write_file(sub, "b", "changed") != 0 || write_file(sub, "stale", "stale") != 0 ||
+            write_file(deep, "c", "old c") != 0 || write_file(data, "keep", "keep") != 0)
+        return -1;
+
+    uint64_t start, end;
+    if (tar_index_range(index, "data/sub", &start, &end) != 0) {
+        fprintf(stderr, "data/sub is not in %s\n", index);
+        return -1;
+    }
+    int fd = open(archive, O_RDONLY);
+    if (fd < 0 || lseek(fd, start, SEEK_SET) != (off_t)start)
+        return -1;
+    struct range r;
+    r.fd = fd;
+    r.remaining = end - start;
+    int ret = tar_update_stream(range_read, &r, root, sub, NULL, index, NULL, NULL);
+    close(fd);
+    if (ret != 0) {
+        fprintf(stderr, "tar_update_stream returned %d\n", ret);
+        return -1;
+    }
+    if (!file_is(sub, "b", "b") || !file_is(deep, "c", "c") || !is_gone(sub, "stale") ||
+            !file_is(data, "keep", "keep"))
+        return -1;
+    int bad = tar_index_verify(index, "data/sub", root);
+    if (bad != 0) {
+        fprintf(stderr, "tar_index_verify returned %d\n", bad);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <scratch directory>\n", argv[0]);
+        return 2;
+    }
+    const char* scratch = argv[1];
+    char src[PATH_MAX], data[PATH_MAX], sub[PATH_MAX], deep[PATH_MAX], archive[PATH_MAX], index[PATH_MAX];
+    snprintf(src, sizeof(src), "%s/src", scratch);
+    snprintf(data, sizeof(data), "%s/src/data", scratch);
+    snprintf(sub, sizeof(sub), "%s/src/data/sub", scratch);
+    snprintf(deep, sizeof(deep), "%s/src/data/sub/deep", scratch);
+    snprintf(archive, sizeof(archive), "%s/data.tar", scratch);
+    snprintf(index, sizeof(index), "%s/data.tar.idx", scratch);
+    mkdir(src, 0755);
+    mkdir(data, 0755);
+    mkdir(sub, 0755);
+    mkdir(deep, 0755);
+    if (write_file(data, "a", "new a") != 0 || write_file(sub, "b", "b") != 0 || write_file(deep, "c", "c") != 0) {
+        fprintf(stderr, "Unable to set up %s: %s\n", scratch, strerror(errno));
+        return 3;
+    }
+    char path[PATH_MAX];
+    struct timeval tv[2];
+    tv[0].tv_sec = tv[1].tv_sec = SOURCE_MTIME;
+    tv[0].tv_usec = tv[1].tv_usec = 0;
+    snprintf(path, sizeof(path), "%s/a", data);
+    utimes(path, tv);
+
+    int fd = open(archive, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || tar_create_stream(fd_write, &fd, data, NULL, index, NULL, NULL) != 0 || close(fd) != 0) {
+        fprintf(stderr, "Unable to create %s\n", archive);
+        return 3;
+    }
+
+    if (test_mount_point_under_root(scratch, archive, index) != 0 || test_subtree(scratch, archive, index) != 0) {
+        printf("FAILURE\n");
+        return 1;
+    }
+    printf("SUCCESS\n");
+    return 0;
+}
@@ -680,6 +680,7 @@ wipe_data(int confirm) {
     }
 
     ui_print("\nWiping data...\n");
+    performance_profile_begin();
     device_wipe_data();
     erase_volume("/data");
     erase_volume("/cache");
@@ -689,6 +690,7 @@ wipe_data(int confirm) {
     // Midnight: skip sd-ext on stock Samsung ROM
     //erase_volume("/sd-ext");
     erase_volume("/sdcard/.android_secure");
+    performance_profile_end();
     ui_print("Data wipe complete.\n");
 }
 
@@ -715,6 +717,8 @@ void backup_menu(){
                             "Nandroid backup DATA",
                             "Backup start/shutdown sounds",
                             "Backup /data/app tp SDCARD",
+                            "Nandroid backup format...",
+                            "Resume interrupted backup",
                             NULL
     };
     
@@ -774,6 +778,12 @@ void backup_menu(){
             }
             break;
           }
+          case 5:
+                show_nandroid_backup_format_menu();
+                break;
+          case 6:
+                nandroid_resume_backup();
+                break;
         }
     }
 }
@@ -792,6 +802,8 @@ void restore_menu(){
                             "Nandroid restore selected file",
                             "Restore start/shutdown sounds",
                             "Restore /data/app from SDCARD",
+                            "Nandroid restore mode...",
+                            "Nandroid restore app data...",
                             NULL
     };
     
@@ -851,6 +863,12 @@ void restore_menu(){
                 }
                 break;
               }
+              case 6:
+                show_nandroid_restore_mode_menu();
+                break;
+              case 7:
+                show_nandroid_restore_app_menu();
+                break;
         }
     }
 }
@@ -1335,6 +1353,8 @@ main(int argc, char **argv) {
 	        return unyaffs_main(argc, argv);           
         if (strstr(argv[0], "nandroid"))
             return nandroid_main(argc, argv);                                
+        if (strstr(argv[0], "dedupe"))
+            return dedupe_main(argc, argv);
         if (strstr(argv[0], "reboot"))
             return reboot_main(argc, argv);
         if (strstr(argv[0], "mount") && !strstr(argv[0], "umount"))